@@ -0,0 +1,57 @@
+import subprocess
+import re
+import itertools
+
+qualities = ['low', 'medium', 'high']
+flags = [[], ['--bvh-compact'], ['--bvh-robust'], ['--flat-bvh'], ['--compact-attributes'], ['--no-reorder'], ['--generic-traversal'], ['--flat-bvh', '--generic-traversal']]
+scenes = ['./assets/sponza.glb', './assets/minecraft.glb']
+renderers = ['-m', '-w']
+depth, samples = 10, 128
+
+with open('benchmark_bvh.csv', 'w') as f:
+    f.write("renderer,quality,flags,scene,build_time,bvh_mib,time,rays_per_sec\n")
+
+combinations = itertools.product(scenes, qualities, flags, renderers)
+for (scene, quality, flag, renderer) in combinations:
+    print(f"Running benchmark for {renderer} with {quality} quality BVHs {flag}")
+
+    build_time_total = 0
+    bvh_mib_total = 0
+    time_total = 0
+    rays_per_sec_total = 0
+
+    for i in range(6):
+        print(f"Iteration {i}")
+        output = subprocess.check_output([
+            "./build/raytracer",
+            renderer,
+            "-d", str(depth),
+            "-s", str(samples),
+            "--build-quality", quality,
+            *flag,
+            scene
+        ])
+        if i == 0:
+            continue
+
+        output = output.decode("utf-8")
+
+        m = re.search(r'BVH build .* in (\d+\.\d+)s, (\d+\.\d+) MiB', output)
+        build_time = float(m.group(1))
+        bvh_mib = float(m.group(2))
+
+        m = re.search(r'Rays/sec: (\d+\.\d+)M', output)
+        rays_per_sec = float(m.group(1))
+
+        m = re.search(r'Time measured: (\d+\.\d+) seconds', output)
+        time = float(m.group(1))
+
+        print(f"({renderer}, {build_time}, {bvh_mib}, {time}, {rays_per_sec})")
+
+        build_time_total += build_time
+        bvh_mib_total += bvh_mib
+        time_total += time
+        rays_per_sec_total += rays_per_sec
+
+    with open('benchmark_bvh.csv', 'a') as f:
+        f.write(f"{renderer},{quality},{' '.join(flag)},{scene},{build_time_total/5},{bvh_mib_total/5},{time_total/5},{rays_per_sec_total/5}\n")
@@ -0,0 +1,124 @@
+import subprocess
+import re
+import itertools
+import shutil
+import struct
+import zlib
+import math
+
+sequences = ['random', 'sobol']
+flags = [[], ['--no-nee'], ['--radiance-cache', '3'], ['--guiding']]
+sample_counts = [4, 8, 16, 32, 64, 128]
+scenes = ['./assets/sponza.glb', './assets/minecraft.glb']
+renderers = ['-m', '-w']
+depth, reference_samples = 10, 4096
+resolution = '960x540'
+
+# Reads the RGB channels of the 8 bit RGBA PNGs written by the ray tracer
+def read_png(path):
+    with open(path, 'rb') as f:
+        data = f.read()
+    pos, idat = 8, b''
+    while pos < len(data):
+        length, kind = struct.unpack('>I4s', data[pos:pos + 8])
+        chunk = data[pos + 8:pos + 8 + length]
+        if kind == b'IHDR':
+            width, height = struct.unpack('>II', chunk[:8])
+        elif kind == b'IDAT':
+            idat += chunk
+        pos += 12 + length
+
+    raw = zlib.decompress(idat)
+    stride = width * 4
+    pixels = bytearray(stride * height)
+    prev = bytearray(stride)
+    for y in range(height):
+        filter_type = raw[y * (stride + 1)]
+        row = bytearray(raw[y * (stride + 1) + 1:(y + 1) * (stride + 1)])
+        for x in range(stride):
+            a = row[x - 4] if x >= 4 else 0
+            b = prev[x]
+            c = prev[x - 4] if x >= 4 else 0
+            if filter_type == 1:
+                row[x] = (row[x] + a) & 0xff
+            elif filter_type == 2:
+                row[x] = (row[x] + b) & 0xff
+            elif filter_type == 3:
+                row[x] = (row[x] + (a + b) // 2) & 0xff
+            elif filter_type == 4:
+                p = a + b - c
+                pa, pb, pc = abs(p - a), abs(p - b), abs(p - c)
+                pred = a if pa <= pb and pa <= pc else (b if pb <= pc else c)
+                row[x] = (row[x] + pred) & 0xff
+        pixels[y * stride:(y + 1) * stride] = row
+        prev = row
+    return [v for i, v in enumerate(pixels) if i % 4 != 3]
+
+def rmse(image, reference):
+    total = sum((a - b) * (a - b) for a, b in zip(image, reference))
+    return math.sqrt(total / len(reference)) / 255.0
+
+# Error of the runs of a configuration, (time, rmse) pairs, interpolated at `time` in
+# log-log space. None outside the times the configuration was run for.
+def error_at(runs, time):
+    runs = sorted(runs)
+    for (t0, e0), (t1, e1) in zip(runs, runs[1:]):
+        if t0 <= time <= t1 and t0 < t1 and e0 > 0 and e1 > 0:
+            a = (math.log(time) - math.log(t0)) / (math.log(t1) - math.log(t0))
+            return math.exp(math.log(e0) + a * (math.log(e1) - math.log(e0)))
+    return None
+
+def render(renderer, sequence, flag, samples, scene):
+    output = subprocess.check_output([
+        "./build/raytracer",
+        renderer,
+        "-d", str(depth),
+        "-s", str(samples),
+        "--sequence", sequence,
+        "--resolution", resolution,
+        *flag,
+        scene
+    ]).decode("utf-8")
+    m = re.search(r'Time measured: (\d+\.\d+) seconds', output)
+    time = float(m.group(1))
+    m = re.search(r'Total rays: (\d+)', output)
+    return time, int(m.group(1))
+
+# (renderer, sequence, scene) -> flags -> [(time, rmse)]
+results = {}
+
+with open('benchmark_sampling.csv', 'w') as f:
+    f.write("renderer,sequence,flags,samples,scene,time,rays,rmse\n")
+
+for scene in scenes:
+    print(f"Rendering reference for {scene} with {reference_samples} samples")
+    render('-m', 'random', [], reference_samples, scene)
+    shutil.copy('out.png', 'reference.png')
+    reference = read_png('reference.png')
+
+    combinations = itertools.product(renderers, sequences, flags, sample_counts)
+    for (renderer, sequence, flag, samples) in combinations:
+        print(f"Running {renderer} with {sequence} sequence {flag} and {samples} samples")
+
+        # First run warms up the JIT and the scene cache
+        render(renderer, sequence, flag, samples, scene)
+        time, rays = render(renderer, sequence, flag, samples, scene)
+        error = rmse(read_png('out.png'), reference)
+
+        print(f"({renderer}, {sequence}, {flag}, {samples}, {time}, {rays}, {error})")
+
+        with open('benchmark_sampling.csv', 'a') as f:
+            f.write(f"{renderer},{sequence},{' '.join(flag)},{samples},{scene},{time},{rays},{error}\n")
+
+        runs = results.setdefault((renderer, sequence, scene), {})
+        runs.setdefault(' '.join(flag), []).append((time, error))
+
+print("Error at the time of each default run, against each option:")
+for (renderer, sequence, scene), runs in results.items():
+    for flag, flag_runs in runs.items():
+        if flag == '':
+            continue
+        for time, error in sorted(runs['']):
+            other = error_at(flag_runs, time)
+            if other is not None:
+                print(f"{scene} {renderer} {sequence} {time:.3f}s: {error:.5f} -> {other:.5f} with {flag}")
@@ -0,0 +1,219 @@
+#include "adaptive_sampling.hpp"
+
+#include <vector>
+
+using namespace raytracer;
+
+using sycl::float3;
+using sycl::range;
+
+AdaptiveSampler::AdaptiveSampler(
+    App &app, sycl::range<2> img_size, const RenderSettings &settings
+)
+    : settings(settings) {
+    this->resize(img_size);
+
+    this->even_accumulation = (float *)sycl::aligned_alloc_device(
+        alignof(sycl::float4), sizeof(sycl::float4) * img_size.size(), app.queue
+    );
+    this->pixel_samples = (uint32_t *)sycl::aligned_alloc_device(
+        alignof(uint32_t), sizeof(uint32_t) * img_size.size(), app.queue
+    );
+    this->active_pixels = (uint32_t *)sycl::aligned_alloc_device(
+        alignof(uint32_t), sizeof(uint32_t) * img_size.size(), app.queue
+    );
+    this->active_pixel_count = (uint32_t *)sycl::aligned_alloc_shared(
+        alignof(uint32_t), sizeof(uint32_t), app.queue
+    );
+}
+
+void AdaptiveSampler::resize(sycl::range<2> img_size) {
+    this->img_size = img_size;
+    this->tile_count = {
+        (img_size[0] + ADAPTIVE_TILE_SIZE - 1) / ADAPTIVE_TILE_SIZE,
+        (img_size[1] + ADAPTIVE_TILE_SIZE - 1) / ADAPTIVE_TILE_SIZE,
+    };
+}
+
+uint32_t AdaptiveSampler::max_pixel_samples() const {
+    if (!this->enabled()) {
+        return settings.sample_count;
+    }
+    if (settings.max_samples > 0) {
+        return settings.max_samples;
+    }
+    return settings.sample_count * 4;
+}
+
+// Rebuilds `active_pixels` from the tiles that did not converge yet. With `force`, every
+// tile is kept.
+static void compact_active_tiles(
+    sycl::queue &queue, AdaptiveSampler &sampler, const float *accumulation, bool force
+) {
+    queue.memset(sampler.active_pixel_count, 0, sizeof(uint32_t));
+
+    queue.submit([&](sycl::handler &cgh) {
+        // Group size / range, one group per tile
+        range<2> local_size{ADAPTIVE_TILE_SIZE, ADAPTIVE_TILE_SIZE};
+        sycl::nd_range<2> for_range(sampler.tile_count * local_size, local_size);
+
+        // Params
+        const auto img_size = sampler.img_size;
+        const float threshold = sampler.settings.noise_threshold;
+        const uint32_t min_samples = std::max(sampler.settings.min_samples, 2u);
+        const uint32_t max_samples = sampler.max_pixel_samples();
+        const float *even_accumulation = sampler.even_accumulation;
+        const uint32_t *pixel_samples = sampler.pixel_samples;
+        uint32_t *active_pixels = sampler.active_pixels;
+        uint32_t *active_pixel_count = sampler.active_pixel_count;
+
+        cgh.parallel_for(for_range, [=](sycl::nd_item<2> id) {
+            auto global_id = id.get_global_id();
+            auto group = id.get_group();
+            bool in_bounds = global_id[0] < img_size[0] && global_id[1] < img_size[1];
+            uint32_t pixel = global_id[0] + global_id[1] * img_size[0];
+
+            uint32_t samples = in_bounds ? pixel_samples[pixel] : 0;
+            float error = 0.0f;
+            if (in_bounds && !force && samples > 1) {
+                uint32_t even_samples = (samples + 1) / 2;
+                float3 mean = float3(
+                                  accumulation[pixel * 4 + 0],
+                                  accumulation[pixel * 4 + 1],
+                                  accumulation[pixel * 4 + 2]
+                              ) /
+                              (float)samples;
+                float3 even_mean = float3(
+                                       even_accumulation[pixel * 4 + 0],
+                                       even_accumulation[pixel * 4 + 1],
+                                       even_accumulation[pixel * 4 + 2]
+                                   ) /
+                                   (float)even_samples;
+                float3 diff = sycl::fabs(mean - even_mean);
+                error = (diff.x() + diff.y() + diff.z()) /
+                        sycl::sqrt(mean.x() + mean.y() + mean.z() + 1e-4f);
+            }
+
+            // Every pixel of an active tile took the same number of samples
+            uint32_t tile_samples =
+                sycl::reduce_over_group(group, samples, sycl::maximum<uint32_t>());
+            uint32_t tile_pixels = sycl::reduce_over_group(
+                group, in_bounds ? 1u : 0u, sycl::plus<uint32_t>()
+            );
+            float tile_error =
+                sycl::reduce_over_group(group, error, sycl::plus<float>()) /
+                (float)tile_pixels;
+
+            bool converged = tile_samples >= max_samples ||
+                             (tile_samples >= min_samples && tile_error < threshold);
+            bool active = force || !converged;
+            if (!active) {
+                return;
+            }
+
+            uint32_t first = 0;
+            if (group.leader()) {
+                sycl::atomic_ref<
+                    uint32_t,
+                    sycl::memory_order_relaxed,
+                    sycl::memory_scope_device,
+                    sycl::access::address_space::global_space>
+                    active_pixel_count_ref(*active_pixel_count);
+                first = active_pixel_count_ref.fetch_add(tile_pixels);
+            }
+            first = sycl::group_broadcast(group, first);
+
+            uint32_t index = sycl::exclusive_scan_over_group(
+                group, in_bounds ? 1u : 0u, sycl::plus<uint32_t>()
+            );
+            if (in_bounds) {
+                active_pixels[first + index] = pixel;
+            }
+        });
+    });
+}
+
+void AdaptiveSampler::reset(sycl::queue &queue) {
+    queue.memset(this->pixel_samples, 0, sizeof(uint32_t) * img_size.size());
+    queue.memset(this->even_accumulation, 0, sizeof(sycl::float4) * img_size.size());
+    compact_active_tiles(queue, *this, nullptr, true);
+    queue.wait();
+
+    this->samples_taken = 0;
+    this->samples_spent = 0;
+}
+
+uint32_t AdaptiveSampler::next_pass_samples() const {
+    const uint32_t max_samples = this->max_pixel_samples();
+    const uint64_t budget = (uint64_t)settings.sample_count * img_size.size();
+    if (this->samples_taken >= max_samples || *this->active_pixel_count == 0 ||
+        this->samples_spent >= budget) {
+        return 0;
+    }
+
+    uint32_t samples = max_samples;
+    if (this->enabled()) {
+        samples = this->samples_taken == 0 ? std::max(settings.min_samples, 2u)
+                                           : ADAPTIVE_PASS_SAMPLES;
+    }
+    return std::min(samples, max_samples - this->samples_taken);
+}
+
+void AdaptiveSampler::finish_pass(
+    sycl::queue &queue, uint32_t samples, const float *accumulation
+) {
+    this->samples_taken += samples;
+    this->samples_spent += (uint64_t)*this->active_pixel_count * samples;
+
+    if (this->next_pass_samples() == 0) {
+        return;
+    }
+
+    compact_active_tiles(queue, *this, accumulation, false);
+    queue.wait();
+
+    if (this->enabled()) {
+        fmt::println(
+            "\tPass done after {} samples, {} pixels still active",
+            this->samples_taken,
+            *this->active_pixel_count
+        );
+    }
+}
+
+void AdaptiveSampler::print_histogram(sycl::queue &queue) const {
+    if (!this->enabled()) return;
+
+    std::vector<uint32_t> samples(img_size.size());
+    queue.memcpy(samples.data(), this->pixel_samples, sizeof(uint32_t) * samples.size())
+        .wait();
+
+    // Bucket i holds the pixels with [2^i, 2^(i+1)) samples
+    std::vector<uint64_t> buckets;
+    uint64_t total = 0;
+    for (uint32_t count : samples) {
+        size_t bucket = 0;
+        while ((2u << bucket) <= count) {
+            bucket++;
+        }
+        if (bucket >= buckets.size()) {
+            buckets.resize(bucket + 1, 0);
+        }
+        buckets[bucket]++;
+        total += count;
+    }
+
+    fmt::println(
+        "Effective samples per pixel: {:.2f}", (double)total / (double)samples.size()
+    );
+    for (size_t bucket = 0; bucket < buckets.size(); ++bucket) {
+        if (buckets[bucket] == 0) continue;
+        fmt::println(
+            "\tspp {}-{}: {} pixels ({:.1f}%)",
+            1u << bucket,
+            (2u << bucket) - 1,
+            buckets[bucket],
+            100.0 * (double)buckets[bucket] / (double)samples.size()
+        );
+    }
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "render.hpp"
+
+namespace raytracer {
+
+// Pixels are sampled in square tiles of this size. A tile keeps or stops sampling as
+// a whole.
+constexpr uint32_t ADAPTIVE_TILE_SIZE = 8;
+
+// Samples taken by the active tiles in every pass after the first one.
+constexpr uint32_t ADAPTIVE_PASS_SAMPLES = 4;
+
+// Decides which pixels keep taking samples. Besides the sum of all samples of a pixel,
+// renderers accumulate the sum of its even samples. The difference between the two
+// means estimates the error of the pixel, and its average over a tile decides whether
+// the tile converged (Dammertz et al., "A Hierarchical Automatic Stopping Condition
+// for Monte Carlo Global Illumination").
+//
+// Frames are rendered in passes. Every pass takes the same number of samples for all
+// pixels of `active_pixels`, then `update` estimates the error of the active tiles and
+// rebuilds the list. Without a noise threshold there is a single pass of
+// `sample_count` samples over every pixel.
+struct AdaptiveSampler {
+    // Size of the current frame, at most the size the buffers were allocated for
+    sycl::range<2> img_size;
+    sycl::range<2> tile_count;
+    const RenderSettings settings;
+
+    // Per pixel RGBA sums of the samples with an even index
+    float *even_accumulation;
+    // Samples taken by each pixel
+    uint32_t *pixel_samples;
+    // Linear ids of the pixels that keep sampling, ordered tile by tile
+    uint32_t *active_pixels;
+    uint32_t *active_pixel_count;
+
+    // Host-side progress of the frame
+    uint32_t samples_taken = 0;
+    uint64_t samples_spent = 0;
+
+    AdaptiveSampler(App &app, sycl::range<2> img_size, const RenderSettings &settings);
+
+    inline bool enabled() const {
+        return this->settings.noise_threshold > 0.0f;
+    }
+
+    // Most samples a single pixel may take
+    uint32_t max_pixel_samples() const;
+
+    // Sets the size of the frames that follow, see frame_size.
+    void resize(sycl::range<2> img_size);
+
+    // Activates every pixel and clears the sample counts.
+    void reset(sycl::queue &queue);
+
+    // Number of samples the active pixels take in the next pass, 0 once the frame is
+    // done.
+    uint32_t next_pass_samples() const;
+
+    // Records a finished pass of `samples` samples over the active pixels, then
+    // updates the active pixels. `accumulation` holds the RGBA sums of all samples.
+    // Waits for the queue.
+    void finish_pass(sycl::queue &queue, uint32_t samples, const float *accumulation);
+
+    // Prints how many pixels ended up with each number of samples.
+    void print_histogram(sycl::queue &queue) const;
+};
+
+} // namespace raytracer
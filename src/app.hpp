@@ -33,6 +33,8 @@ struct App {
     sycl::queue queue;
     sycl::context context;
     RTCDevice embree_device;
+    // Whether `embree_device` is a host device
+    bool use_cpu;
 
     App(const App &) = delete;
     App &operator=(const App &) = delete;
@@ -40,13 +42,24 @@ struct App {
     App(App &&) = delete;
     App &operator=(App &&) = delete;
 
-    App() {
+    // When `use_cpu` is set, the Embree device is a regular host device and the SYCL
+    // queue is only used for USM allocations and image output, so any SYCL device
+    // (including a CPU one) will do.
+    App(bool use_cpu = false) : use_cpu(use_cpu) {
         enablePersistentJITCache();
 
-        this->sycl_device = sycl::device(rtcSYCLDeviceSelector);
+        if (use_cpu) {
+            this->sycl_device = sycl::device(sycl::default_selector_v);
+        } else {
+            this->sycl_device = sycl::device(rtcSYCLDeviceSelector);
+        }
         this->queue = sycl::queue(this->sycl_device, exception_handler);
         this->context = sycl::context(this->sycl_device);
-        this->embree_device = rtcNewSYCLDevice(context, "");
+        if (use_cpu) {
+            this->embree_device = rtcNewDevice("");
+        } else {
+            this->embree_device = rtcNewSYCLDevice(context, "");
+        }
 
         std::cout
             << "Running on device: "
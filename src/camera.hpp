@@ -5,7 +5,7 @@
 #include <glm/glm.hpp>
 #include <fmt/core.h>
 
-#include "xorshift.hpp"
+#include "rng.hpp"
 
 namespace raytracer {
 
@@ -70,6 +70,8 @@ struct Camera {
     sycl::float3 pixel_delta_v;
 
     sycl::int2 img_size;
+    // Position of pixel (0, 0) of the camera in the full image, see crop
+    sycl::int2 pixel_offset = sycl::int2(0, 0);
 
     Camera(
         sycl::range<2> img_size,
@@ -105,8 +107,28 @@ struct Camera {
         this->pixel_delta_v = -up / ((float)img_size[1] / (viewport[1] * 2.0f));
     }
 
+    // Returns a camera that only covers the `size` pixels starting at `origin`. Its
+    // pixel coordinates and ray ids are relative to that region, random numbers are
+    // still drawn for the pixels of the full image (see image_pixel).
+    Camera crop(sycl::int2 origin, sycl::range<2> size) const {
+        Camera cropped = *this;
+        cropped.pixel00_loc = this->pixel00_loc +
+                              ((float)origin.x() * this->pixel_delta_u) +
+                              ((float)origin.y() * this->pixel_delta_v);
+        cropped.img_size[0] = size[0];
+        cropped.img_size[1] = size[1];
+        cropped.pixel_offset = this->pixel_offset + origin;
+        return cropped;
+    }
+
+    // Pixel of the full image at `pixel_coords` of this camera. Random numbers are
+    // keyed by it, so every tile of a tiled render draws the numbers of its own pixels.
+    sycl::int2 image_pixel(sycl::int2 pixel_coords) const {
+        return pixel_coords + this->pixel_offset;
+    }
+
     // Get a randomly sampled camera ray for the pixel at location x,y.
-    RayData get_ray(sycl::int2 pixel_coords, XorShift32State &rng) const {
+    RayData get_ray(sycl::int2 pixel_coords, Rng &rng) const {
         int x = pixel_coords[0];
         int y = pixel_coords[1];
 
@@ -122,11 +144,17 @@ struct Camera {
         return RayData(ray_id, ray_origin, ray_direction);
     }
 
+    // Pixel coordinates of the camera ray with `ray_id`.
+    sycl::int2 ray_pixel(uint32_t ray_id) const {
+        return sycl::int2(ray_id % this->img_size[0], ray_id / this->img_size[0]);
+    }
+
     // Returns a random point in the square surrounding a pixel at the
     // origin.
-    sycl::float3 pixel_sample_square(XorShift32State &rng) const {
-        float px = -0.5f + rng();
-        float py = -0.5f + rng();
+    sycl::float3 pixel_sample_square(Rng &rng) const {
+        sycl::float2 u = rng.next_2d();
+        float px = -0.5f + u.x();
+        float py = -0.5f + u.y();
         return (px * pixel_delta_u) + (py * pixel_delta_v);
     }
 };
@@ -0,0 +1,261 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+#include <sycl/sycl.hpp>
+#include <fmt/core.h>
+
+#include "radiance_cache.hpp"
+
+namespace raytracer {
+
+// Path guiding: every cell of a world space hash grid, keyed like the radiance cache
+// (see hash_grid_key), learns a histogram of the radiance arriving at the diffuse
+// surfaces in it. Diffuse hits in a trained cell pick their bounce direction from the
+// histogram with probability GuidingField::probability and from the BSDF otherwise,
+// and divide by the density of the mixture (one-sample MIS). The estimate stays
+// unbiased however poor the histogram is, it only gets noisier.
+//
+// Every diffuse hit records into its cell: what the path gathers until its next
+// diffuse hit (the emission it reaches and the light sample there), divided by its
+// throughput and the density of its direction, is added to the bin of the direction.
+// Frames are rendered in passes and the histograms are only sampled after the pass
+// that trained them, see update_guiding_field, so a pass never sees its own samples.
+
+// Rows and columns of the histogram of a cell. Rows are equal steps of the y
+// coordinate of the world space direction and columns equal steps of its azimuth, so
+// every bin covers the same solid angle.
+constexpr uint32_t GUIDING_RESOLUTION = 16;
+constexpr uint32_t GUIDING_BINS = GUIDING_RESOLUTION * GUIDING_RESOLUTION;
+
+// Cells of the hash table. Must be a power of two.
+constexpr uint32_t GUIDING_CELLS = 1u << 15;
+
+// Bin index of paths that are not recording into the guiding field.
+constexpr uint32_t GUIDING_NO_BIN = ~0u;
+
+struct GuidingCell {
+    // See RadianceCacheCell::key
+    uint32_t key;
+    // Paths that recorded into the cell
+    uint32_t sample_count;
+    // Sum of the recorded luminance over the density of its direction, per bin
+    float bins[GUIDING_BINS];
+};
+
+// Guiding distribution at a hit
+struct GuidingLookup {
+    // Cell of the hit, RADIANCE_CACHE_NO_CELL when the hit has none
+    uint32_t cell = RADIANCE_CACHE_NO_CELL;
+    // CDF of the cell, null when hits in it are not guided yet
+    const float *cdf = nullptr;
+};
+
+struct GuidingSample {
+    sycl::float3 direction;
+    // Solid angle density of `direction`
+    float pdf;
+};
+
+// Whether diffuse hits look up and record into the guiding field.
+template <typename Context>
+static inline bool uses_guiding(const Context &ctx, const RenderSettings &settings) {
+    return settings.path_guiding && ctx.guiding.cells != nullptr;
+}
+
+// Bin of the histogram of a cell that world space direction `dir` falls into.
+inline uint32_t guiding_bin(const sycl::float3 &dir) {
+    float u = (sycl::clamp(dir.y(), -1.0f, 1.0f) + 1.0f) * 0.5f;
+    float v = sycl::atan2(dir.z(), dir.x()) / (2.0f * PI) + 0.5f;
+    uint32_t row = sycl::min((uint32_t)(u * GUIDING_RESOLUTION), GUIDING_RESOLUTION - 1);
+    uint32_t col = sycl::min((uint32_t)(v * GUIDING_RESOLUTION), GUIDING_RESOLUTION - 1);
+    return row * GUIDING_RESOLUTION + col;
+}
+
+// Solid angle density of bin `bin` of `cdf`. Every bin covers 4 PI / GUIDING_BINS.
+inline float guiding_bin_pdf(const float *cdf, uint32_t bin) {
+    float probability = cdf[bin] - (bin > 0 ? cdf[bin - 1] : 0.0f);
+    return probability * (GUIDING_BINS / (4.0f * PI));
+}
+
+// Looks up the cell of a hit at `position`, on the side of the surface `normal`
+// faces, claiming a slot for it so the hit can record into it.
+inline GuidingLookup find_guiding_cell(
+    const GuidingField &field, const sycl::float3 &position, const sycl::float3 &normal
+) {
+    GuidingLookup lookup;
+    lookup.cell = find_hash_grid_cell(
+        field.cells, GUIDING_CELLS, hash_grid_key(field.cell_size, position, normal)
+    );
+    if (lookup.cell != RADIANCE_CACHE_NO_CELL) {
+        const float *cdf = &field.distributions[lookup.cell * GUIDING_BINS];
+        if (cdf[GUIDING_BINS - 1] > 0.0f) {
+            lookup.cdf = cdf;
+        }
+    }
+    return lookup;
+}
+
+// Picks a bin of `cdf` proportionally to the radiance recorded into it and a uniform
+// direction inside the bin.
+inline GuidingSample sample_guiding(const float *cdf, Rng &rng) {
+    // First bin whose CDF exceeds u, empty bins are never picked
+    float u = rng();
+    uint32_t lo = 0, hi = GUIDING_BINS - 1;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (cdf[mid] > u) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+
+    sycl::float2 offset = rng.next_2d();
+    float y = (lo / GUIDING_RESOLUTION + offset.x()) / GUIDING_RESOLUTION * 2.0f - 1.0f;
+    float phi =
+        ((lo % GUIDING_RESOLUTION + offset.y()) / GUIDING_RESOLUTION - 0.5f) * 2.0f * PI;
+    float r = sycl::sqrt(sycl::fmax(1.0f - y * y, 0.0f));
+
+    return GuidingSample{
+        .direction = sycl::float3(r * sycl::cos(phi), y, r * sycl::sin(phi)),
+        .pdf = guiding_bin_pdf(cdf, lo),
+    };
+}
+
+// Density of the one-sample MIS mixture of the distribution of `lookup` and a BSDF
+// with density `bsdf_pdf` towards `dir`. Just the BSDF's at hits that are not guided.
+inline float guided_pdf(
+    const GuidingField &field,
+    const GuidingLookup &lookup,
+    float bsdf_pdf,
+    const sycl::float3 &dir
+) {
+    if (!lookup.cdf) return bsdf_pdf;
+    return field.probability * guiding_bin_pdf(lookup.cdf, guiding_bin(dir)) +
+           (1.0f - field.probability) * bsdf_pdf;
+}
+
+// Counts a path recording into `cell`.
+inline void add_guiding_path(const GuidingField &field, uint32_t cell) {
+    GlobalAtomic<uint32_t>(field.cells[cell].sample_count) += 1;
+}
+
+// Adds the luminance of `radiance` to `bin`, the index of a bin among the bins of
+// every cell (cell * GUIDING_BINS + bin).
+inline void add_guiding_sample(
+    const GuidingField &field, uint32_t bin, const sycl::float3 &radiance
+) {
+    float value = luminance(radiance);
+    if (!(value > 0.0f) || sycl::isinf(value)) return;
+    GuidingCell &cell = field.cells[bin / GUIDING_BINS];
+    GlobalAtomic<float>(cell.bins[bin % GUIDING_BINS]) += value;
+}
+
+// Samples per pixel of pass `pass` of a frame. With guiding the passes double in
+// length: the first histograms are rebuilt after a few samples, later passes are long
+// so they spend little time waiting for the host. Without guiding there is no limit.
+inline uint32_t guiding_pass_samples(const GuidingField &field, uint32_t pass) {
+    if (!field.cells) return UINT32_MAX;
+    return 1u << std::min(pass, 16u);
+}
+
+// Allocates the cells and distributions of the field when the settings enable it.
+inline GuidingField
+create_guiding_field(sycl::queue &queue, const RenderSettings &settings) {
+    GuidingField field = {};
+    if (!settings.path_guiding) return field;
+
+    field.cells = (GuidingCell *)sycl::aligned_alloc_device(
+        alignof(GuidingCell), sizeof(GuidingCell) * GUIDING_CELLS, queue
+    );
+    field.distributions = (float *)sycl::aligned_alloc_device(
+        alignof(float), sizeof(float) * GUIDING_CELLS * GUIDING_BINS, queue
+    );
+    field.min_samples = std::max(settings.guiding_min_samples, 1u);
+    field.probability = std::clamp(settings.guiding_probability, 0.0f, 1.0f);
+    return field;
+}
+
+// Forgets everything the field learned and sizes its cells for `scene`. Without a
+// cell size in the settings, cells are 1/64 of the diagonal of the scene bounds.
+inline void reset_guiding_field(
+    sycl::queue &queue,
+    GuidingField &field,
+    const Scene &scene,
+    const RenderSettings &settings
+) {
+    if (!field.cells) return;
+
+    field.cell_size = settings.guiding_cell_size;
+    if (field.cell_size <= 0.0f) {
+        field.cell_size = sycl::fmax(scene_diagonal(scene) / 64.0f, 1e-4f);
+    }
+
+    queue.memset(field.cells, 0, sizeof(GuidingCell) * GUIDING_CELLS);
+    queue.memset(field.distributions, 0, sizeof(float) * GUIDING_CELLS * GUIDING_BINS)
+        .wait();
+}
+
+// Rebuilds the distributions sampled by the next pass from everything recorded so
+// far. Must not run while paths are being traced.
+inline void update_guiding_field(sycl::queue &queue, const GuidingField &field) {
+    if (!field.cells) return;
+
+    const GuidingCell *cells = field.cells;
+    float *distributions = field.distributions;
+    const uint32_t min_samples = field.min_samples;
+
+    queue
+        .parallel_for(
+            sycl::range<1>(GUIDING_CELLS),
+            [=](sycl::item<1> item) {
+                const GuidingCell &cell = cells[item[0]];
+                float *cdf = &distributions[item[0] * GUIDING_BINS];
+
+                float sum = 0.0f;
+                for (uint32_t i = 0; i < GUIDING_BINS; ++i) {
+                    sum += cell.bins[i];
+                    cdf[i] = sum;
+                }
+
+                // Cells without enough samples keep an all zero CDF and are not guided
+                float scale = cell.sample_count >= min_samples && sum > 0.0f
+                                  ? 1.0f / sum
+                                  : 0.0f;
+                for (uint32_t i = 0; i < GUIDING_BINS; ++i) {
+                    cdf[i] *= scale;
+                }
+                if (scale > 0.0f) {
+                    cdf[GUIDING_BINS - 1] = 1.0f;
+                }
+            }
+        )
+        .wait();
+}
+
+// Prints how many cells the frame trained and how many of them guide their hits.
+inline void print_guiding_stats(sycl::queue &queue, const GuidingField &field) {
+    if (!field.cells) return;
+
+    std::vector<GuidingCell> cells(GUIDING_CELLS);
+    queue.memcpy(cells.data(), field.cells, sizeof(GuidingCell) * cells.size()).wait();
+
+    uint64_t used = 0, guided = 0, samples = 0;
+    for (const GuidingCell &cell : cells) {
+        if (cell.key == 0) continue;
+        used++;
+        guided += cell.sample_count >= field.min_samples ? 1 : 0;
+        samples += cell.sample_count;
+    }
+
+    fmt::println(
+        "Path guiding: {} cells ({} guided), cell size {:.4f}, {} paths recorded",
+        used,
+        guided,
+        field.cell_size,
+        samples
+    );
+}
+
+} // namespace raytracer
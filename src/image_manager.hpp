@@ -36,7 +36,8 @@ struct ImageManager {
     ImageManager(ImageManager &&) = delete;
     ImageManager &operator=(ImageManager &&) = delete;
 
-    ImageRef upload_image(uint32_t width, uint32_t height, const uint8_t *data) {
+    // Reserves a slot for an image that is filled in later with `resize_image`.
+    ImageRef allocate_image() {
         uint32_t image_index = this->images.size();
         if (image_index >= MAX_IMAGES) {
             fmt::print("Too many images uploaded\n");
@@ -48,27 +49,56 @@ struct ImageManager {
                 std::vector<uint8_t>(IMAGE_SIZE.x() * IMAGE_SIZE.y() * IMAGE_CHANNELS),
         });
 
+        return ImageRef{image_index};
+    }
+
+    // Resizes RGBA8 `data` into the slot of `image_ref`. Different slots may be
+    // resized from different threads at the same time.
+    void resize_image(
+        ImageRef image_ref, uint32_t width, uint32_t height, const uint8_t *data
+    ) {
         uint8_t *output = stbir_resize_uint8_srgb(
             data,
             width,
             height,
             0,
-            this->images[image_index].data.data(),
+            this->images[image_ref.index].data.data(),
             IMAGE_SIZE.x(),
             IMAGE_SIZE.y(),
             0,
             STBIR_RGBA
         );
-        assert(output == this->images[image_index].data.data());
+        assert(output == this->images[image_ref.index].data.data());
 
         fmt::println(
             "Resized image {} from {}x{} to {}x{}",
-            image_index,
+            image_ref.index,
             width,
             height,
             IMAGE_SIZE.x(),
             IMAGE_SIZE.y()
         );
+    }
+
+    ImageRef upload_image(uint32_t width, uint32_t height, const uint8_t *data) {
+        ImageRef image_ref = this->allocate_image();
+        this->resize_image(image_ref, width, height, data);
+        return image_ref;
+    }
+
+    // Adds an image whose texels are already IMAGE_SIZE.
+    ImageRef add_image(const uint8_t *texels) {
+        uint32_t image_index = this->images.size();
+        if (image_index >= MAX_IMAGES) {
+            fmt::print("Too many images uploaded\n");
+            std::terminate();
+        }
+
+        this->images.push_back(Image{
+            .data = std::vector<uint8_t>(
+                texels, texels + IMAGE_SIZE.x() * IMAGE_SIZE.y() * IMAGE_CHANNELS
+            ),
+        });
 
         return ImageRef{image_index};
     }
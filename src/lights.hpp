@@ -0,0 +1,206 @@
+#pragma once
+
+#include <vector>
+#include <sycl/sycl.hpp>
+
+#include "render_context.hpp"
+#include "rng.hpp"
+#include "util.hpp"
+
+namespace raytracer {
+
+// World space triangle of a mesh whose material emits light.
+struct EmissiveTriangle {
+    sycl::float3 p0;
+    sycl::float3 e1;
+    sycl::float3 e2;
+    sycl::float3 emission;
+};
+
+// Entry of an alias table (Vose): bin `i` keeps itself with `probability` and picks
+// `alias` otherwise.
+struct LightAliasEntry {
+    float probability;
+    uint32_t alias;
+};
+
+// Weight of an emitter in the light table. Emitters are picked proportionally to it.
+inline float light_power(const sycl::float3 &emission, float area) {
+    return luminance(emission) * area;
+}
+
+// Builds an alias table that picks index `i` with probability weights[i] / sum.
+inline std::vector<LightAliasEntry> build_alias_table(const std::vector<float> &weights) {
+    const size_t count = weights.size();
+    double sum = 0.0;
+    for (float w : weights) sum += w;
+
+    std::vector<LightAliasEntry> table(count);
+    std::vector<double> scaled(count);
+    std::vector<uint32_t> small, large;
+    for (size_t i = 0; i < count; ++i) {
+        scaled[i] = sum > 0.0 ? weights[i] * count / sum : 1.0;
+        (scaled[i] < 1.0 ? small : large).push_back(i);
+    }
+
+    while (!small.empty() && !large.empty()) {
+        uint32_t s = small.back();
+        uint32_t l = large.back();
+        small.pop_back();
+        table[s] = LightAliasEntry{.probability = (float)scaled[s], .alias = l};
+        scaled[l] -= 1.0 - scaled[s];
+        if (scaled[l] < 1.0) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // Left over bins are full up to rounding
+    for (uint32_t i : small) table[i] = LightAliasEntry{.probability = 1.0f, .alias = i};
+    for (uint32_t i : large) table[i] = LightAliasEntry{.probability = 1.0f, .alias = i};
+
+    return table;
+}
+
+// Probability density, per unit area, of sample_light picking a point on an emitter
+// with `emission`. The power of a triangle is proportional to its area, so it is the
+// same for every point of every triangle of the emitter.
+inline float light_pdf_area(const LightTable &lights, const sycl::float3 &emission) {
+    return luminance(emission) / lights.total_power;
+}
+
+struct LightSample {
+    sycl::float3 position;
+    sycl::float3 normal;
+    sycl::float3 emission;
+    // Probability density per unit area of the light surfaces
+    float pdf_area;
+};
+
+// Picks an emissive triangle proportionally to its power and a uniform point on it.
+inline LightSample sample_light(const LightTable &lights, Rng &rng) {
+    // See sample_environment
+    sycl::float2 u = rng.next_2d();
+    uint32_t i = sycl::min((uint32_t)(u.x() * lights.count), lights.count - 1);
+    LightAliasEntry entry = lights.alias[i];
+    if (u.y() >= entry.probability) i = entry.alias;
+
+    const EmissiveTriangle tri = lights.triangles[i];
+    sycl::float2 p = rng.next_2d();
+    float su = sycl::sqrt(p.x());
+    sycl::float3 normal = sycl::cross(tri.e1, tri.e2);
+
+    return LightSample{
+        .position = tri.p0 + su * (1.0f - p.y()) * tri.e1 + su * p.y() * tri.e2,
+        .normal = sycl::normalize(normal),
+        .emission = tri.emission,
+        .pdf_area = light_pdf_area(lights, tri.emission),
+    };
+}
+
+// Converts a density per unit area at a point seen at `distance` under `cos_light`
+// to a density per solid angle.
+inline float area_to_solid_angle(float pdf_area, float distance, float cos_light) {
+    return cos_light > 0.0f ? pdf_area * distance * distance / cos_light : 0.0f;
+}
+
+// Power heuristic weight of a sample taken with density `pdf` when another strategy
+// could have taken it with density `other_pdf`.
+inline float mis_weight(float pdf, float other_pdf) {
+    float a = pdf * pdf;
+    float b = other_pdf * other_pdf;
+    return a + b > 0.0f ? a / (a + b) : 0.0f;
+}
+
+// Equirectangular coordinates in [0, 1]^2 of the unit vector `dir`. v goes from +y
+// down to -y, and u = 0.5 looks down -z.
+inline sycl::float2 direction_to_equirect(const sycl::float3 &dir) {
+    float u = 0.5f + sycl::atan2(dir.x(), -dir.z()) / (2.0f * PI);
+    float v = sycl::acos(sycl::clamp(dir.y(), -1.0f, 1.0f)) / PI;
+    return sycl::float2(u, v);
+}
+
+inline sycl::float3 equirect_to_direction(const sycl::float2 &uv) {
+    float phi = (uv.x() - 0.5f) * 2.0f * PI;
+    float theta = uv.y() * PI;
+    float sin_theta = sycl::sin(theta);
+    return sycl::float3(
+        sin_theta * sycl::sin(phi), sycl::cos(theta), -sin_theta * sycl::cos(phi)
+    );
+}
+
+// Index of the texel of `env` that covers `uv`.
+inline uint32_t environment_texel(const EnvironmentMap &env, const sycl::float2 &uv) {
+    uint32_t x = sycl::min((uint32_t)sycl::fmax(uv.x() * env.width, 0.0f), env.width - 1);
+    uint32_t y =
+        sycl::min((uint32_t)sycl::fmax(uv.y() * env.height, 0.0f), env.height - 1);
+    return y * env.width + x;
+}
+
+// Weight of a texel of row `y` in the environment alias table: its luminance times the
+// solid angle it covers, which shrinks towards the poles.
+inline float
+environment_texel_weight(const sycl::float4 &texel, uint32_t y, uint32_t height) {
+    float sin_theta = sycl::sin(PI * (y + 0.5f) / height);
+    return luminance(sycl::float3(texel.x(), texel.y(), texel.z())) * sin_theta;
+}
+
+// Radiance of a ray escaping the scene in direction `dir`, a unit vector.
+inline sycl::float3
+environment_radiance(const EnvironmentMap &env, const sycl::float3 &dir) {
+    if (!env.texels) return env.color;
+    sycl::float4 texel = env.texels[environment_texel(env, direction_to_equirect(dir))];
+    return sycl::float3(texel.x(), texel.y(), texel.z());
+}
+
+// Solid angle density of sample_environment picking `uv`, which lies in texel `i`.
+inline float
+environment_pdf(const EnvironmentMap &env, const sycl::float2 &uv, uint32_t i) {
+    float sin_theta = sycl::sin(uv.y() * PI);
+    if (sin_theta <= 0.0f) return 0.0f;
+
+    uint32_t y = i / env.width;
+    float pdf_texel = environment_texel_weight(env.texels[i], y, env.height) /
+                      env.total_weight;
+    // The texel covers 1 / (width * height) of the map, which maps onto
+    // 2 PI^2 sin(theta) of solid angle
+    return pdf_texel * env.width * env.height / (2.0f * PI * PI * sin_theta);
+}
+
+inline float environment_pdf(const EnvironmentMap &env, const sycl::float3 &dir) {
+    sycl::float2 uv = direction_to_equirect(dir);
+    return environment_pdf(env, uv, environment_texel(env, uv));
+}
+
+struct EnvironmentSample {
+    sycl::float3 direction;
+    sycl::float3 radiance;
+    // Probability density per solid angle
+    float pdf;
+};
+
+// Picks a texel of the environment map proportionally to its weight and a uniform
+// direction inside it.
+inline EnvironmentSample sample_environment(const EnvironmentMap &env, Rng &rng) {
+    // The texel and the alias coin get a dimension each, a single number scaled by the
+    // texel count leaves too few bits for the coin of large maps
+    uint32_t count = env.width * env.height;
+    sycl::float2 u = rng.next_2d();
+    uint32_t i = sycl::min((uint32_t)(u.x() * count), count - 1);
+    LightAliasEntry entry = env.alias[i];
+    if (u.y() >= entry.probability) i = entry.alias;
+
+    sycl::float2 jitter = rng.next_2d();
+    sycl::float2 uv = sycl::float2(
+        ((i % env.width) + jitter.x()) / env.width,
+        ((i / env.width) + jitter.y()) / env.height
+    );
+    sycl::float4 texel = env.texels[i];
+
+    return EnvironmentSample{
+        .direction = equirect_to_direction(uv),
+        .radiance = sycl::float3(texel.x(), texel.y(), texel.z()),
+        .pdf = environment_pdf(env, uv, i),
+    };
+}
+
+} // namespace raytracer
@@ -4,48 +4,254 @@
 #include "render.hpp"
 #include "render_megakernel.hpp"
 #include "render_wavefront.hpp"
+#include "render_cpu.hpp"
+#include "util.hpp"
 
 int main(int argc, const char *argv[]) {
     CLI::App cli_app{"App description"};
 
-    uint32_t max_depth = 10;
-    cli_app.add_option("-d,--max-depth", max_depth, "Max depth");
-    uint32_t sample_count = 32;
-    cli_app.add_option("-s,--sample-count", sample_count, "Sample count");
+    raytracer::RenderSettings settings = {};
+    cli_app.add_option("-d,--max-depth", settings.max_depth, "Max depth");
+    cli_app.add_option("-s,--sample-count", settings.sample_count, "Sample count");
+    cli_app.add_option(
+        "--roulette-depth",
+        settings.roulette_min_depth,
+        "Depth from which russian roulette may terminate paths (0 disables it)"
+    );
+    cli_app.add_option(
+        "--split-threshold",
+        settings.split_threshold,
+        "Split paths with a throughput above this value (0 disables splitting)"
+    );
+    cli_app.add_flag(
+        "--regenerate",
+        settings.regenerate,
+        "Wavefront: refill terminated ray slots with camera rays of later samples"
+    );
+    cli_app.add_option(
+        "--ray-pool-size",
+        settings.ray_pool_size,
+        "Wavefront: number of rays in flight when regenerating (default: pixel count)"
+    );
+    cli_app.add_option(
+        "--noise-threshold",
+        settings.noise_threshold,
+        "Stop sampling tiles whose relative error is below this value (0 disables it)"
+    );
+    cli_app.add_option(
+        "--min-samples",
+        settings.min_samples,
+        "Adaptive sampling: samples taken by every pixel before estimating its error"
+    );
+    cli_app.add_option(
+        "--max-samples",
+        settings.max_samples,
+        "Adaptive sampling: most samples a pixel may take (default: 4 * sample count)"
+    );
+    cli_app
+        .add_option(
+            "--sequence",
+            settings.sample_sequence,
+            "Sample sequence: sobol (dithered Owen-scrambled Sobol) or random"
+        )
+        ->transform(CLI::CheckedTransformer(
+            std::map<std::string, raytracer::SampleSequence>{
+                {"random", raytracer::SampleSequence::eRandom},
+                {"sobol", raytracer::SampleSequence::eSobol},
+            },
+            CLI::ignore_case
+        ));
+    bool no_nee = false;
+    cli_app.add_flag(
+        "--no-nee",
+        no_nee,
+        "Only find lights by chance instead of sampling them with shadow rays"
+    );
+    cli_app.add_option(
+        "--radiance-cache",
+        settings.radiance_cache_depth,
+        "GPU: end paths in the radiance cache from this bounce on (0 disables it)"
+    );
+    cli_app.add_option(
+        "--radiance-cache-samples",
+        settings.radiance_cache_min_samples,
+        "Samples a radiance cache cell needs before paths end in it"
+    );
+    cli_app.add_option(
+        "--radiance-cache-cell",
+        settings.radiance_cache_cell_size,
+        "Radiance cache cell size in world units (default: scene diagonal / 256)"
+    );
+    cli_app.add_flag(
+        "--guiding",
+        settings.path_guiding,
+        "GPU: guide diffuse bounces with directional distributions learned per pass"
+    );
+    cli_app.add_option(
+        "--guiding-probability",
+        settings.guiding_probability,
+        "Chance of sampling the guiding distribution instead of the BSDF"
+    );
+    cli_app.add_option(
+        "--guiding-samples",
+        settings.guiding_min_samples,
+        "Paths a guiding cell needs to record before its hits are guided"
+    );
+    cli_app.add_option(
+        "--guiding-cell",
+        settings.guiding_cell_size,
+        "Guiding cell size in world units (default: scene diagonal / 64)"
+    );
+    bool no_graph = false;
+    cli_app.add_flag(
+        "--no-graph",
+        no_graph,
+        "Wavefront: submit every kernel directly instead of replaying a command graph"
+    );
+    bool generic_traversal = false;
+    cli_app.add_flag(
+        "--generic-traversal",
+        generic_traversal,
+        "Compile Embree traversal for every geometry type instead of the scene's"
+    );
+
+    std::string resolution = "1920x1080";
+    cli_app.add_option("--resolution", resolution, "Output image size (WIDTHxHEIGHT)");
+    uint32_t tile_size = 0;
+    cli_app.add_option(
+        "--tile-size",
+        tile_size,
+        "Render the image in square tiles of this size and stream them to out.ppm "
+        "(0 renders the whole image at once)"
+    );
 
     std::string scene_path = "./assets/sponza.glb";
     cli_app.add_option("scene_path", scene_path, "Scene path");
+    bool no_scene_cache = false;
+    cli_app.add_flag(
+        "--no-scene-cache",
+        no_scene_cache,
+        "Always load the scene from the glTF file and do not write a scene cache"
+    );
+    raytracer::SceneSettings scene_settings = {};
+    cli_app
+        .add_option(
+            "--build-quality",
+            scene_settings.build_quality,
+            "BVH build quality: low (fast builds), medium or high (fast tracing)"
+        )
+        ->transform(CLI::CheckedTransformer(
+            std::map<std::string, RTCBuildQuality>{
+                {"low", RTC_BUILD_QUALITY_LOW},
+                {"medium", RTC_BUILD_QUALITY_MEDIUM},
+                {"high", RTC_BUILD_QUALITY_HIGH},
+            },
+            CLI::ignore_case
+        ));
+    bool bvh_compact = false;
+    cli_app.add_flag(
+        "--bvh-compact", bvh_compact, "Build compact BVHs that use less memory"
+    );
+    bool no_reorder = false;
+    cli_app.add_flag(
+        "--no-reorder",
+        no_reorder,
+        "Keep the triangle and vertex order of the glTF file instead of Morton order"
+    );
+    cli_app.add_flag(
+        "--compact-attributes",
+        scene_settings.compact_attributes,
+        "Store normals as octahedral snorm16 and uvs as halfs in one record per vertex"
+    );
+    cli_app.add_flag(
+        "--flat-bvh",
+        scene_settings.flat_bvh,
+        "Bake meshes used by a single node into the top-level BVH instead of instancing"
+    );
+    cli_app.add_option(
+        "--environment-map",
+        scene_settings.environment_map,
+        "Equirectangular HDR image that lights the scene instead of the sky color"
+    );
+    bool bvh_robust = false;
+    cli_app.add_flag(
+        "--bvh-robust", bvh_robust, "Build robust BVHs that avoid missing edge hits"
+    );
 
     bool use_wavefront = false;
     cli_app.add_flag("-w,--wavefront", use_wavefront, "Use wavefront renderer");
     bool use_megakernel = false;
     cli_app.add_flag("-m,--megakernel", use_megakernel, "Use megakernel renderer");
+    bool use_cpu = false;
+    cli_app.add_flag("--cpu", use_cpu, "Use host-side Embree CPU renderer");
+    uint32_t packet_size = 8;
+    cli_app.add_option(
+        "--packet-size", packet_size, "CPU renderer packet size (4, 8 or 16)"
+    );
 
     CLI11_PARSE(cli_app, argc, argv);
 
-    if (!use_wavefront && !use_megakernel) {
+    settings.command_graph = !no_graph;
+    settings.next_event_estimation = !no_nee;
+    settings.traversal_feature_mask = !generic_traversal;
+
+    scene_settings.use_cache = !no_scene_cache;
+    scene_settings.reorder_primitives = !no_reorder;
+    if (bvh_compact) {
+        scene_settings.scene_flags =
+            (RTCSceneFlags)(scene_settings.scene_flags | RTC_SCENE_FLAG_COMPACT);
+    }
+    if (bvh_robust) {
+        scene_settings.scene_flags =
+            (RTCSceneFlags)(scene_settings.scene_flags | RTC_SCENE_FLAG_ROBUST);
+    }
+
+    uint32_t width = 0, height = 0;
+    if (sscanf(resolution.c_str(), "%ux%u", &width, &height) != 2 || width == 0 ||
+        height == 0) {
+        fmt::println("Invalid resolution: {}", resolution);
+        return 1;
+    }
+
+    if (!use_wavefront && !use_megakernel && !use_cpu) {
         use_wavefront = true;
     }
 
+    if (settings.noise_threshold > 0.0f && (use_cpu || settings.regenerate)) {
+        fmt::println("Adaptive sampling is not supported with --cpu or --regenerate");
+        settings.noise_threshold = 0.0f;
+    }
+
     fmt::println("Loading scene: {}", scene_path);
 
     try {
-        raytracer::App app;
+        raytracer::App app(use_cpu);
 
         // Calculate viewport size
-        sycl::range<2> img_size = sycl::range<2>(1920, 1080);
+        sycl::range<2> img_size = sycl::range<2>(width, height);
+
+        // Renderers only ever see one tile, so their buffers are sized by the tile
+        // instead of the whole image
+        bool tiled = tile_size > 0 && (tile_size < width || tile_size < height);
+        sycl::range<2> render_size = img_size;
+        if (tiled) {
+            render_size = sycl::range<2>(
+                std::min(tile_size, width), std::min(tile_size, height)
+            );
+        }
 
         // Create image
-        uint8_t *image_buf =
-            sycl::malloc_shared<uint8_t>(img_size[0] * img_size[1] * 4, app.queue);
+        uint8_t *image_buf = sycl::malloc_shared<uint8_t>(
+            render_size[0] * render_size[1] * 4, app.queue
+        );
         sycl::image<2> image(
             image_buf,
             sycl::image_channel_order::rgba,
             sycl::image_channel_type::unorm_int8,
-            img_size
+            render_size
         );
 
-        raytracer::Scene scene(app, scene_path);
+        raytracer::Scene scene(app, scene_path, scene_settings);
 
         raytracer::Camera camera(
             img_size,
@@ -55,19 +261,62 @@ int main(int argc, const char *argv[]) {
         );
 
         std::unique_ptr<raytracer::IRenderer> renderer;
-        if (use_megakernel) {
+        if (use_cpu) {
+            renderer.reset(new raytracer::CpuRenderer(
+                app, render_size, image, settings, packet_size
+            ));
+        } else if (use_megakernel) {
             renderer.reset(new raytracer::MegakernelRenderer(
-                app, img_size, image, max_depth, sample_count
+                app, render_size, image, settings
             ));
         } else if (use_wavefront) {
             renderer.reset(new raytracer::WavefrontRenderer(
-                app, img_size, image, max_depth, sample_count
+                app, render_size, image, settings
             ));
         } else {
             throw std::runtime_error("Unknown renderer");
         }
 
-        renderer->render_frame(camera, scene);
+        if (!tiled) {
+            renderer->render_frame(camera, scene);
+
+            fmt::println("Writing image to disk");
+            raytracer::write_image(app.queue, image, img_size[0], img_size[1]);
+        } else {
+            // Edge tiles only render the pixels inside the image
+            raytracer::PpmTileWriter writer("out.ppm", img_size[0], img_size[1]);
+            size_t tiles_x = (img_size[0] + render_size[0] - 1) / render_size[0];
+            size_t tiles_y = (img_size[1] + render_size[1] - 1) / render_size[1];
+            for (size_t tile_y = 0; tile_y < tiles_y; ++tile_y) {
+                for (size_t tile_x = 0; tile_x < tiles_x; ++tile_x) {
+                    sycl::range<2> origin(
+                        tile_x * render_size[0], tile_y * render_size[1]
+                    );
+                    sycl::range<2> size(
+                        std::min(render_size[0], img_size[0] - origin[0]),
+                        std::min(render_size[1], img_size[1] - origin[1])
+                    );
+
+                    fmt::println(
+                        "Tile {}/{} at ({}, {})",
+                        tile_y * tiles_x + tile_x + 1,
+                        tiles_x * tiles_y,
+                        origin[0],
+                        origin[1]
+                    );
+                    renderer->render_frame(
+                        camera.crop(sycl::int2(origin[0], origin[1]), size),
+                        scene
+                    );
+
+                    std::vector<uint8_t> pixels = raytracer::read_image(
+                        app.queue, image, render_size[0], render_size[1]
+                    );
+                    writer.write_tile(origin, size, pixels.data(), render_size[0]);
+                }
+            }
+            fmt::println("Wrote out.ppm");
+        }
     } catch (sycl::exception const &e) {
         fmt::println("Caught SYCL exception: {}", e.what());
         std::terminate();
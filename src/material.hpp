@@ -4,7 +4,7 @@
 #include <embree4/rtcore.h>
 
 #include "image_manager.hpp"
-#include "xorshift.hpp"
+#include "rng.hpp"
 #include "util.hpp"
 #include "render_context.hpp"
 
@@ -42,12 +42,13 @@ struct Texture {
         return *this;
     }
 
-    inline sycl::float3 sample(const RenderContext &ctx, sycl::float2 uv) const {
+    template <typename Context>
+    inline sycl::float3 sample(const Context &ctx, sycl::float2 uv) const {
         switch (this->type) {
         case TextureType::eColor: return this->color;
         case TextureType::eImage:
-            sycl::float4 color =
-                ctx.image_reader[this->image_ref.index].read(uv, ctx.sampler);
+            if (!ctx.features.has(TextureType::eImage)) return sycl::float3(0.0f);
+            sycl::float4 color = ctx.sample_image(this->image_ref.index, uv);
             return sycl::float3(color.x(), color.y(), color.z());
         }
     }
@@ -55,9 +56,73 @@ struct Texture {
 
 struct ScatterResult {
     sycl::float3 dir;
+    // Weight of the sample, the BSDF times the cosine over the density of `dir`
     sycl::float3 attenuation;
+    // Solid angle density of `dir`, 0 when it has no known density (e.g. mirrors)
+    float pdf;
 };
 
+// BSDF times the cosine towards a direction, and the density of scatter() picking it
+struct BsdfEval {
+    sycl::float3 value;
+    float pdf;
+};
+
+// GGX lobes narrower than this are treated as perfect mirrors, their density would
+// not fit in a float.
+constexpr float MIN_GGX_ALPHA = 1e-3f;
+
+// Schlick's approximation of the Fresnel reflectance for reflectance `f0` at normal
+// incidence.
+inline sycl::float3 fresnel_schlick(const sycl::float3 &f0, float cos_theta) {
+    float m = sycl::clamp(1.0f - cos_theta, 0.0f, 1.0f);
+    float m2 = m * m;
+    return f0 + (sycl::float3(1.0f) - f0) * (m2 * m2 * m);
+}
+
+// GGX distribution of microfacet normals `h`, in the local frame of the surface.
+inline float ggx_d(const sycl::float3 &h, float alpha) {
+    float a2 = alpha * alpha;
+    float d = h.z() * h.z() * (a2 - 1.0f) + 1.0f;
+    return a2 / (PI * d * d);
+}
+
+// Smith's Lambda for the GGX distribution, from which the masking functions follow.
+inline float ggx_lambda(const sycl::float3 &v, float alpha) {
+    float cos2 = v.z() * v.z();
+    float tan2 = sycl::fmax(1.0f - cos2, 0.0f) / cos2;
+    return 0.5f * (sycl::sqrt(1.0f + alpha * alpha * tan2) - 1.0f);
+}
+
+// Samples a microfacet normal visible from `wo` (Heitz, "Sampling the GGX
+// Distribution of Visible Normals"), with density G1(wo) max(0, wo.h) D(h) / wo.z.
+inline sycl::float3
+ggx_sample_vndf(const sycl::float3 &wo, float alpha, const sycl::float2 &u) {
+    // Stretch the view direction to the hemisphere configuration
+    sycl::float3 v = normalize(sycl::float3(alpha * wo.x(), alpha * wo.y(), wo.z()));
+
+    float len2 = v.x() * v.x() + v.y() * v.y();
+    sycl::float3 t1 = len2 > 0.0f ? sycl::float3(-v.y(), v.x(), 0.0f) * sycl::rsqrt(len2)
+                                  : sycl::float3(1.0f, 0.0f, 0.0f);
+    sycl::float3 t2 = sycl::cross(v, t1);
+
+    // Point on the projected area of the hemisphere
+    float r = sycl::sqrt(u.x());
+    float phi = 2.0f * PI * u.y();
+    float p1 = r * sycl::cos(phi);
+    float p2 = r * sycl::sin(phi);
+    float s = 0.5f * (1.0f + v.z());
+    p2 = (1.0f - s) * sycl::sqrt(1.0f - p1 * p1) + s * p2;
+
+    sycl::float3 h =
+        p1 * t1 + p2 * t2 + sycl::sqrt(sycl::fmax(0.0f, 1.0f - p1 * p1 - p2 * p2)) * v;
+
+    // Unstretch
+    return normalize(
+        sycl::float3(alpha * h.x(), alpha * h.y(), sycl::fmax(0.0f, h.z()))
+    );
+}
+
 enum class MaterialType : uint8_t {
     eNone,
     eDiffuse,
@@ -69,22 +134,43 @@ struct MaterialDiffuse {
     Texture albedo;
     sycl::float3 emissive;
 
+    template <typename Context>
     inline bool scatter(
-        const RenderContext &ctx,
-        XorShift32State &rng,
+        const Context &ctx,
+        Rng &rng,
         const sycl::float3 &dir,
         const sycl::float3 &normal,
         const sycl::float2 &uv,
         ScatterResult &result
     ) const {
-        result.dir = normal + rng.random_unit_vector();
-        if (near_zero(dir)) {
-            result.dir = normal;
-        }
+        // The cosine and 1/PI of the BSDF cancel against the density, which leaves
+        // the albedo as the weight
+        Frame frame = Frame::from_normal(face_forward(normal, dir));
+        sycl::float3 local = rng.random_cosine_direction();
+        result.dir = frame.to_world(local);
         result.attenuation = this->albedo.sample(ctx, uv);
+        result.pdf = local.z() / PI;
         return true;
     }
 
+    template <typename Context>
+    inline BsdfEval eval(
+        const Context &ctx,
+        const sycl::float3 &dir,
+        const sycl::float3 &normal,
+        const sycl::float2 &uv,
+        const sycl::float3 &wi
+    ) const {
+        float cos_theta = dot(wi, face_forward(normal, dir));
+        if (cos_theta <= 0.0f) {
+            return BsdfEval{.value = sycl::float3(0.0f), .pdf = 0.0f};
+        }
+        return BsdfEval{
+            .value = this->albedo.sample(ctx, uv) * (cos_theta / PI),
+            .pdf = cos_theta / PI,
+        };
+    }
+
     inline sycl::float3 emitted() const {
         return this->emissive;
     }
@@ -95,18 +181,83 @@ struct MaterialMetallic {
     float roughness;
     sycl::float3 emissive;
 
+    template <typename Context>
     inline bool scatter(
-        const RenderContext &ctx,
-        XorShift32State &rng,
+        const Context &ctx,
+        Rng &rng,
         const sycl::float3 &dir,
         const sycl::float3 &normal,
         const sycl::float2 &uv,
         ScatterResult &result
     ) const {
-        sycl::float3 reflected = reflect(dir, normal);
-        result.dir = reflected + this->roughness * rng.random_unit_vector();
-        result.attenuation = this->albedo.sample(ctx, uv);
-        return dot(result.dir, normal) > 0;
+        sycl::float3 n = face_forward(normal, dir);
+        sycl::float3 f0 = this->albedo.sample(ctx, uv);
+
+        if (this->is_mirror()) {
+            result.dir = reflect(dir, n);
+            result.attenuation = f0;
+            result.pdf = 0.0f;
+            return true;
+        }
+
+        float alpha = this->alpha();
+        Frame frame = Frame::from_normal(n);
+        sycl::float3 wo = frame.to_local(-normalize(dir));
+        if (wo.z() <= 0.0f) return false;
+
+        sycl::float3 h = ggx_sample_vndf(wo, alpha, rng.next_2d());
+        sycl::float3 wi = reflect(-wo, h);
+        // Visible normals can still reflect below the surface at grazing angles
+        if (wi.z() <= 0.0f) return false;
+
+        // D and G1(wo) cancel against the density, which leaves F G2 / G1(wo)
+        float lambda_o = ggx_lambda(wo, alpha);
+        float lambda_i = ggx_lambda(wi, alpha);
+        result.dir = frame.to_world(wi);
+        result.attenuation = fresnel_schlick(f0, dot(wo, h)) *
+                             ((1.0f + lambda_o) / (1.0f + lambda_o + lambda_i));
+        result.pdf = ggx_d(h, alpha) / ((1.0f + lambda_o) * 4.0f * wo.z());
+        return true;
+    }
+
+    template <typename Context>
+    inline BsdfEval eval(
+        const Context &ctx,
+        const sycl::float3 &dir,
+        const sycl::float3 &normal,
+        const sycl::float2 &uv,
+        const sycl::float3 &wi
+    ) const {
+        BsdfEval result = {.value = sycl::float3(0.0f), .pdf = 0.0f};
+        if (this->is_mirror()) return result;
+
+        float alpha = this->alpha();
+        Frame frame = Frame::from_normal(face_forward(normal, dir));
+        sycl::float3 wo = frame.to_local(-normalize(dir));
+        sycl::float3 wi_local = frame.to_local(wi);
+        if (wo.z() <= 0.0f || wi_local.z() <= 0.0f) return result;
+
+        sycl::float3 h = normalize(wo + wi_local);
+        float d = ggx_d(h, alpha);
+        float lambda_o = ggx_lambda(wo, alpha);
+        float lambda_i = ggx_lambda(wi_local, alpha);
+
+        // F D G2 / (4 wo.z wi.z), times the cosine wi.z
+        sycl::float3 f = fresnel_schlick(this->albedo.sample(ctx, uv), dot(wo, h));
+        result.value = f * (d / ((1.0f + lambda_o + lambda_i) * 4.0f * wo.z()));
+        result.pdf = d / ((1.0f + lambda_o) * 4.0f * wo.z());
+        return result;
+    }
+
+    // glTF roughness is perceptual, GGX is parameterized by its square.
+    inline float alpha() const {
+        return this->roughness * this->roughness;
+    }
+
+    // Whether the lobe is a perfect mirror, which has no density and so can't be
+    // combined with light sampling.
+    inline bool is_mirror() const {
+        return this->alpha() < MIN_GGX_ALPHA;
     }
 
     inline sycl::float3 emitted() const {
@@ -124,15 +275,17 @@ struct MaterialDielectric {
         return r0 + (1.0f - r0) * sycl::pow((1.0f - cosine), 5.0f);
     }
 
+    template <typename Context>
     inline bool scatter(
-        const RenderContext &ctx,
-        XorShift32State &rng,
+        const Context &ctx,
+        Rng &rng,
         const sycl::float3 &dir,
         const sycl::float3 &outward_normal,
         const sycl::float2 &uv,
         ScatterResult &result
     ) const {
         result.attenuation = sycl::float3(1, 1, 1);
+        result.pdf = 0.0f;
 
         bool front_face = dot(dir, outward_normal) < 0;
 
@@ -208,25 +361,124 @@ struct Material {
         this->dielectric = dielectric;
     }
 
+    template <typename Context>
     inline bool scatter(
-        const RenderContext &ctx,
-        XorShift32State &rng,
+        const Context &ctx,
+        Rng &rng,
         const sycl::float3 &dir,
         const sycl::float3 &normal,
         const sycl::float2 &uv,
         ScatterResult &result
     ) const {
+        // Types missing from ctx.features are never hit, their branches fold away
+        // when the features are a specialization constant
         switch (this->type) {
         case MaterialType::eDiffuse:
-            return this->diffuse.scatter(ctx, rng, dir, normal, uv, result);
+            return ctx.features.has(MaterialType::eDiffuse) &&
+                   this->diffuse.scatter(ctx, rng, dir, normal, uv, result);
         case MaterialType::eMetallic:
-            return this->metallic.scatter(ctx, rng, dir, normal, uv, result);
+            return ctx.features.has(MaterialType::eMetallic) &&
+                   this->metallic.scatter(ctx, rng, dir, normal, uv, result);
         case MaterialType::eDielectric:
+            return ctx.features.has(MaterialType::eDielectric) &&
+                   this->dielectric.scatter(ctx, rng, dir, normal, uv, result);
+        case MaterialType::eNone: return false;
+        }
+    }
+
+    // Same as scatter(), for callers that already know the material type, so the
+    // switch over material types is resolved at compile time.
+    template <MaterialType Type, typename Context>
+    inline bool scatter_as(
+        const Context &ctx,
+        Rng &rng,
+        const sycl::float3 &dir,
+        const sycl::float3 &normal,
+        const sycl::float2 &uv,
+        ScatterResult &result
+    ) const {
+        if constexpr (Type == MaterialType::eDiffuse) {
+            return this->diffuse.scatter(ctx, rng, dir, normal, uv, result);
+        } else if constexpr (Type == MaterialType::eMetallic) {
+            return this->metallic.scatter(ctx, rng, dir, normal, uv, result);
+        } else if constexpr (Type == MaterialType::eDielectric) {
             return this->dielectric.scatter(ctx, rng, dir, normal, uv, result);
+        } else {
+            return false;
+        }
+    }
+
+    // Whether eval() is supported, so hits on the material sample lights. Mirrors and
+    // dielectrics have no BSDF density.
+    inline bool samples_lights() const {
+        switch (this->type) {
+        case MaterialType::eDiffuse: return true;
+        case MaterialType::eMetallic: return !this->metallic.is_mirror();
+        case MaterialType::eDielectric:
         case MaterialType::eNone: return false;
         }
     }
 
+    template <MaterialType Type> inline bool samples_lights_as() const {
+        if constexpr (Type == MaterialType::eDiffuse) {
+            return true;
+        } else if constexpr (Type == MaterialType::eMetallic) {
+            return !this->metallic.is_mirror();
+        } else {
+            return false;
+        }
+    }
+
+    template <typename Context>
+    inline BsdfEval eval(
+        const Context &ctx,
+        const sycl::float3 &dir,
+        const sycl::float3 &normal,
+        const sycl::float2 &uv,
+        const sycl::float3 &wi
+    ) const {
+        switch (this->type) {
+        case MaterialType::eDiffuse:
+            if (!ctx.features.has(MaterialType::eDiffuse)) break;
+            return this->diffuse.eval(ctx, dir, normal, uv, wi);
+        case MaterialType::eMetallic:
+            if (!ctx.features.has(MaterialType::eMetallic)) break;
+            return this->metallic.eval(ctx, dir, normal, uv, wi);
+        case MaterialType::eDielectric:
+        case MaterialType::eNone: break;
+        }
+        return BsdfEval{.value = sycl::float3(0.0f), .pdf = 0.0f};
+    }
+
+    template <MaterialType Type, typename Context>
+    inline BsdfEval eval_as(
+        const Context &ctx,
+        const sycl::float3 &dir,
+        const sycl::float3 &normal,
+        const sycl::float2 &uv,
+        const sycl::float3 &wi
+    ) const {
+        if constexpr (Type == MaterialType::eDiffuse) {
+            return this->diffuse.eval(ctx, dir, normal, uv, wi);
+        } else if constexpr (Type == MaterialType::eMetallic) {
+            return this->metallic.eval(ctx, dir, normal, uv, wi);
+        } else {
+            return BsdfEval{.value = sycl::float3(0.0f), .pdf = 0.0f};
+        }
+    }
+
+    template <MaterialType Type> inline sycl::float3 emitted_as() const {
+        if constexpr (Type == MaterialType::eDiffuse) {
+            return this->diffuse.emitted();
+        } else if constexpr (Type == MaterialType::eMetallic) {
+            return this->metallic.emitted();
+        } else if constexpr (Type == MaterialType::eDielectric) {
+            return this->dielectric.emitted();
+        } else {
+            return sycl::float3(0.0f);
+        }
+    }
+
     inline sycl::float3 emitted() const {
         switch (this->type) {
         case MaterialType::eDiffuse: return this->diffuse.emitted();
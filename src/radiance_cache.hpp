@@ -0,0 +1,251 @@
+#pragma once
+
+#include <algorithm>
+#include <vector>
+#include <sycl/sycl.hpp>
+#include <embree4/rtcore.h>
+#include <fmt/core.h>
+
+#include "render.hpp"
+#include "render_context.hpp"
+#include "rng.hpp"
+#include "util.hpp"
+
+namespace raytracer {
+
+// Radiance cache: a world space hash grid of the radiance reflected by diffuse
+// surfaces. Paths that reach RenderSettings::radiance_cache_depth look up the cell of
+// their hit. If it has enough samples, the path ends with the cached radiance instead
+// of tracing the rest of its bounces. Otherwise the path continues and everything it
+// gathers from then on, divided by its throughput at the hit, is added to the cell.
+// The cache is cleared at the start of every frame and fills up as paths complete.
+
+// Cells of the hash table. Must be a power of two.
+constexpr uint32_t RADIANCE_CACHE_CELLS = 1u << 20;
+
+// Slots probed after the one a cell hashes to before the cell is given up on.
+constexpr uint32_t RADIANCE_CACHE_MAX_PROBES = 8;
+
+// Cell index of paths that are not recording into the cache.
+constexpr uint32_t RADIANCE_CACHE_NO_CELL = ~0u;
+
+struct RadianceCacheCell {
+    // Hash of the quantized position and normal, 0 while the slot is free
+    uint32_t key;
+    // Paths that recorded their radiance into the cell
+    uint32_t sample_count;
+    // Sum of the reflected radiance of those paths
+    float radiance[3];
+    // Bounce rays traced by those paths after reaching the cell
+    uint32_t recorded_rays;
+    // Paths that ended by reading the cell
+    uint32_t terminated_paths;
+};
+
+template <typename T>
+using GlobalAtomic = sycl::atomic_ref<
+    T,
+    sycl::memory_order_relaxed,
+    sycl::memory_scope_device,
+    sycl::access::address_space::global_space>;
+
+// Whether paths look up and record into the cache.
+template <typename Context>
+static inline bool
+uses_radiance_cache(const Context &ctx, const RenderSettings &settings) {
+    return settings.radiance_cache_depth > 0 && ctx.radiance_cache.cells != nullptr;
+}
+
+// Hash of the cell of a grid with cells of `cell_size` at `position`, on the side of
+// the surface `normal` faces. Never 0. Shared with the guiding field, see guiding.hpp.
+inline uint32_t hash_grid_key(
+    float cell_size, const sycl::float3 &position, const sycl::float3 &normal
+) {
+    sycl::int3 cell = sycl::floor(position / cell_size).convert<int>();
+
+    // Dominant axis and its sign, so both sides of a wall and the faces meeting in a
+    // corner get cells of their own
+    sycl::float3 a = sycl::fabs(normal);
+    uint32_t axis = a.x() >= a.y() && a.x() >= a.z() ? 0u : (a.y() >= a.z() ? 1u : 2u);
+    uint32_t side = axis * 2u + (normal[axis] < 0.0f ? 1u : 0u);
+
+    uint32_t h = hash_u32((uint32_t)cell.x() + 0x9e3779b9u);
+    h = hash_u32(h ^ (uint32_t)cell.y());
+    h = hash_u32(h ^ (uint32_t)cell.z());
+    h = hash_u32(h ^ side);
+    return h != 0 ? h : 1u;
+}
+
+// Index of the cell with `key` in `cells`, a table of `cell_count` cells (a power of
+// two) with a `key` member, claiming a free slot for it if it is not in the table yet.
+// Returns RADIANCE_CACHE_NO_CELL when the probed slots are taken by other cells.
+template <typename Cell>
+inline uint32_t find_hash_grid_cell(Cell *cells, uint32_t cell_count, uint32_t key) {
+    for (uint32_t probe = 0; probe < RADIANCE_CACHE_MAX_PROBES; ++probe) {
+        uint32_t index = (key + probe) & (cell_count - 1);
+        GlobalAtomic<uint32_t> key_ref(cells[index].key);
+
+        uint32_t current = key_ref.load();
+        if (current == 0) {
+            // Another path may claim the slot first, possibly for the same cell
+            key_ref.compare_exchange_strong(current, key);
+            if (current == 0) return index;
+        }
+        if (current == key) return index;
+    }
+    return RADIANCE_CACHE_NO_CELL;
+}
+
+// Index of the radiance cache cell at `position` and `normal`, see find_hash_grid_cell.
+inline uint32_t find_radiance_cache_cell(
+    const RadianceCache &cache, const sycl::float3 &position, const sycl::float3 &normal
+) {
+    return find_hash_grid_cell(
+        cache.cells,
+        RADIANCE_CACHE_CELLS,
+        hash_grid_key(cache.cell_size, position, normal)
+    );
+}
+
+// Reads the mean reflected radiance of `cell` into `radiance` if it has enough samples
+// for paths to end in it, and counts the path as ended there.
+inline bool read_radiance_cache(
+    const RadianceCache &cache, uint32_t cell, sycl::float3 &radiance
+) {
+    RadianceCacheCell &c = cache.cells[cell];
+    uint32_t samples = GlobalAtomic<uint32_t>(c.sample_count).load();
+    if (samples < cache.min_samples) return false;
+
+    for (int i = 0; i < 3; ++i) {
+        radiance[i] = GlobalAtomic<float>(c.radiance[i]).load() / samples;
+    }
+    GlobalAtomic<uint32_t>(c.terminated_paths) += 1;
+    return true;
+}
+
+// Adds `radiance` to the sum of `cell` and `samples` to its sample count.
+inline void add_radiance_cache_sample(
+    const RadianceCache &cache,
+    uint32_t cell,
+    const sycl::float3 &radiance,
+    uint32_t samples
+) {
+    // One infinite or NaN sample would poison the cell for the rest of the frame
+    if (!sycl::isfinite(radiance.x()) || !sycl::isfinite(radiance.y()) ||
+        !sycl::isfinite(radiance.z())) {
+        return;
+    }
+
+    RadianceCacheCell &c = cache.cells[cell];
+    if (samples > 0) {
+        GlobalAtomic<uint32_t>(c.sample_count) += samples;
+    }
+    for (int i = 0; i < 3; ++i) {
+        if (radiance[i] != 0.0f) {
+            GlobalAtomic<float>(c.radiance[i]) += radiance[i];
+        }
+    }
+}
+
+// Counts `rays` bounce rays traced by a path recording into `cell`.
+inline void
+add_radiance_cache_rays(const RadianceCache &cache, uint32_t cell, uint32_t rays) {
+    GlobalAtomic<uint32_t>(cache.cells[cell].recorded_rays) += rays;
+}
+
+// Radiance `contribution` of a path, relative to the throughput it had at the cell
+// it records into. Channels the path did not carry contribute nothing.
+inline sycl::float3
+radiance_cache_sample(const sycl::float3 &contribution, const sycl::float3 &throughput) {
+    sycl::float3 result;
+    for (int i = 0; i < 3; ++i) {
+        result[i] = throughput[i] > 0.0f ? contribution[i] / throughput[i] : 0.0f;
+    }
+    return result;
+}
+
+// Length of the diagonal of the bounds of `scene`, which grid cell sizes default to a
+// fraction of.
+inline float scene_diagonal(const Scene &scene) {
+    RTCBounds bounds;
+    rtcGetSceneBounds(scene.scene, &bounds);
+    return sycl::length(sycl::float3(
+        bounds.upper_x - bounds.lower_x,
+        bounds.upper_y - bounds.lower_y,
+        bounds.upper_z - bounds.lower_z
+    ));
+}
+
+// Allocates the cells of the cache when the settings enable it.
+inline RadianceCache
+create_radiance_cache(sycl::queue &queue, const RenderSettings &settings) {
+    RadianceCache cache = {};
+    if (settings.radiance_cache_depth == 0) return cache;
+
+    cache.cells = (RadianceCacheCell *)sycl::aligned_alloc_device(
+        alignof(RadianceCacheCell),
+        sizeof(RadianceCacheCell) * RADIANCE_CACHE_CELLS,
+        queue
+    );
+    cache.min_samples = std::max(settings.radiance_cache_min_samples, 1u);
+    return cache;
+}
+
+// Empties the cache and sizes its cells for `scene`. Without a cell size in the
+// settings, cells are 1/256 of the diagonal of the scene bounds.
+inline void reset_radiance_cache(
+    sycl::queue &queue,
+    RadianceCache &cache,
+    const Scene &scene,
+    const RenderSettings &settings
+) {
+    if (!cache.cells) return;
+
+    cache.cell_size = settings.radiance_cache_cell_size;
+    if (cache.cell_size <= 0.0f) {
+        cache.cell_size = sycl::fmax(scene_diagonal(scene) / 256.0f, 1e-4f);
+    }
+
+    queue.memset(cache.cells, 0, sizeof(RadianceCacheCell) * RADIANCE_CACHE_CELLS)
+        .wait();
+}
+
+// Prints how many cells the frame filled and how many bounce rays paths that ended in
+// the cache saved, estimated from the rays paths traced after recording into a cell.
+inline void print_radiance_cache_stats(sycl::queue &queue, const RadianceCache &cache) {
+    if (!cache.cells) return;
+
+    std::vector<RadianceCacheCell> cells(RADIANCE_CACHE_CELLS);
+    queue.memcpy(cells.data(), cache.cells, sizeof(RadianceCacheCell) * cells.size())
+        .wait();
+
+    uint64_t used = 0, ready = 0, samples = 0, recorded_rays = 0, terminated = 0;
+    for (const RadianceCacheCell &cell : cells) {
+        if (cell.key == 0) continue;
+        used++;
+        ready += cell.sample_count >= cache.min_samples ? 1 : 0;
+        samples += cell.sample_count;
+        recorded_rays += cell.recorded_rays;
+        terminated += cell.terminated_paths;
+    }
+
+    double rays_per_path = samples > 0 ? (double)recorded_rays / samples : 0.0;
+    fmt::println(
+        "Radiance cache: {} cells ({} converged), cell size {:.4f}",
+        used,
+        ready,
+        cache.cell_size
+    );
+    fmt::println(
+        "Radiance cache: {} paths ended in the cache, {} recorded into it",
+        terminated,
+        samples
+    );
+    fmt::println(
+        "Radiance cache: ~{:.0f} rays saved ({:.2f} bounce rays per recorded path)",
+        terminated * rays_per_path,
+        rays_per_path
+    );
+}
+
+} // namespace raytracer
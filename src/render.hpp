@@ -5,9 +5,114 @@
 #include "camera.hpp"
 #include "image_manager.hpp"
 
+#include <stdexcept>
 #include <vector>
 
 namespace raytracer {
+struct RenderSettings {
+    uint32_t max_depth = 10;
+    uint32_t sample_count = 32;
+
+    // Paths may be terminated by russian roulette once they reach this depth.
+    // 0 disables russian roulette.
+    uint32_t roulette_min_depth = 0;
+
+    // Paths whose throughput exceeds this value are split in two.
+    // 0 disables splitting.
+    float split_threshold = 0.0f;
+
+    // Wavefront only: inject new camera rays into slots freed by terminated paths
+    // instead of tracing each sample as a separate wave.
+    bool regenerate = false;
+
+    // Wavefront only: number of rays in flight when regenerating.
+    // 0 means one ray per pixel.
+    uint32_t ray_pool_size = 0;
+
+    // Wavefront only: record the kernels of a sample once into a SYCL command graph
+    // and replay it for every sample. Falls back to plain submission when the device
+    // does not support command graphs.
+    bool command_graph = true;
+
+    // Adaptive sampling: tiles whose estimated relative error drops below this value
+    // stop taking samples, and the rest of the sample_count * pixels budget goes to
+    // the noisy tiles. 0 disables adaptive sampling.
+    float noise_threshold = 0.0f;
+
+    // GPU renderers: restrict Embree's traversal kernels to the geometry types the
+    // scene uses. When false they are compiled for every feature Embree supports.
+    bool traversal_feature_mask = true;
+
+    // Diffuse hits sample a point on an emissive triangle and trace a shadow ray
+    // towards it, weighted against hitting the light by chance with MIS.
+    bool next_event_estimation = true;
+
+    // Paths end at their first diffuse hit from this bounce on by reading the radiance
+    // cache, once the cell of the hit has radiance_cache_min_samples samples. Until
+    // then they continue and record what they gather into the cell. GPU renderers
+    // only, 0 disables the cache.
+    uint32_t radiance_cache_depth = 0;
+
+    // Samples a radiance cache cell needs before paths end in it. Fewer samples end
+    // paths sooner, but leave more of the cache's noise in the image.
+    uint32_t radiance_cache_min_samples = 32;
+
+    // Edge length of the radiance cache cells in world units. Larger cells fill up
+    // sooner but blur the lighting more. 0 derives it from the scene bounds.
+    float radiance_cache_cell_size = 0.0f;
+
+    // Diffuse hits also sample directions from a distribution of the radiance arriving
+    // at their cell, learned over a hash grid and mixed with the BSDF by one-sample
+    // MIS. Samples are taken in passes of 1, 2, 4... samples, each one guided by what
+    // the passes before it learned. GPU renderers only.
+    bool path_guiding = false;
+
+    // Chance of sampling the guiding distribution instead of the BSDF at guided hits.
+    float guiding_probability = 0.5f;
+
+    // Paths a guiding cell needs to record before the hits in it are guided.
+    uint32_t guiding_min_samples = 64;
+
+    // Edge length of the guiding cells in world units. 0 derives it from the scene
+    // bounds.
+    float guiding_cell_size = 0.0f;
+
+    // Sequence the random numbers of every path are drawn from.
+    SampleSequence sample_sequence = SampleSequence::eSobol;
+
+    // Adaptive sampling: samples every pixel takes before its error is estimated.
+    uint32_t min_samples = 8;
+
+    // Adaptive sampling: most samples a single pixel may take.
+    // 0 means 4 * sample_count.
+    uint32_t max_samples = 0;
+};
+
+// `counts[depth]` is the number of paths terminated right before tracing their ray at
+// `depth`, which is also the number of rays saved at that bounce.
+static void print_roulette_stats(const RenderSettings &settings, const uint64_t *counts) {
+    if (settings.roulette_min_depth == 0) return;
+
+    uint64_t total = 0;
+    for (uint32_t depth = settings.roulette_min_depth; depth < settings.max_depth;
+         ++depth) {
+        fmt::println("\tRoulette: bounce {} saved {} rays", depth, counts[depth]);
+        total += counts[depth];
+    }
+    fmt::println("Paths terminated by roulette: {}", total);
+}
+
+// Size of the frame `camera` renders. Renderers allocate their buffers for
+// `buffer_size` pixels up front, and frames may be smaller, like the edge tiles of a
+// tiled render.
+inline sycl::range<2> frame_size(const Camera &camera, sycl::range<2> buffer_size) {
+    sycl::range<2> size(camera.img_size[0], camera.img_size[1]);
+    if (size[0] > buffer_size[0] || size[1] > buffer_size[1]) {
+        throw std::runtime_error("Frame is larger than the buffers of the renderer");
+    }
+    return size;
+}
+
 struct IRenderer {
     virtual void render_frame(
         const Camera &camera,
@@ -9,11 +9,105 @@
 
 namespace raytracer {
 
+struct InstanceData;
+struct PrimitiveData;
+struct Material;
+struct EmissiveTriangle;
+struct LightAliasEntry;
+struct RadianceCacheCell;
+struct GuidingCell;
+enum class MaterialType : uint8_t;
+enum class TextureType : uint8_t;
+
+// Material, texture and geometry types used by a scene. Material and Texture skip the
+// branches of types that are not set, and Embree only traverses `traversal`, so
+// kernels specialized on the features of a scene only keep the code it needs. See
+// specialization.hpp.
+struct SceneFeatures {
+    // Bit `1 << type` of every MaterialType / TextureType used
+    uint32_t material_types = ~0u;
+    uint32_t texture_types = ~0u;
+    // Passed to Embree as the feature mask of every ray query
+    RTCFeatureFlags traversal = RTC_FEATURE_FLAG_ALL;
+
+    inline bool has(MaterialType type) const {
+        return (this->material_types >> (uint32_t)type) & 1u;
+    }
+    inline bool has(TextureType type) const {
+        return (this->texture_types >> (uint32_t)type) & 1u;
+    }
+};
+
+// Device arrays with the shading data of a scene, see hit_shading_data
+struct ShadingTables {
+    // Indexed by top-level geometry id
+    const InstanceData *instances;
+    const PrimitiveData *primitives;
+    // One per glTF material
+    const Material *materials;
+};
+
+// Device arrays of the emissive triangles of a scene, see sample_light
+struct LightTable {
+    const EmissiveTriangle *triangles;
+    // Picks triangles proportionally to their power, see light_power
+    const LightAliasEntry *alias;
+    uint32_t count;
+    // Sum of the power of every triangle
+    float total_power;
+};
+
+// Radiance of rays that escape the scene: an equirectangular HDR image when `texels`
+// is set, the constant `color` otherwise. See sample_environment.
+struct EnvironmentMap {
+    // width * height linear texels, row 0 looking up (+y)
+    const sycl::float4 *texels;
+    // Picks texels proportionally to environment_texel_weight
+    const LightAliasEntry *alias;
+    uint32_t width;
+    uint32_t height;
+    // Sum of the weights of every texel
+    float total_weight;
+    sycl::float3 color;
+};
+
+// Hash grid of reflected radiance, see radiance_cache.hpp. `cells` is null when the
+// cache is disabled.
+struct RadianceCache {
+    RadianceCacheCell *cells;
+    // Edge length of a cell in world units
+    float cell_size;
+    // Samples a cell needs before paths end in it
+    uint32_t min_samples;
+};
+
+// Distributions of the radiance arriving at diffuse surfaces over a hash grid, see
+// guiding.hpp. `cells` is null when path guiding is disabled.
+struct GuidingField {
+    // Trained by the paths of every pass so far
+    GuidingCell *cells;
+    // GUIDING_BINS values of the normalized CDF of each cell, rebuilt from `cells`
+    // after every pass. The last one is 0 in cells that are not guided yet.
+    float *distributions;
+    // Edge length of a cell in world units
+    float cell_size;
+    // Samples a cell needs before hits in it are guided
+    uint32_t min_samples;
+    // Chance of sampling the distribution instead of the BSDF at guided hits
+    float probability;
+};
+
 struct RenderContext {
     Camera camera;
-    sycl::float3 sky_color;
+    EnvironmentMap environment;
 
     RTCScene scene;
+    ShadingTables tables;
+    LightTable lights;
+    RadianceCache radiance_cache;
+    GuidingField guiding;
+    // Set from the specialization constant inside the kernels
+    SceneFeatures features;
 
     sycl::sampler sampler;
     ImageReadAccessor image_reader;
@@ -21,6 +115,10 @@ struct RenderContext {
 #if USE_STREAMS
     mutable sycl::stream os;
 #endif
+
+    inline sycl::float4 sample_image(uint32_t index, sycl::float2 uv) const {
+        return this->image_reader[index].read(uv, this->sampler);
+    }
 };
 
 } // namespace raytracer
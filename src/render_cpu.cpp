@@ -0,0 +1,401 @@
+#include "render_cpu.hpp"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <sycl/sycl.hpp>
+#include <embree4/rtcore.h>
+
+#include "util.hpp"
+#include "trace_ray.hpp"
+
+using namespace raytracer;
+
+using sycl::float2;
+using sycl::float3;
+using sycl::float4;
+using sycl::int2;
+using sycl::range;
+
+constexpr int TILE_SIZE = 16;
+
+// Host equivalent of RenderContext. Images are sampled straight from the
+// ImageManager's texels, mirroring the normalized/repeat/nearest sampler used on
+// the device.
+struct CpuRenderContext {
+    Camera camera;
+    EnvironmentMap environment;
+
+    RTCScene scene;
+    ShadingTables tables;
+    LightTable lights;
+    // Always empty, the radiance cache and the guiding field live in device memory
+    RadianceCache radiance_cache;
+    GuidingField guiding;
+    SceneFeatures features;
+
+    const Image *images;
+
+    inline sycl::float4 sample_image(uint32_t index, sycl::float2 uv) const {
+        float u = uv.x() - sycl::floor(uv.x());
+        float v = uv.y() - sycl::floor(uv.y());
+        int x = std::min((int)(u * IMAGE_SIZE.x()), IMAGE_SIZE.x() - 1);
+        int y = std::min((int)(v * IMAGE_SIZE.y()), IMAGE_SIZE.y() - 1);
+
+        const uint8_t *texel =
+            &this->images[index].data[(y * IMAGE_SIZE.x() + x) * IMAGE_CHANNELS];
+        return float4(texel[0], texel[1], texel[2], texel[3]) / 255.0f;
+    }
+};
+
+// Packet types and block shapes for each supported packet width. Each packet covers
+// a small block of adjacent pixels so that camera rays stay coherent.
+template <uint32_t N> struct Packet;
+
+template <> struct Packet<4> {
+    using RayHit = RTCRayHit4;
+    static constexpr int WIDTH = 2;
+    static constexpr int HEIGHT = 2;
+
+    static void intersect(
+        const int *valid, RTCScene scene, RayHit *rayhit, RTCIntersectArguments *args
+    ) {
+        rtcIntersect4(valid, scene, rayhit, args);
+    }
+};
+
+template <> struct Packet<8> {
+    using RayHit = RTCRayHit8;
+    static constexpr int WIDTH = 4;
+    static constexpr int HEIGHT = 2;
+
+    static void intersect(
+        const int *valid, RTCScene scene, RayHit *rayhit, RTCIntersectArguments *args
+    ) {
+        rtcIntersect8(valid, scene, rayhit, args);
+    }
+};
+
+template <> struct Packet<16> {
+    using RayHit = RTCRayHit16;
+    static constexpr int WIDTH = 4;
+    static constexpr int HEIGHT = 4;
+
+    static void intersect(
+        const int *valid, RTCScene scene, RayHit *rayhit, RTCIntersectArguments *args
+    ) {
+        rtcIntersect16(valid, scene, rayhit, args);
+    }
+};
+
+template <typename RayHitN>
+static inline void pack_ray(RayHitN &rayhit, uint32_t lane, const RTCRay &ray) {
+    rayhit.ray.org_x[lane] = ray.org_x;
+    rayhit.ray.org_y[lane] = ray.org_y;
+    rayhit.ray.org_z[lane] = ray.org_z;
+    rayhit.ray.tnear[lane] = ray.tnear;
+    rayhit.ray.dir_x[lane] = ray.dir_x;
+    rayhit.ray.dir_y[lane] = ray.dir_y;
+    rayhit.ray.dir_z[lane] = ray.dir_z;
+    rayhit.ray.time[lane] = ray.time;
+    rayhit.ray.tfar[lane] = ray.tfar;
+    rayhit.ray.mask[lane] = ray.mask;
+    rayhit.ray.id[lane] = ray.id;
+    rayhit.ray.flags[lane] = ray.flags;
+    rayhit.hit.geomID[lane] = RTC_INVALID_GEOMETRY_ID;
+    rayhit.hit.instID[0][lane] = RTC_INVALID_GEOMETRY_ID;
+}
+
+template <typename RayHitN>
+static inline RTCRayHit unpack_ray_hit(const RayHitN &rayhit, uint32_t lane) {
+    RTCRayHit result;
+    result.ray.org_x = rayhit.ray.org_x[lane];
+    result.ray.org_y = rayhit.ray.org_y[lane];
+    result.ray.org_z = rayhit.ray.org_z[lane];
+    result.ray.tnear = rayhit.ray.tnear[lane];
+    result.ray.dir_x = rayhit.ray.dir_x[lane];
+    result.ray.dir_y = rayhit.ray.dir_y[lane];
+    result.ray.dir_z = rayhit.ray.dir_z[lane];
+    result.ray.time = rayhit.ray.time[lane];
+    result.ray.tfar = rayhit.ray.tfar[lane];
+    result.ray.mask = rayhit.ray.mask[lane];
+    result.ray.id = rayhit.ray.id[lane];
+    result.ray.flags = rayhit.ray.flags[lane];
+    result.hit.Ng_x = rayhit.hit.Ng_x[lane];
+    result.hit.Ng_y = rayhit.hit.Ng_y[lane];
+    result.hit.Ng_z = rayhit.hit.Ng_z[lane];
+    result.hit.u = rayhit.hit.u[lane];
+    result.hit.v = rayhit.hit.v[lane];
+    result.hit.primID = rayhit.hit.primID[lane];
+    result.hit.geomID = rayhit.hit.geomID[lane];
+    result.hit.instID[0] = rayhit.hit.instID[0][lane];
+    return result;
+}
+
+// Renders all samples of one packet-sized block of pixels. Camera rays are traced
+// as a coherent packet, bounce rays are traced one by one since they diverge.
+template <uint32_t N>
+static void render_block(
+    const CpuRenderContext &ctx,
+    int2 block_origin,
+    range<2> img_size,
+    const RenderSettings &settings,
+    float3 *framebuffer,
+    uint64_t &ray_count,
+    uint64_t *roulette_counts
+) {
+    using P = Packet<N>;
+
+    RTCIntersectArguments coherent_args;
+    rtcInitIntersectArguments(&coherent_args);
+    coherent_args.flags = RTC_RAY_QUERY_FLAG_COHERENT;
+
+    auto on_roulette = [&](uint32_t depth) { roulette_counts[depth]++; };
+
+    alignas(64) int valid[N];
+    int2 pixel_coords[N];
+    float3 colors[N];
+
+    for (uint32_t lane = 0; lane < N; ++lane) {
+        pixel_coords[lane] = {
+            block_origin.x() + (int)(lane % P::WIDTH),
+            block_origin.y() + (int)(lane / P::WIDTH),
+        };
+        bool in_bounds = pixel_coords[lane].x() < (int)img_size[0] &&
+                         pixel_coords[lane].y() < (int)img_size[1];
+        valid[lane] = in_bounds ? -1 : 0;
+
+        colors[lane] = float3(0.0f);
+    }
+
+    for (uint32_t sample = 0; sample < settings.sample_count; ++sample) {
+        alignas(64) typename P::RayHit rayhit;
+        uint32_t rng_keys[N];
+
+        for (uint32_t lane = 0; lane < N; ++lane) {
+            if (!valid[lane]) continue;
+            rng_keys[lane] = Rng::path_key(sample);
+            Rng rng = Rng::at(
+                settings.sample_sequence,
+                ctx.camera.image_pixel(pixel_coords[lane]),
+                rng_keys[lane],
+                0
+            );
+            RTCRay ray = ctx.camera.get_ray(pixel_coords[lane], rng).to_embree();
+            pack_ray(rayhit, lane, ray);
+        }
+
+        P::intersect(valid, ctx.scene, &rayhit, &coherent_args);
+
+        for (uint32_t lane = 0; lane < N; ++lane) {
+            if (!valid[lane]) continue;
+
+            ray_count++;
+
+            RTCRayHit lane_hit = unpack_ray_hit(rayhit, lane);
+            PathState path = {
+                .ray = lane_hit.ray,
+                .attenuation = float3(1.0f),
+                .radiance = float3(0.0f),
+                .depth = 0,
+                .rng_key = rng_keys[lane],
+                .bsdf_pdf = 0.0f,
+            };
+            PathState split;
+            ShadowRay shadow;
+
+            uint32_t path_count = advance_path(
+                ctx, settings, lane_hit, path, &split, shadow, colors[lane], on_roulette
+            );
+
+            // Bounce rays are incoherent, so they are traced one by one
+            uint32_t lane_ray_count = 0;
+            colors[lane] += trace_shadow_ray(ctx, shadow, lane_ray_count);
+            if (path_count >= 1) {
+                colors[lane] +=
+                    trace_path(ctx, settings, path, lane_ray_count, on_roulette);
+            }
+            if (path_count == 2) {
+                colors[lane] +=
+                    trace_path(ctx, settings, split, lane_ray_count, on_roulette);
+            }
+            ray_count += lane_ray_count;
+        }
+    }
+
+    for (uint32_t lane = 0; lane < N; ++lane) {
+        if (!valid[lane]) continue;
+        size_t i = pixel_coords[lane].x() + pixel_coords[lane].y() * img_size[0];
+        framebuffer[i] = colors[lane] / (float)settings.sample_count;
+    }
+}
+
+template <uint32_t N>
+static void render_tile(
+    const CpuRenderContext &ctx,
+    int2 tile_origin,
+    range<2> img_size,
+    const RenderSettings &settings,
+    float3 *framebuffer,
+    uint64_t &ray_count,
+    uint64_t *roulette_counts
+) {
+    static_assert(TILE_SIZE % Packet<N>::WIDTH == 0);
+    static_assert(TILE_SIZE % Packet<N>::HEIGHT == 0);
+
+    for (int y = 0; y < TILE_SIZE; y += Packet<N>::HEIGHT) {
+        for (int x = 0; x < TILE_SIZE; x += Packet<N>::WIDTH) {
+            int2 block_origin = {tile_origin.x() + x, tile_origin.y() + y};
+            if (block_origin.x() >= (int)img_size[0] ||
+                block_origin.y() >= (int)img_size[1]) {
+                continue;
+            }
+            render_block<N>(
+                ctx,
+                block_origin,
+                img_size,
+                settings,
+                framebuffer,
+                ray_count,
+                roulette_counts
+            );
+        }
+    }
+}
+
+CpuRenderer::CpuRenderer(
+    App &app,
+    sycl::range<2> img_size,
+    sycl::image<2> &image,
+    const RenderSettings &settings,
+    uint32_t packet_size
+)
+    : app(app), buffer_size(img_size), img_size(img_size), image(image),
+      settings(settings),
+      packet_size(packet_size) {
+    if (packet_size != 4 && packet_size != 8 && packet_size != 16) {
+        throw std::runtime_error("Packet size must be 4, 8 or 16");
+    }
+}
+
+void CpuRenderer::render_frame(const Camera &camera, const Scene &scene) {
+    this->img_size = frame_size(camera, this->buffer_size);
+
+    CpuRenderContext ctx = {
+        .camera = camera,
+        .environment = scene.environment,
+        .scene = scene.scene,
+        .tables = scene.tables,
+        .lights = scene.lights,
+        .radiance_cache = {},
+        .guiding = {},
+        .features = scene.features(),
+        .images = scene.image_baker.images.data(),
+    };
+
+    std::vector<float3> framebuffer(img_size.size(), float3(0.0f));
+
+    const uint32_t tiles_x = (img_size[0] + TILE_SIZE - 1) / TILE_SIZE;
+    const uint32_t tiles_y = (img_size[1] + TILE_SIZE - 1) / TILE_SIZE;
+    const uint32_t tile_count = tiles_x * tiles_y;
+
+    std::atomic<uint32_t> next_tile = 0;
+    std::atomic<uint64_t> total_ray_count = 0;
+    std::vector<std::atomic<uint64_t>> total_roulette_counts(settings.max_depth);
+
+    auto worker = [&]() {
+        uint64_t ray_count = 0;
+        std::vector<uint64_t> roulette_counts(settings.max_depth, 0);
+        for (uint32_t tile = next_tile++; tile < tile_count; tile = next_tile++) {
+            int2 tile_origin = {
+                (int)((tile % tiles_x) * TILE_SIZE),
+                (int)((tile / tiles_x) * TILE_SIZE),
+            };
+
+            switch (this->packet_size) {
+            case 4:
+                render_tile<4>(
+                    ctx,
+                    tile_origin,
+                    img_size,
+                    settings,
+                    framebuffer.data(),
+                    ray_count,
+                    roulette_counts.data()
+                );
+                break;
+            case 8:
+                render_tile<8>(
+                    ctx,
+                    tile_origin,
+                    img_size,
+                    settings,
+                    framebuffer.data(),
+                    ray_count,
+                    roulette_counts.data()
+                );
+                break;
+            case 16:
+                render_tile<16>(
+                    ctx,
+                    tile_origin,
+                    img_size,
+                    settings,
+                    framebuffer.data(),
+                    ray_count,
+                    roulette_counts.data()
+                );
+                break;
+            }
+        }
+        total_ray_count += ray_count;
+        for (uint32_t depth = 0; depth < settings.max_depth; ++depth) {
+            total_roulette_counts[depth] += roulette_counts[depth];
+        }
+    };
+
+    uint32_t thread_count = std::max(1u, std::thread::hardware_concurrency());
+    fmt::println(
+        "Rendering {} tiles on {} threads with packet size {}",
+        tile_count,
+        thread_count,
+        this->packet_size
+    );
+
+    auto begin = std::chrono::high_resolution_clock::now();
+
+    std::vector<std::thread> threads;
+    for (uint32_t i = 0; i < thread_count; ++i) {
+        threads.emplace_back(worker);
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin);
+
+    uint64_t ray_count = total_ray_count;
+
+    double secs = elapsed.count() * 1e-9;
+    double rays_per_sec = (double)ray_count / secs;
+
+    fmt::println("Time measured: {:.6f} seconds", secs);
+    fmt::println("Total rays: {}", ray_count);
+    fmt::println("Rays/sec: {:.2f}M", rays_per_sec / 1000000.0);
+
+    std::vector<uint64_t> roulette_counts(
+        total_roulette_counts.begin(), total_roulette_counts.end()
+    );
+    print_roulette_stats(settings, roulette_counts.data());
+
+    {
+        auto image_writer = image.get_access<float4, sycl::access::mode::write>();
+        for (size_t y = 0; y < img_size[1]; ++y) {
+            for (size_t x = 0; x < img_size[0]; ++x) {
+                float3 pixel_color = linear_to_gamma(framebuffer[x + y * img_size[0]]);
+                image_writer.write(int2(x, y), float4(pixel_color, 1.0f));
+            }
+        }
+    }
+}
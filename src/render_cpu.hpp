@@ -0,0 +1,27 @@
+#pragma once
+
+#include "render.hpp"
+
+namespace raytracer {
+// Host-side renderer that traces the scene with Embree's CPU packet API.
+// Requires the App (and therefore the Scene) to be created with a CPU Embree device.
+struct CpuRenderer : public IRenderer {
+    App &app;
+    // Pixels of the output image, and the size of the current frame
+    sycl::range<2> buffer_size;
+    sycl::range<2> img_size;
+    sycl::image<2> &image;
+    const RenderSettings settings;
+    const uint32_t packet_size;
+
+    CpuRenderer(
+        App &app,
+        sycl::range<2> img_size,
+        sycl::image<2> &image,
+        const RenderSettings &settings,
+        uint32_t packet_size
+    );
+
+    virtual void render_frame(const Camera &camera, const Scene &scene) override;
+};
+} // namespace raytracer
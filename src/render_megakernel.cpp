@@ -17,85 +17,109 @@ using sycl::float4;
 using sycl::int2;
 using sycl::range;
 
+class MegakernelRenderPass;
+
+template <typename OnRoulette>
 static float3 render_pixel(
     const RenderContext &ctx,
-    XorShift32State &rng,
+    uint32_t rng_key,
     int2 pixel_coords,
-    uint32_t max_depth,
-    uint32_t &ray_count
+    const RenderSettings &settings,
+    uint32_t &ray_count,
+    OnRoulette on_roulette
 ) {
-    float3 attenuation = float3(1.0f);
-    float3 radiance = float3(0.0f);
-
-    RayData ray_data = ctx.camera.get_ray(pixel_coords, rng);
-    for (uint32_t i = 0; i < max_depth; ++i) {
-        ray_count++;
-
-        float3 attenuation = float3(ray_data.att_r, ray_data.att_g, ray_data.att_b);
-        float3 radiance = float3(ray_data.rad_r, ray_data.rad_g, ray_data.rad_b);
-
-        auto ray = ray_data.to_embree();
-
-        auto res = trace_ray(ctx, rng, ray, attenuation, radiance);
-
-        ray_data.org_x = ray.org_x;
-        ray_data.org_y = ray.org_y;
-        ray_data.org_z = ray.org_z;
-
-        ray_data.dir_x = ray.dir_x;
-        ray_data.dir_y = ray.dir_y;
-        ray_data.dir_z = ray.dir_z;
-
-        ray_data.att_r = attenuation.x();
-        ray_data.att_g = attenuation.y();
-        ray_data.att_b = attenuation.z();
-
-        ray_data.rad_r = radiance.x();
-        ray_data.rad_g = radiance.y();
-        ray_data.rad_b = radiance.z();
-
-        if (res) {
-            return *res;
-        }
-    }
-
-    return float3(0, 0, 0);
+    Rng rng = Rng::at(
+        settings.sample_sequence, ctx.camera.image_pixel(pixel_coords), rng_key, 0
+    );
+    PathState path = {
+        .ray = ctx.camera.get_ray(pixel_coords, rng).to_embree(),
+        .attenuation = float3(1.0f),
+        .radiance = float3(0.0f),
+        .depth = 0,
+        .rng_key = rng_key,
+        .bsdf_pdf = 0.0f,
+    };
+
+    return trace_path(ctx, settings, path, ray_count, on_roulette);
 }
 
 MegakernelRenderer::MegakernelRenderer(
     App &app,
     sycl::range<2> img_size,
     sycl::image<2> &image,
-    uint32_t max_depth,
-    uint32_t sample_count
+    const RenderSettings &settings
 )
-    : app(app), img_size(img_size), image(image), max_depth(max_depth),
-      sample_count(sample_count) {}
+    : app(app), buffer_size(img_size), img_size(img_size), image(image),
+      settings(settings),
+      sampler(app, img_size, settings) {
+    this->accumulation = (float *)sycl::aligned_alloc_device(
+        alignof(sycl::float4), sizeof(sycl::float4) * img_size.size(), app.queue
+    );
+    this->radiance_cache = create_radiance_cache(app.queue, settings);
+    this->guiding = create_guiding_field(app.queue, settings);
+}
 
-void MegakernelRenderer::render_frame(const Camera &camera, const Scene &scene) {
-    uint64_t initial_ray_count = 0;
-    sycl::buffer<uint64_t> ray_count_buffer{&initial_ray_count, 1};
+// Resolves the accumulated samples into the output image.
+void MegakernelRenderer::resolve_image() {
+    app.queue
+        .submit([&](sycl::handler &cgh) {
+            auto image_writer = image.get_access<float4, sycl::access::mode::write>(cgh);
 
-    auto begin = std::chrono::high_resolution_clock::now();
+            const auto img_size = this->img_size;
+            const uint32_t *pixel_samples = this->sampler.pixel_samples;
+            const float *accumulation = this->accumulation;
+
+            cgh.parallel_for(sycl::range<2>(img_size), [=](sycl::item<2> item) {
+                int2 pixel_coords = {item[0], item[1]};
+                size_t i = pixel_coords[0] + pixel_coords[1] * img_size[0];
 
-    uint32_t max_depth = this->max_depth;
-    uint32_t sample_count = this->sample_count;
+                float3 pixel_color = float3(
+                    accumulation[i * 4 + 0],
+                    accumulation[i * 4 + 1],
+                    accumulation[i * 4 + 2]
+                );
+                pixel_color /= (float)sycl::max(pixel_samples[i], 1u);
+
+                pixel_color = linear_to_gamma(pixel_color);
+
+                image_writer.write(pixel_coords, float4(pixel_color, 1.0f));
+            });
+        })
+        .wait();
+}
+
+// Takes `pass_samples` samples for every active pixel and adds them to the
+// accumulation buffers.
+void MegakernelRenderer::render_pass(
+    const Camera &camera,
+    const Scene &scene,
+    uint32_t pass_samples,
+    sycl::buffer<uint64_t> &ray_count_buffer,
+    sycl::buffer<uint64_t> &roulette_count_buffer
+) {
+    const RenderSettings base_settings = this->settings;
 
     auto e = app.queue.submit([&](sycl::handler &cgh) {
         sycl::stream os(8192, 256, cgh);
 
-        auto image_writer = image.get_access<float4, sycl::access::mode::write>(cgh);
-        auto ray_count = ray_count_buffer.get_access<sycl::access_mode::write>(cgh);
+        this->specialization->apply(cgh);
+
+        auto ray_count = ray_count_buffer.get_access<sycl::access_mode::read_write>(cgh);
+        auto roulette_count =
+            roulette_count_buffer.get_access<sycl::access_mode::read_write>(cgh);
 
-        range<2> local_size{8, 8};
-        range<2> n_groups = img_size;
-        n_groups[0] = ((img_size[0] + local_size[0] - 1) / local_size[0]);
-        n_groups[1] = ((img_size[1] + local_size[1] - 1) / local_size[1]);
+        // One group per tile of active pixels
+        range<1> local_size = ADAPTIVE_TILE_SIZE * ADAPTIVE_TILE_SIZE;
+        range<1> n_groups = ((img_size.size() + local_size - 1) / local_size);
 
-        RenderContext ctx = {
+        RenderContext base_ctx = {
             .camera = camera,
-            .sky_color = scene.sky_color,
+            .environment = scene.environment,
             .scene = scene.scene,
+            .tables = scene.tables,
+            .lights = scene.lights,
+            .radiance_cache = this->radiance_cache,
+            .guiding = this->guiding,
             .sampler = sycl::sampler(
                 sycl::coordinate_normalization_mode::normalized,
                 sycl::addressing_mode::repeat,
@@ -108,18 +132,28 @@ void MegakernelRenderer::render_frame(const Camera &camera, const Scene &scene)
         };
 
         const auto img_size = this->img_size;
+        const uint32_t *active_pixels = this->sampler.active_pixels;
+        const uint32_t *active_pixel_count = this->sampler.active_pixel_count;
+        uint32_t *pixel_samples = this->sampler.pixel_samples;
+        float *accumulation = this->accumulation;
+        float *even_accumulation = this->sampler.even_accumulation;
 
         sycl::local_accessor<uint32_t, 1> local_ray_count_accessor(
             sycl::range<1>(1), cgh
         );
+        sycl::local_accessor<uint32_t, 1> local_roulette_count_accessor(
+            sycl::range<1>(base_settings.max_depth), cgh
+        );
 
-        cgh.parallel_for(
-            sycl::nd_range<2>(n_groups * local_size, local_size),
-            [=](sycl::nd_item<2> id, sycl::kernel_handler h) {
-                auto global_id = id.get_global_id();
-                if (global_id[0] >= img_size[0] || global_id[1] >= img_size[1]) {
-                    return;
-                }
+        cgh.parallel_for<MegakernelRenderPass>(
+            sycl::nd_range<1>(n_groups * local_size, local_size),
+            [=](sycl::nd_item<1> id, sycl::kernel_handler h) {
+                RenderContext ctx = base_ctx;
+                RenderSettings settings = base_settings;
+                specialize_kernel(h, ctx, settings);
+
+                auto global_id = id.get_global_id(0);
+                bool in_bounds = global_id < *active_pixel_count;
 
                 sycl::atomic_ref<
                     uint64_t,
@@ -135,40 +169,125 @@ void MegakernelRenderer::render_frame(const Camera &camera, const Scene &scene)
                     sycl::access::address_space::local_space>
                     local_ray_count_ref(local_ray_count_accessor[0]);
 
-                if (id.get_local_linear_id() == 0) {
+                const uint32_t local_id = id.get_local_linear_id();
+                const uint32_t local_range = id.get_local_range().size();
+
+                if (local_id == 0) {
                     local_ray_count_ref = 0;
                 }
-
-                int2 pixel_coords = {global_id[0], global_id[1]};
-
-                auto init_generator_state =
-                    std::hash<std::size_t>{}(id.get_global_linear_id());
-                auto rng = XorShift32State{(uint32_t)init_generator_state};
-
-                uint32_t ray_count = 0;
-                float3 pixel_color = float3(0, 0, 0);
-                for (uint32_t i = 0; i < sample_count; ++i) {
-                    pixel_color +=
-                        render_pixel(ctx, rng, pixel_coords, max_depth, ray_count);
+                for (uint32_t d = local_id; d < settings.max_depth; d += local_range) {
+                    local_roulette_count_accessor[d] = 0;
                 }
-                pixel_color /= (float)sample_count;
-
-                pixel_color = linear_to_gamma(pixel_color);
 
-                image_writer.write(pixel_coords, float4(pixel_color, 1.0f));
+                id.barrier(sycl::access::fence_space::local_space);
 
-                local_ray_count_ref += ray_count;
+                if (in_bounds) {
+                    uint32_t pixel = active_pixels[global_id];
+                    int2 pixel_coords = {pixel % img_size[0], pixel / img_size[0]};
+                    uint32_t first_sample = pixel_samples[pixel];
+
+                    auto on_roulette = [&](uint32_t depth) {
+                        sycl::atomic_ref<
+                            uint32_t,
+                            sycl::memory_order_relaxed,
+                            sycl::memory_scope_work_group,
+                            sycl::access::address_space::local_space>
+                            count_ref(local_roulette_count_accessor[depth]);
+                        count_ref += 1;
+                    };
+
+                    uint32_t ray_count = 0;
+                    float3 pixel_color = float3(0, 0, 0);
+                    float3 even_color = float3(0, 0, 0);
+                    for (uint32_t i = 0; i < pass_samples; ++i) {
+                        uint32_t sample = first_sample + i;
+                        uint32_t rng_key = Rng::path_key(sample);
+                        float3 sample_color = render_pixel(
+                            ctx, rng_key, pixel_coords, settings, ray_count, on_roulette
+                        );
+                        pixel_color += sample_color;
+                        if (sample % 2 == 0) {
+                            even_color += sample_color;
+                        }
+                    }
+
+                    // Each pixel is owned by a single work-item
+                    for (int c = 0; c < 3; ++c) {
+                        accumulation[pixel * 4 + c] += pixel_color[c];
+                        even_accumulation[pixel * 4 + c] += even_color[c];
+                    }
+                    pixel_samples[pixel] = first_sample + pass_samples;
+
+                    local_ray_count_ref += ray_count;
+                }
 
                 id.barrier(sycl::access::fence_space::local_space);
 
-                if (id.get_local_linear_id() == 0) {
+                if (local_id == 0) {
                     global_ray_count_ref += local_ray_count_ref;
                 }
+                for (uint32_t d = local_id; d < settings.max_depth; d += local_range) {
+                    if (local_roulette_count_accessor[d] == 0) continue;
+                    sycl::atomic_ref<
+                        uint64_t,
+                        sycl::memory_order_relaxed,
+                        sycl::memory_scope_device,
+                        sycl::access::address_space::global_space>
+                        global_roulette_count_ref(roulette_count[d]);
+                    global_roulette_count_ref += local_roulette_count_accessor[d];
+                }
             }
         );
     });
 
     e.wait_and_throw();
+}
+
+void MegakernelRenderer::render_frame(const Camera &camera, const Scene &scene) {
+    uint64_t initial_ray_count = 0;
+    sycl::buffer<uint64_t> ray_count_buffer{&initial_ray_count, 1};
+
+    std::vector<uint64_t> roulette_counts(settings.max_depth, 0);
+    sycl::buffer<uint64_t> roulette_count_buffer{
+        roulette_counts.data(), roulette_counts.size()
+    };
+
+    SceneFeatures features = kernel_features(scene, settings);
+    if (!this->specialization ||
+        !this->specialization->matches(features, settings.max_depth)) {
+        this->specialization = specialize_kernels(
+            app.queue,
+            {sycl::get_kernel_id<MegakernelRenderPass>()},
+            features,
+            settings.max_depth
+        );
+    }
+
+    auto begin = std::chrono::high_resolution_clock::now();
+
+    this->img_size = frame_size(camera, this->buffer_size);
+    this->sampler.resize(this->img_size);
+
+    app.queue.memset(this->accumulation, 0, sizeof(sycl::float4) * img_size.size());
+    this->sampler.reset(app.queue);
+    reset_radiance_cache(app.queue, this->radiance_cache, scene, settings);
+    reset_guiding_field(app.queue, this->guiding, scene, settings);
+
+    // Every pass takes `pass_samples` samples for each active pixel, and guides its
+    // paths with what the passes before it learned
+    uint32_t pass = 0;
+    while (uint32_t pass_samples = this->sampler.next_pass_samples()) {
+        pass_samples =
+            std::min(pass_samples, guiding_pass_samples(this->guiding, pass++));
+        this->render_pass(
+            camera, scene, pass_samples, ray_count_buffer, roulette_count_buffer
+        );
+
+        this->sampler.finish_pass(app.queue, pass_samples, this->accumulation);
+        update_guiding_field(app.queue, this->guiding);
+    }
+
+    this->resolve_image();
 
     auto end = std::chrono::high_resolution_clock::now();
     auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin);
@@ -182,6 +301,9 @@ void MegakernelRenderer::render_frame(const Camera &camera, const Scene &scene)
     fmt::println("Total rays: {}", ray_count);
     fmt::println("Rays/sec: {:.2f}M", rays_per_sec / 1000000.0);
 
-    fmt::println("Writing image to disk");
-    write_image(app.queue, image, img_size[0], img_size[1]);
+    auto roulette_count = roulette_count_buffer.get_host_access();
+    print_roulette_stats(settings, &roulette_count[0]);
+    this->sampler.print_histogram(app.queue);
+    print_radiance_cache_stats(app.queue, this->radiance_cache);
+    print_guiding_stats(app.queue, this->guiding);
 }
@@ -1,23 +1,48 @@
 #pragma once
 
 #include "render.hpp"
+#include "adaptive_sampling.hpp"
+#include "guiding.hpp"
+#include "radiance_cache.hpp"
+#include "specialization.hpp"
 
 namespace raytracer {
 struct MegakernelRenderer : public IRenderer {
     App &app;
+    // Pixels the buffers were allocated for, and the size of the current frame
+    sycl::range<2> buffer_size;
     sycl::range<2> img_size;
     sycl::image<2> &image;
-    const uint32_t max_depth;
-    const uint32_t sample_count;
+    const RenderSettings settings;
+
+    // Per pixel RGBA sums of all samples
+    float *accumulation;
+    AdaptiveSampler sampler;
+    // Filled by the paths of the frame, see radiance_cache.hpp
+    RadianceCache radiance_cache;
+    // Trained by the passes of the frame, see guiding.hpp
+    GuidingField guiding;
+
+    // Render kernel built for the features of the last rendered scene
+    std::optional<KernelSpecialization> specialization;
 
     MegakernelRenderer(
         App &app,
         sycl::range<2> img_size,
         sycl::image<2> &image,
-        uint32_t max_depth,
-        uint32_t sample_count
+        const RenderSettings &settings
     );
 
     virtual void render_frame(const Camera &camera, const Scene &scene) override;
+
+  private:
+    void render_pass(
+        const Camera &camera,
+        const Scene &scene,
+        uint32_t pass_samples,
+        sycl::buffer<uint64_t> &ray_count_buffer,
+        sycl::buffer<uint64_t> &roulette_count_buffer
+    );
+    void resolve_image();
 };
 } // namespace raytracer
@@ -1,5 +1,8 @@
 #include "render_wavefront.hpp"
 
+#include <functional>
+#include <optional>
+
 #include "trace_ray.hpp"
 
 using namespace raytracer;
@@ -12,214 +15,662 @@ using sycl::half3;
 using sycl::int2;
 using sycl::range;
 
-struct ScopedRng {
-    ScopedRng(int2 pixel_coords, sycl::range<2> img_size, XorShift32State *rng_buffer) {
-        this->rng_ptr = &rng_buffer[pixel_coords[0] + (pixel_coords[1] * img_size[0])];
-        this->rng = *this->rng_ptr;
-    }
+class WavefrontIntersectRays;
+class WavefrontTraceShadowRays;
+template <typename Dispatch> class WavefrontShadeRays;
 
-    ~ScopedRng() {
-        *this->rng_ptr = this->rng;
+// Without regeneration every pixel has exactly one ray in flight, so the ray
+// buffers need to fit the whole frame.
+static size_t ray_pool_capacity(sycl::range<2> img_size, const RenderSettings &settings) {
+    if (settings.regenerate && settings.ray_pool_size > 0) {
+        return settings.ray_pool_size;
     }
+    return img_size.size();
+}
 
-    operator XorShift32State &() {
-        return rng;
+// Regenerating rays needs the host to decide how many slots to refill after every
+// bounce, so only the fixed sample pipeline is recorded into a graph.
+static bool can_use_graph(const sycl::device &device, const RenderSettings &settings) {
+    if (!settings.command_graph || settings.regenerate) {
+        return false;
     }
+#ifdef SYCL_EXT_ONEAPI_GRAPH
+    return device.has(sycl::aspect::ext_oneapi_limited_graph);
+#else
+    return false;
+#endif
+}
 
-  private:
-    XorShift32State rng;
-    XorShift32State *rng_ptr;
-};
+static sycl::queue make_wavefront_queue(App &app, bool profiling) {
+    sycl::property_list properties = {sycl::property::queue::in_order()};
+    if (profiling) {
+        properties = {
+            sycl::property::queue::in_order(), sycl::property::queue::enable_profiling()};
+    }
+    return sycl::queue(
+        app.queue.get_context(), app.queue.get_device(), exception_handler, properties
+    );
+}
 
 WavefrontRenderer::WavefrontRenderer(
     App &app,
     sycl::range<2> img_size,
     sycl::image<2> &output_image,
-    uint32_t max_depth,
-    uint32_t sample_count
+    const RenderSettings &settings
 )
-    : app(app), img_size(img_size),
-      image(sycl::image_channel_order::rgba, sycl::image_channel_type::fp32, img_size),
-      combined_image(
-          sycl::image_channel_order::rgba, sycl::image_channel_type::fp32, img_size
-      ),
-      buffers({Buffers(app, img_size), Buffers(app, img_size)}),
-      output_image(output_image), max_depth(max_depth), sample_count(sample_count) {
-    this->rng_buffer = (XorShift32State *)sycl::aligned_alloc_device(
-        alignof(XorShift32State), sizeof(XorShift32State) * img_size.size(), app.queue
+    : app(app), use_graph(can_use_graph(app.queue.get_device(), settings)),
+      profiling(!use_graph), queue(make_wavefront_queue(app, profiling)),
+      buffer_size(img_size), img_size(img_size), output_image(output_image),
+      pool_size(ray_pool_capacity(img_size, settings)),
+      buffers({Buffers(app, pool_size), Buffers(app, pool_size)}),
+      sampler(app, img_size, settings), settings(settings) {
+    *this->buffers[0].ray_buffer_length = 0;
+    *this->buffers[1].ray_buffer_length = 0;
+
+    this->accumulation = (float *)sycl::aligned_alloc_device(
+        alignof(sycl::float4), sizeof(sycl::float4) * img_size.size(), app.queue
     );
 
-    app.queue
-        .submit([&](sycl::handler &cgh) {
-            auto image_writer =
-                this->image.get_access<sycl::float4, sycl::access::mode::write>(cgh);
-            auto combined_image_writer =
-                this->image.get_access<sycl::float4, sycl::access::mode::write>(cgh);
+    if (settings.regenerate) {
+        fmt::println("Regenerating rays with a pool of {} rays", this->pool_size);
+    }
 
-            auto rng_buffer = this->rng_buffer;
-            auto img_size = this->img_size;
+    this->hits = (HitRecord *)sycl::aligned_alloc_device(
+        alignof(HitRecord), sizeof(HitRecord) * pool_size, app.queue
+    );
+    this->ray_bins = (uint8_t *)sycl::aligned_alloc_device(
+        alignof(uint8_t), sizeof(uint8_t) * pool_size, app.queue
+    );
+    this->sorted_ray_indices = (uint32_t *)sycl::aligned_alloc_device(
+        alignof(uint32_t), sizeof(uint32_t) * pool_size, app.queue
+    );
+    this->bin_counts = (uint32_t *)sycl::aligned_alloc_device(
+        alignof(uint32_t), sizeof(uint32_t) * SHADE_BIN_COUNT, app.queue
+    );
+    this->bin_offsets = (uint32_t *)sycl::aligned_alloc_device(
+        alignof(uint32_t), sizeof(uint32_t) * SHADE_BIN_COUNT, app.queue
+    );
+    this->bin_cursors = (uint32_t *)sycl::aligned_alloc_device(
+        alignof(uint32_t), sizeof(uint32_t) * SHADE_BIN_COUNT, app.queue
+    );
+    this->shadow_records = (ShadowRecord *)sycl::aligned_alloc_device(
+        alignof(ShadowRecord), sizeof(ShadowRecord) * pool_size, app.queue
+    );
 
-            cgh.parallel_for(sycl::range<2>(img_size), [=](sycl::item<2> item) {
-                sycl::int2 pixel_coords(item[0], item[1]);
+    this->traced_ray_count = (uint64_t *)sycl::aligned_alloc_shared(
+        alignof(uint64_t), sizeof(uint64_t), app.queue
+    );
+    this->split_count = (uint64_t *)sycl::aligned_alloc_device(
+        alignof(uint64_t), sizeof(uint64_t), app.queue
+    );
 
-                image_writer.write(pixel_coords, sycl::float4(0.0f));
-                combined_image_writer.write(pixel_coords, sycl::float4(0.0f));
+    this->roulette_counts = (uint64_t *)sycl::aligned_alloc_shared(
+        alignof(uint64_t), sizeof(uint64_t) * settings.max_depth, app.queue
+    );
+    std::fill(this->roulette_counts, this->roulette_counts + settings.max_depth, 0);
 
-                // Initialize RNG state
-                uint32_t pixel_linear_pos =
-                    pixel_coords[0] + (pixel_coords[1] * img_size[0]);
-                auto init_generator_state = std::hash<std::size_t>{}(pixel_linear_pos);
-                rng_buffer[pixel_linear_pos] =
-                    XorShift32State{(uint32_t)init_generator_state};
-            });
-        })
-        .wait();
+    this->radiance_cache = create_radiance_cache(app.queue, settings);
+    this->guiding = create_guiding_field(app.queue, settings);
 }
 
-void WavefrontRenderer::generate_camera_rays(const Camera &camera, uint32_t sample) {
-    app.queue
-        .submit([&](sycl::handler &cgh) {
-            // Group size / range
-            range<2> local_size{16, 16};
-            range<2> n_groups = {
-                ((img_size[0] + local_size[0] - 1) / local_size[0]),
-                ((img_size[1] + local_size[1] - 1) / local_size[1]),
-            };
-            sycl::nd_range<2> for_range(n_groups * local_size, local_size);
-
-            // Accessors
-            auto image_writer =
-                this->image.get_access<sycl::float4, sycl::access::mode::write>(cgh);
-
-            // Params
-            auto img_size = this->img_size;
-            auto rng_buffer = this->rng_buffer;
-            auto ray_ids = this->current_buffer().ray_ids;
-            auto ray_origins = this->current_buffer().ray_origins;
-            auto ray_directions = this->current_buffer().ray_directions;
-            auto ray_attenuations = this->current_buffer().ray_attenuations;
-            auto ray_radiances = this->current_buffer().ray_radiances;
+// Generates the next sample of every active pixel. Pixels are listed tile by tile, so
+// neighbouring rays start out coherent.
+void WavefrontRenderer::generate_camera_rays(const Camera &camera) {
+    this->queue.submit([&](sycl::handler &cgh) {
+        // Group size / range
+        range<1> local_size = ADAPTIVE_TILE_SIZE * ADAPTIVE_TILE_SIZE;
+        range<1> n_groups = ((img_size.size() + local_size - 1) / local_size);
+        sycl::nd_range<1> for_range(n_groups * local_size, local_size);
+
+        // Params
+        auto img_size = this->img_size;
+        auto ray_ids = this->current_buffer().ray_ids;
+        auto ray_origins = this->current_buffer().ray_origins;
+        auto ray_directions = this->current_buffer().ray_directions;
+        auto ray_attenuations = this->current_buffer().ray_attenuations;
+        auto ray_radiances = this->current_buffer().ray_radiances;
+        auto ray_depths = this->current_buffer().ray_depths;
+        auto ray_rng_keys = this->current_buffer().ray_rng_keys;
+        auto ray_bsdf_pdfs = this->current_buffer().ray_bsdf_pdfs;
+        auto ray_cache_cells = this->current_buffer().ray_cache_cells;
+        auto ray_cache_throughputs = this->current_buffer().ray_cache_throughputs;
+        auto ray_guide_bins = this->current_buffer().ray_guide_bins;
+        auto ray_guide_throughputs = this->current_buffer().ray_guide_throughputs;
+        auto sequence = this->settings.sample_sequence;
+        auto ray_buffer_length = this->current_buffer().ray_buffer_length;
+        const uint32_t *active_pixels = this->sampler.active_pixels;
+        const uint32_t *active_pixel_count = this->sampler.active_pixel_count;
+        uint32_t *pixel_samples = this->sampler.pixel_samples;
+
+        cgh.parallel_for(for_range, [=](sycl::nd_item<1> id) {
+            auto global_id = id.get_global_id(0);
+            const uint32_t ray_count = *active_pixel_count;
+            if (global_id >= ray_count) {
+                return;
+            }
 
             // Set produced ray count
-            *this->current_buffer().ray_buffer_length = img_size.size();
+            if (global_id == 0) {
+                *ray_buffer_length = ray_count;
+            }
 
-            cgh.parallel_for(for_range, [=](sycl::nd_item<2> id) {
-                auto global_id = id.get_global_id();
-                if (global_id[0] >= img_size[0] || global_id[1] >= img_size[1]) {
-                    return;
-                }
+            uint32_t pixel_linear_pos = active_pixels[global_id];
+            int2 pixel_coords = {
+                pixel_linear_pos % img_size[0], pixel_linear_pos / img_size[0]};
+
+            uint32_t sample = pixel_samples[pixel_linear_pos]++;
+            uint32_t rng_key = Rng::path_key(sample);
+            Rng rng = Rng::at(sequence, camera.image_pixel(pixel_coords), rng_key, 0);
+
+            RayData ray = camera.get_ray(pixel_coords, rng);
+            ray_ids[global_id] = ray.id;
+            ray_origins[global_id] = sycl::float3(ray.org_x, ray.org_y, ray.org_z);
+            ray_directions[global_id] = sycl::half3(ray.dir_x, ray.dir_y, ray.dir_z);
+            ray_attenuations[global_id] = sycl::half3(ray.att_r, ray.att_g, ray.att_b);
+            ray_radiances[global_id] = sycl::float3(ray.rad_r, ray.rad_g, ray.rad_b);
+            ray_depths[global_id] = 0;
+            ray_rng_keys[global_id] = rng_key;
+            ray_bsdf_pdfs[global_id] = 0.0f;
+            ray_cache_cells[global_id] = RADIANCE_CACHE_NO_CELL;
+            ray_cache_throughputs[global_id] = sycl::float3(0.0f);
+            ray_guide_bins[global_id] = GUIDING_NO_BIN;
+            ray_guide_throughputs[global_id] = sycl::float3(0.0f);
+        });
+    });
+}
 
-                int2 pixel_coords = {global_id[0], global_id[1]};
+// Fills `count` ray slots starting at `first_slot` of the current buffer with camera
+// rays. Jobs enumerate every sample of every pixel: job j is sample j / pixel_count of
+// pixel j % pixel_count, so consecutive jobs stay spatially coherent.
+void WavefrontRenderer::regenerate_rays(
+    const Camera &camera, uint64_t first_slot, uint64_t first_job, uint64_t count
+) {
+    this->queue.submit([&](sycl::handler &cgh) {
+        // Group size / range
+        range<1> local_size = 64;
+        range<1> n_groups = ((count + local_size - 1) / local_size);
+        sycl::nd_range<1> for_range(n_groups * local_size, local_size);
+
+        // Params
+        auto img_size = this->img_size;
+        auto ray_ids = this->current_buffer().ray_ids;
+        auto ray_origins = this->current_buffer().ray_origins;
+        auto ray_directions = this->current_buffer().ray_directions;
+        auto ray_attenuations = this->current_buffer().ray_attenuations;
+        auto ray_radiances = this->current_buffer().ray_radiances;
+        auto ray_depths = this->current_buffer().ray_depths;
+        auto ray_rng_keys = this->current_buffer().ray_rng_keys;
+        auto ray_bsdf_pdfs = this->current_buffer().ray_bsdf_pdfs;
+        auto ray_cache_cells = this->current_buffer().ray_cache_cells;
+        auto ray_cache_throughputs = this->current_buffer().ray_cache_throughputs;
+        auto ray_guide_bins = this->current_buffer().ray_guide_bins;
+        auto ray_guide_throughputs = this->current_buffer().ray_guide_throughputs;
+        auto sequence = this->settings.sample_sequence;
+
+        cgh.parallel_for(for_range, [=](sycl::nd_item<1> id) {
+            uint64_t i = id.get_global_id(0);
+            if (i >= count) {
+                return;
+            }
 
-                image_writer.write(pixel_coords, sycl::float4(0.0f));
+            uint64_t job = first_job + i;
+            uint32_t pixel_linear_pos = job % img_size.size();
+            uint32_t sample = job / img_size.size();
+
+            int2 pixel_coords = {
+                pixel_linear_pos % img_size[0], pixel_linear_pos / img_size[0]};
+
+            uint32_t rng_key = Rng::path_key(sample);
+            Rng rng = Rng::at(sequence, camera.image_pixel(pixel_coords), rng_key, 0);
+
+            RayData ray = camera.get_ray(pixel_coords, rng);
+
+            uint64_t slot = first_slot + i;
+            ray_ids[slot] = ray.id;
+            ray_origins[slot] = sycl::float3(ray.org_x, ray.org_y, ray.org_z);
+            ray_directions[slot] = sycl::half3(ray.dir_x, ray.dir_y, ray.dir_z);
+            ray_attenuations[slot] = sycl::half3(ray.att_r, ray.att_g, ray.att_b);
+            ray_radiances[slot] = sycl::float3(ray.rad_r, ray.rad_g, ray.rad_b);
+            ray_depths[slot] = 0;
+            ray_rng_keys[slot] = rng_key;
+            ray_bsdf_pdfs[slot] = 0.0f;
+            ray_cache_cells[slot] = RADIANCE_CACHE_NO_CELL;
+            ray_cache_throughputs[slot] = sycl::float3(0.0f);
+            ray_guide_bins[slot] = GUIDING_NO_BIN;
+            ray_guide_throughputs[slot] = sycl::float3(0.0f);
+        });
+    });
+}
 
-                ScopedRng rng(pixel_coords, img_size, rng_buffer);
+static inline RTCRay make_ray(float3 origin, float3 direction, uint32_t ray_id) {
+    RTCRay ray = {
+        .org_x = origin.x(),
+        .org_y = origin.y(),
+        .org_z = origin.z(),
+        .tnear = 0.0001f,
+        .dir_x = direction.x(),
+        .dir_y = direction.y(),
+        .dir_z = direction.z(),
+        .time = 0.0f,
+        .tfar = std::numeric_limits<float>::infinity(),
+        .mask = UINT32_MAX,
+        .id = ray_id,
+        .flags = 0,
+    };
+    return ray;
+}
 
-                RayData ray = camera.get_ray(pixel_coords, rng);
-                ray_ids[ray.id] = ray.id;
-                ray_origins[ray.id] = sycl::float3(ray.org_x, ray.org_y, ray.org_z);
-                ray_directions[ray.id] = sycl::half3(ray.dir_x, ray.dir_y, ray.dir_z);
-                ray_attenuations[ray.id] = sycl::half3(ray.att_r, ray.att_g, ray.att_b);
-                ray_radiances[ray.id] = sycl::half3(ray.rad_r, ray.rad_g, ray.rad_b);
-            });
-        })
-        .wait();
+static inline ShadeBin get_shade_bin(const Material &material) {
+    switch (material.type) {
+    case MaterialType::eDiffuse:
+        return material.diffuse.albedo.type == TextureType::eImage
+                   ? ShadeBin::eDiffuseImage
+                   : ShadeBin::eDiffuseColor;
+    case MaterialType::eMetallic:
+        return material.metallic.albedo.type == TextureType::eImage
+                   ? ShadeBin::eMetallicImage
+                   : ShadeBin::eMetallicColor;
+    case MaterialType::eDielectric: return ShadeBin::eDielectric;
+    case MaterialType::eNone: break;
+    }
+    return ShadeBin::eNone;
 }
 
-static void print_elapsed(
-    const std::chrono::high_resolution_clock::time_point &begin, const char *phase_name
+static RenderContext make_render_context(
+    const Camera &camera,
+    const Scene &scene,
+    const RadianceCache &radiance_cache,
+    const GuidingField &guiding,
+    sycl::handler &cgh
 ) {
-    auto end = std::chrono::high_resolution_clock::now();
-    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin);
-    double msecs = elapsed.count() * 1e-6;
+    return RenderContext{
+        .camera = camera,
+        .environment = scene.environment,
+        .scene = scene.scene,
+        .tables = scene.tables,
+        .lights = scene.lights,
+        .radiance_cache = radiance_cache,
+        .guiding = guiding,
+        .sampler = sycl::sampler(
+            sycl::coordinate_normalization_mode::normalized,
+            sycl::addressing_mode::repeat,
+            sycl::filtering_mode::nearest
+        ),
+        .image_reader = ImageReadAccessor(scene.image_array.value(), cgh),
+#if USE_STREAMS
+        .os = sycl::stream(8192, 256, cgh),
+#endif
+    };
+}
+
+// Stage 1: intersects every ray of the previous buffer and stores its hit record.
+// Launched over the whole pool, rays past the ray count of the buffer exit right away.
+void WavefrontRenderer::intersect_rays(const Scene &scene) {
+    sycl::event event = this->queue.submit([&](sycl::handler &cgh) {
+        // Group size / range
+        range<1> local_size = 16;
+        range<1> n_groups = ((pool_size + local_size - 1) / local_size);
+        sycl::nd_range<1> for_range(n_groups * local_size, local_size);
+
+        this->specialization->apply(cgh);
+
+        // Params
+        RTCScene rtc_scene = scene.scene;
+        const auto ray_ids = this->prev_buffer().ray_ids;
+        const auto ray_origins = this->prev_buffer().ray_origins;
+        const auto ray_directions = this->prev_buffer().ray_directions;
+        const auto ray_depths = this->prev_buffer().ray_depths;
+        const uint64_t *ray_buffer_length = this->prev_buffer().ray_buffer_length;
+        uint64_t *traced_ray_count = this->traced_ray_count;
+        HitRecord *hits = this->hits;
+
+        cgh.parallel_for<WavefrontIntersectRays>(
+            for_range,
+            [=](sycl::nd_item<1> id, sycl::kernel_handler h) {
+                auto global_id = id.get_global_id(0);
+                const uint64_t ray_count = *ray_buffer_length;
+                if (global_id >= ray_count) {
+                    return;
+                }
 
-    fmt::println("\tPhase {}: {:.6f}ms", phase_name, msecs);
+                if (global_id == 0) {
+                    sycl::atomic_ref<
+                        uint64_t,
+                        sycl::memory_order_relaxed,
+                        sycl::memory_scope_device,
+                        sycl::access::address_space::global_space>
+                        traced_ray_count_ref(*traced_ray_count);
+                    traced_ray_count_ref += ray_count;
+                }
+
+                RTCRayHit rayhit;
+                rayhit.ray = make_ray(
+                    ray_origins[global_id],
+                    ray_directions[global_id].convert<float>(),
+                    ray_ids[global_id]
+                );
+                rayhit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
+                rayhit.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
+
+                RTCIntersectArguments args;
+                rtcInitIntersectArguments(&args);
+                args.flags = ray_query_flags(ray_depths[global_id]);
+                args.feature_mask = h.get_specialization_constant<rtc::feature_mask>();
+                rtcIntersect1(rtc_scene, &rayhit, &args);
+
+                bool missed = rayhit.hit.geomID == RTC_INVALID_GEOMETRY_ID;
+                hits[global_id] = HitRecord{
+                    .inst_id = rayhit.hit.instID[0],
+                    .geom_id = missed ? RTC_INVALID_GEOMETRY_ID : rayhit.hit.geomID,
+                    .prim_id = rayhit.hit.primID,
+                    .u = rayhit.hit.u,
+                    .v = rayhit.hit.v,
+                    .t = rayhit.ray.tfar,
+                    .ng_x = rayhit.hit.Ng_x,
+                    .ng_y = rayhit.hit.Ng_y,
+                    .ng_z = rayhit.hit.Ng_z,
+                };
+            }
+        );
+    });
+    this->track_stage(WavefrontStage::eIntersect, event);
 }
 
-void WavefrontRenderer::shoot_rays(
-    const Camera &camera, const Scene &scene, uint32_t depth
-) {
-    auto begin = std::chrono::high_resolution_clock::now();
+// Stage 2: counting sort of the hits by shading bin. Afterwards `sorted_ray_indices`
+// holds the rays of each bin contiguously, starting at `bin_offsets[bin]`.
+void WavefrontRenderer::sort_hits(const Scene &scene) {
+    this->queue.memset(this->bin_counts, 0, sizeof(uint32_t) * SHADE_BIN_COUNT);
+
+    // Classify hits and count bin sizes
+    sycl::event count_event = this->queue.submit([&](sycl::handler &cgh) {
+        // Group size / range
+        range<1> local_size = 64;
+        range<1> n_groups = ((pool_size + local_size - 1) / local_size);
+        sycl::nd_range<1> for_range(n_groups * local_size, local_size);
+
+        // Accessors
+        sycl::local_accessor<uint32_t, 1> local_bin_counts(
+            sycl::range<1>(SHADE_BIN_COUNT), cgh
+        );
+
+        // Params
+        ShadingTables tables = scene.tables;
+        const uint64_t *ray_buffer_length = this->prev_buffer().ray_buffer_length;
+        const HitRecord *hits = this->hits;
+        uint8_t *ray_bins = this->ray_bins;
+        uint32_t *bin_counts = this->bin_counts;
+
+        cgh.parallel_for(for_range, [=](sycl::nd_item<1> id) {
+            auto global_id = id.get_global_id(0);
+            auto local_id = id.get_local_id(0);
+            const uint64_t ray_count = *ray_buffer_length;
+
+            // Uniform across the group, so no barrier is skipped by only some items
+            if (id.get_group(0) * id.get_local_range(0) >= ray_count) {
+                return;
+            }
 
-    uint32_t prev_ray_count = *this->prev_buffer().ray_buffer_length;
-    // fmt::println("Shooting {} rays", prev_ray_count);
-    *this->prev_buffer().ray_buffer_length = 0;
+            if (local_id < SHADE_BIN_COUNT) {
+                local_bin_counts[local_id] = 0;
+            }
 
-    // print_elapsed(begin, "reset ray count");
+            id.barrier(sycl::access::fence_space::local_space);
+
+            if (global_id < ray_count) {
+                ShadeBin bin = ShadeBin::eMiss;
+                if (hits[global_id].geom_id != RTC_INVALID_GEOMETRY_ID) {
+                    HitShadingData data = hit_shading_data(
+                        tables, hits[global_id].inst_id, hits[global_id].geom_id
+                    );
+                    bin = get_shade_bin(
+                        tables.materials[data.primitive->material_index]
+                    );
+                }
+                ray_bins[global_id] = (uint8_t)bin;
 
-    app.queue
-        .submit([&](sycl::handler &cgh) {
-            if (prev_ray_count == 0) {
+                sycl::atomic_ref<
+                    uint32_t,
+                    sycl::memory_order_relaxed,
+                    sycl::memory_scope_work_group,
+                    sycl::access::address_space::local_space>
+                    local_bin_count_ref(local_bin_counts[(uint32_t)bin]);
+                local_bin_count_ref += 1;
+            }
+
+            id.barrier(sycl::access::fence_space::local_space);
+
+            if (local_id < SHADE_BIN_COUNT && local_bin_counts[local_id] > 0) {
+                sycl::atomic_ref<
+                    uint32_t,
+                    sycl::memory_order_relaxed,
+                    sycl::memory_scope_device,
+                    sycl::access::address_space::global_space>
+                    bin_count_ref(bin_counts[local_id]);
+                bin_count_ref += local_bin_counts[local_id];
+            }
+        });
+    });
+    this->track_stage(WavefrontStage::eSort, count_event);
+
+    // Bin offsets
+    sycl::event offset_event = this->queue.submit([&](sycl::handler &cgh) {
+        const uint32_t *bin_counts = this->bin_counts;
+        uint32_t *bin_offsets = this->bin_offsets;
+        uint32_t *bin_cursors = this->bin_cursors;
+
+        cgh.single_task([=]() {
+            uint32_t offset = 0;
+            for (uint32_t bin = 0; bin < SHADE_BIN_COUNT; ++bin) {
+                bin_offsets[bin] = offset;
+                bin_cursors[bin] = offset;
+                offset += bin_counts[bin];
+            }
+        });
+    });
+    this->track_stage(WavefrontStage::eSort, offset_event);
+
+    // Scatter ray indices to their bins
+    sycl::event scatter_event = this->queue.submit([&](sycl::handler &cgh) {
+        // Group size / range
+        range<1> local_size = 64;
+        range<1> n_groups = ((pool_size + local_size - 1) / local_size);
+        sycl::nd_range<1> for_range(n_groups * local_size, local_size);
+
+        // Accessors
+        sycl::local_accessor<uint32_t, 1> local_bin_counts(
+            sycl::range<1>(SHADE_BIN_COUNT), cgh
+        );
+        sycl::local_accessor<uint32_t, 1> local_bin_offsets(
+            sycl::range<1>(SHADE_BIN_COUNT), cgh
+        );
+
+        // Params
+        const uint64_t *ray_buffer_length = this->prev_buffer().ray_buffer_length;
+        const uint8_t *ray_bins = this->ray_bins;
+        uint32_t *bin_cursors = this->bin_cursors;
+        uint32_t *sorted_ray_indices = this->sorted_ray_indices;
+
+        cgh.parallel_for(for_range, [=](sycl::nd_item<1> id) {
+            auto global_id = id.get_global_id(0);
+            auto local_id = id.get_local_id(0);
+            const uint64_t ray_count = *ray_buffer_length;
+
+            // Uniform across the group, so no barrier is skipped by only some items
+            if (id.get_group(0) * id.get_local_range(0) >= ray_count) {
                 return;
             }
 
-            // Group size / range
-            range<1> local_size = 16;
-            range<1> n_groups = ((prev_ray_count + local_size - 1) / local_size);
-            sycl::nd_range<1> for_range(n_groups * local_size, local_size);
-
-            // Accessors
-            sycl::local_accessor<uint32_t, 1> local_ray_count_accessor(
-                sycl::range<1>(1), cgh
-            );
-            sycl::local_accessor<uint64_t, 1> local_first_ray_index_accessor(
-                sycl::range<1>(1), cgh
-            );
-
-            sycl::local_accessor<uint32_t, 1> local_ray_ids(
-                sycl::range<1>(local_size), cgh
-            );
-            sycl::local_accessor<float3, 1> local_ray_origins(
-                sycl::range<1>(local_size), cgh
-            );
-            sycl::local_accessor<half3, 1> local_ray_directions(
-                sycl::range<1>(local_size), cgh
-            );
-            sycl::local_accessor<half3, 1> local_ray_attenuations(
-                sycl::range<1>(local_size), cgh
-            );
-            sycl::local_accessor<half3, 1> local_ray_radiances(
-                sycl::range<1>(local_size), cgh
-            );
-
-            auto image_writer =
-                this->image.get_access<float4, sycl::access::mode::write>(cgh);
-
-            // Params
-            RenderContext ctx = {
-                .camera = camera,
-                .sky_color = scene.sky_color,
-                .scene = scene.scene,
-                .sampler = sycl::sampler(
-                    sycl::coordinate_normalization_mode::normalized,
-                    sycl::addressing_mode::repeat,
-                    sycl::filtering_mode::nearest
-                ),
-                .image_reader = ImageReadAccessor(scene.image_array.value(), cgh),
-#if USE_STREAMS
-                .os = sycl::stream(8192, 256, cgh),
-#endif
-            };
-            const auto prev_ray_ids = this->prev_buffer().ray_ids;
-            const auto prev_ray_origins = this->prev_buffer().ray_origins;
-            const auto prev_ray_directions = this->prev_buffer().ray_directions;
-            const auto prev_ray_attenuations = this->prev_buffer().ray_attenuations;
-            const auto prev_ray_radiances = this->prev_buffer().ray_radiances;
-
-            const auto new_ray_ids = this->current_buffer().ray_ids;
-            const auto new_ray_origins = this->current_buffer().ray_origins;
-            const auto new_ray_directions = this->current_buffer().ray_directions;
-            const auto new_ray_attenuations = this->current_buffer().ray_attenuations;
-            const auto new_ray_radiances = this->current_buffer().ray_radiances;
-
-            uint64_t *global_ray_count = this->current_buffer().ray_buffer_length;
-
-            const uint32_t max_depth = this->max_depth;
-            const range<2> img_size = this->img_size;
-            XorShift32State *rng_buffer = this->rng_buffer;
-
-            // print_elapsed(begin, "parallel_for begin");
-            cgh.parallel_for(for_range, [=](sycl::nd_item<1> id) {
+            if (local_id < SHADE_BIN_COUNT) {
+                local_bin_counts[local_id] = 0;
+            }
+
+            id.barrier(sycl::access::fence_space::local_space);
+
+            uint32_t bin = 0;
+            uint32_t local_slot = 0;
+            if (global_id < ray_count) {
+                bin = ray_bins[global_id];
+
+                sycl::atomic_ref<
+                    uint32_t,
+                    sycl::memory_order_relaxed,
+                    sycl::memory_scope_work_group,
+                    sycl::access::address_space::local_space>
+                    local_bin_count_ref(local_bin_counts[bin]);
+                local_slot = local_bin_count_ref.fetch_add(1);
+            }
+
+            id.barrier(sycl::access::fence_space::local_space);
+
+            if (local_id < SHADE_BIN_COUNT && local_bin_counts[local_id] > 0) {
+                sycl::atomic_ref<
+                    uint32_t,
+                    sycl::memory_order_relaxed,
+                    sycl::memory_scope_device,
+                    sycl::access::address_space::global_space>
+                    bin_cursor_ref(bin_cursors[local_id]);
+                local_bin_offsets[local_id] =
+                    bin_cursor_ref.fetch_add(local_bin_counts[local_id]);
+            }
+
+            id.barrier(sycl::access::fence_space::local_space);
+
+            if (global_id < ray_count) {
+                sorted_ray_indices[local_bin_offsets[bin] + local_slot] = global_id;
+            }
+        });
+    });
+    this->track_stage(WavefrontStage::eSort, scatter_event);
+}
+
+// Stage 3: shades the sorted rays of bins `first_bin` to `last_bin`, which all use
+// the same dispatch, and compacts the bounce rays into the current buffer. Paths that
+// end are added straight to the accumulation buffer.
+template <typename Dispatch>
+void WavefrontRenderer::shade_rays(
+    const Camera &camera, const Scene &scene, ShadeBin first_bin, ShadeBin last_bin
+) {
+    sycl::event event = this->queue.submit([&](sycl::handler &cgh) {
+        // Group size / range
+        range<1> local_size = 16;
+        range<1> n_groups = ((pool_size + local_size - 1) / local_size);
+        sycl::nd_range<1> for_range(n_groups * local_size, local_size);
+
+        // Accessors
+        sycl::local_accessor<uint32_t, 1> local_ray_count_accessor(
+            sycl::range<1>(1), cgh
+        );
+        sycl::local_accessor<uint64_t, 1> local_first_ray_index_accessor(
+            sycl::range<1>(1), cgh
+        );
+        sycl::local_accessor<uint32_t, 1> local_roulette_count_accessor(
+            sycl::range<1>(settings.max_depth), cgh
+        );
+
+        // Every ray may be split in two
+        const size_t max_local_rays = local_size.size() * 2;
+        sycl::local_accessor<uint32_t, 1> local_ray_ids(
+            sycl::range<1>(max_local_rays), cgh
+        );
+        sycl::local_accessor<float3, 1> local_ray_origins(
+            sycl::range<1>(max_local_rays), cgh
+        );
+        sycl::local_accessor<half3, 1> local_ray_directions(
+            sycl::range<1>(max_local_rays), cgh
+        );
+        sycl::local_accessor<half3, 1> local_ray_attenuations(
+            sycl::range<1>(max_local_rays), cgh
+        );
+        sycl::local_accessor<float3, 1> local_ray_radiances(
+            sycl::range<1>(max_local_rays), cgh
+        );
+        sycl::local_accessor<uint16_t, 1> local_ray_depths(
+            sycl::range<1>(max_local_rays), cgh
+        );
+        sycl::local_accessor<uint32_t, 1> local_ray_rng_keys(
+            sycl::range<1>(max_local_rays), cgh
+        );
+        sycl::local_accessor<float, 1> local_ray_bsdf_pdfs(
+            sycl::range<1>(max_local_rays), cgh
+        );
+        sycl::local_accessor<uint32_t, 1> local_ray_cache_cells(
+            sycl::range<1>(max_local_rays), cgh
+        );
+        sycl::local_accessor<float3, 1> local_ray_cache_throughputs(
+            sycl::range<1>(max_local_rays), cgh
+        );
+        sycl::local_accessor<uint32_t, 1> local_ray_guide_bins(
+            sycl::range<1>(max_local_rays), cgh
+        );
+        sycl::local_accessor<float3, 1> local_ray_guide_throughputs(
+            sycl::range<1>(max_local_rays), cgh
+        );
+
+        this->specialization->apply(cgh);
+
+        // Params
+        RenderContext base_ctx = make_render_context(
+            camera, scene, this->radiance_cache, this->guiding, cgh
+        );
+
+        const auto prev_ray_ids = this->prev_buffer().ray_ids;
+        const auto prev_ray_origins = this->prev_buffer().ray_origins;
+        const auto prev_ray_directions = this->prev_buffer().ray_directions;
+        const auto prev_ray_attenuations = this->prev_buffer().ray_attenuations;
+        const auto prev_ray_radiances = this->prev_buffer().ray_radiances;
+        const auto prev_ray_depths = this->prev_buffer().ray_depths;
+        const auto prev_ray_rng_keys = this->prev_buffer().ray_rng_keys;
+        const auto prev_ray_bsdf_pdfs = this->prev_buffer().ray_bsdf_pdfs;
+        const auto prev_ray_cache_cells = this->prev_buffer().ray_cache_cells;
+        const auto prev_ray_cache_throughputs = this->prev_buffer().ray_cache_throughputs;
+        const auto prev_ray_guide_bins = this->prev_buffer().ray_guide_bins;
+        const auto prev_ray_guide_throughputs = this->prev_buffer().ray_guide_throughputs;
+
+        const auto new_ray_ids = this->current_buffer().ray_ids;
+        const auto new_ray_origins = this->current_buffer().ray_origins;
+        const auto new_ray_directions = this->current_buffer().ray_directions;
+        const auto new_ray_attenuations = this->current_buffer().ray_attenuations;
+        const auto new_ray_radiances = this->current_buffer().ray_radiances;
+        const auto new_ray_depths = this->current_buffer().ray_depths;
+        const auto new_ray_rng_keys = this->current_buffer().ray_rng_keys;
+        const auto new_ray_bsdf_pdfs = this->current_buffer().ray_bsdf_pdfs;
+        const auto new_ray_cache_cells = this->current_buffer().ray_cache_cells;
+        const auto new_ray_cache_throughputs =
+            this->current_buffer().ray_cache_throughputs;
+        const auto new_ray_guide_bins = this->current_buffer().ray_guide_bins;
+        const auto new_ray_guide_throughputs =
+            this->current_buffer().ray_guide_throughputs;
+
+        const HitRecord *hits = this->hits;
+        const uint32_t *sorted_ray_indices = this->sorted_ray_indices;
+        const uint32_t *bin_counts = this->bin_counts;
+        const uint32_t *bin_offsets = this->bin_offsets;
+        const uint32_t first_bin_index = (uint32_t)first_bin;
+        const uint32_t last_bin_index = (uint32_t)last_bin;
+
+        const uint64_t *prev_ray_count = this->prev_buffer().ray_buffer_length;
+        uint64_t *global_ray_count = this->current_buffer().ray_buffer_length;
+        uint64_t *split_count = this->split_count;
+        uint64_t *roulette_counts = this->roulette_counts;
+        float *accumulation = this->accumulation;
+        // Regenerated rays do not track per pixel samples
+        float *even_accumulation =
+            settings.regenerate ? nullptr : this->sampler.even_accumulation;
+        const uint32_t *pixel_samples = this->sampler.pixel_samples;
+        const uint64_t pool_size = this->pool_size;
+        // Without light sampling no shadow rays are traced
+        ShadowRecord *shadow_records =
+            uses_light_sampling(scene, settings) ? this->shadow_records : nullptr;
+
+        const RenderSettings base_settings = this->settings;
+
+        cgh.parallel_for<WavefrontShadeRays<Dispatch>>(
+            for_range,
+            [=](sycl::nd_item<1> id, sycl::kernel_handler h) {
+                RenderContext ctx = base_ctx;
+                RenderSettings settings = base_settings;
+                specialize_kernel(h, ctx, settings);
+
                 sycl::atomic_ref<
                     uint64_t,
                     sycl::memory_order_relaxed,
@@ -237,58 +688,175 @@ void WavefrontRenderer::shoot_rays(
                 auto global_id = id.get_global_id();
                 auto local_id = id.get_local_id();
 
-                local_ray_count_ref = 0;
+                const uint32_t first = bin_offsets[first_bin_index];
+                const uint32_t count =
+                    bin_offsets[last_bin_index] + bin_counts[last_bin_index] - first;
+
+                // Uniform across the group, so no barrier is skipped by only some items
+                if (id.get_group(0) * id.get_local_range(0) >= count) {
+                    return;
+                }
+
+                if (local_id == 0) {
+                    local_ray_count_ref = 0;
+                }
+                for (uint32_t d = local_id; d < settings.max_depth;
+                     d += id.get_local_range(0)) {
+                    local_roulette_count_accessor[d] = 0;
+                }
 
                 id.barrier(sycl::access::fence_space::local_space);
 
-                if (global_id < prev_ray_count) {
-                    uint32_t ray_id = prev_ray_ids[global_id];
-                    float3 ray_origin = prev_ray_origins[global_id];
-                    float3 ray_direction =
-                        prev_ray_directions[global_id].convert<float>();
-                    float3 ray_attenuation =
-                        prev_ray_attenuations[global_id].convert<float>();
-                    float3 ray_radiance = prev_ray_radiances[global_id].convert<float>();
-
-                    sycl::int2 pixel_coords = {
-                        ray_id % ctx.camera.img_size[0], ray_id / ctx.camera.img_size[0]};
-
-                    ScopedRng rng(pixel_coords, img_size, rng_buffer);
-
-                    RTCRay ray = {
-                        .org_x = ray_origin.x(),
-                        .org_y = ray_origin.y(),
-                        .org_z = ray_origin.z(),
-                        .tnear = 0.0001f,
-                        .dir_x = ray_direction.x(),
-                        .dir_y = ray_direction.y(),
-                        .dir_z = ray_direction.z(),
-                        .time = 0.0f,
-                        .tfar = std::numeric_limits<float>::infinity(),
-                        .mask = UINT32_MAX,
-                        .id = ray_id,
-                        .flags = 0,
+                auto write_local_ray = [&](uint32_t ray_index,
+                                           uint32_t ray_id,
+                                           const PathState &path) {
+                    const RTCRay &ray = path.ray;
+                    local_ray_ids[ray_index] = ray_id;
+                    local_ray_origins[ray_index] =
+                        float3(ray.org_x, ray.org_y, ray.org_z);
+                    local_ray_directions[ray_index] =
+                        half3(ray.dir_x, ray.dir_y, ray.dir_z);
+                    local_ray_attenuations[ray_index] = path.attenuation.convert<half>();
+                    local_ray_radiances[ray_index] = path.radiance;
+                    local_ray_depths[ray_index] = path.depth;
+                    local_ray_rng_keys[ray_index] = path.rng_key;
+                    local_ray_bsdf_pdfs[ray_index] = path.bsdf_pdf;
+                    local_ray_cache_cells[ray_index] = path.cache_cell;
+                    local_ray_cache_throughputs[ray_index] = path.cache_throughput;
+                    local_ray_guide_bins[ray_index] = path.guide_bin;
+                    local_ray_guide_throughputs[ray_index] = path.guide_throughput;
+                };
+
+                if (global_id < count) {
+                    const uint32_t i = sorted_ray_indices[first + global_id];
+                    const HitRecord hit = hits[i];
+
+                    uint32_t ray_id = prev_ray_ids[i];
+                    float3 ray_origin = prev_ray_origins[i];
+                    float3 ray_direction = prev_ray_directions[i].convert<float>();
+                    float3 ray_attenuation = prev_ray_attenuations[i].convert<float>();
+                    float3 ray_radiance = prev_ray_radiances[i];
+
+                    PathState path = {
+                        .ray = make_ray(ray_origin, ray_direction, ray_id),
+                        .attenuation = ray_attenuation,
+                        .radiance = ray_radiance,
+                        .depth = prev_ray_depths[i],
+                        .rng_key = prev_ray_rng_keys[i],
+                        .bsdf_pdf = prev_ray_bsdf_pdfs[i],
+                        .cache_cell = prev_ray_cache_cells[i],
+                        .cache_throughput = prev_ray_cache_throughputs[i],
+                        .guide_bin = prev_ray_guide_bins[i],
+                        .guide_throughput = prev_ray_guide_throughputs[i],
+                    };
+
+                    RTCRayHit rayhit;
+                    rayhit.ray = path.ray;
+                    rayhit.ray.tfar = hit.t;
+                    rayhit.hit.u = hit.u;
+                    rayhit.hit.v = hit.v;
+                    rayhit.hit.Ng_x = hit.ng_x;
+                    rayhit.hit.Ng_y = hit.ng_y;
+                    rayhit.hit.Ng_z = hit.ng_z;
+                    rayhit.hit.primID = hit.prim_id;
+                    rayhit.hit.instID[0] = hit.inst_id;
+                    rayhit.hit.geomID = hit.geom_id;
+
+                    auto on_roulette = [&](uint32_t depth) {
+                        sycl::atomic_ref<
+                            uint32_t,
+                            sycl::memory_order_relaxed,
+                            sycl::memory_scope_work_group,
+                            sycl::access::address_space::local_space>
+                            count_ref(local_roulette_count_accessor[depth]);
+                        count_ref += 1;
                     };
 
-                    auto res = trace_ray(ctx, rng, ray, ray_attenuation, ray_radiance);
+                    // Continuing rays never outnumber the rays of the previous
+                    // buffer, so splits may use the rest of the pool. The slot is
+                    // reserved before the split registers with the radiance cache or
+                    // the guiding field, a path without one is not split.
+                    auto reserve_split = [&]() {
+                        sycl::atomic_ref<
+                            uint64_t,
+                            sycl::memory_order_relaxed,
+                            sycl::memory_scope_device,
+                            sycl::access::address_space::global_space>
+                            split_count_ref(*split_count);
+                        return split_count_ref.fetch_add(1) < pool_size - *prev_ray_count;
+                    };
 
-                    if (res) {
-                        // Final value is computed. Write to image.
-                        float4 final_color = float4(sycl::clamp(*res, 0.0f, 1.0f), 1.0f);
-                        image_writer.write(pixel_coords, final_color);
-                    } else if (depth == (max_depth - 1)) {
-                        image_writer.write(pixel_coords, float4(0.0f, 0.0f, 0.0f, 1.0f));
-                    } else {
+                    float3 color = float3(0.0f);
+                    PathState split;
+                    ShadowRay shadow;
+                    uint32_t path_count = advance_path<Dispatch>(
+                        ctx,
+                        settings,
+                        rayhit,
+                        path,
+                        &split,
+                        shadow,
+                        color,
+                        on_roulette,
+                        reserve_split
+                    );
+
+                    if (shadow_records) {
+                        const RTCRay &ray = shadow.ray;
+                        shadow_records[i] = ShadowRecord{
+                            .origin = float3(ray.org_x, ray.org_y, ray.org_z),
+                            .direction = float3(ray.dir_x, ray.dir_y, ray.dir_z),
+                            .contribution = shadow.contribution,
+                            .tfar = ray.tfar,
+                            .ray_id = ray_id,
+                            .cache_cell = shadow.cache_cell,
+                            .cache_radiance = shadow.cache_radiance,
+                            .guide_bin = shadow.guide_bin,
+                            .guide_radiance = shadow.guide_radiance,
+                        };
+                    }
+
+                    if (path_count == 2) {
+                        uint32_t ray_index = local_ray_count_ref.fetch_add(1);
+                        write_local_ray(ray_index, ray_id, split);
+                    }
+
+                    // Paths that start recording into the radiance cache or the
+                    // guiding field hand over what they gathered so far before they
+                    // end
+                    if (path_count == 0 || max_component(color) > 0.0f) {
+                        // Other paths of this pixel may end at the same time. Alpha is
+                        // not accumulated since a split sample ends as several paths.
+                        // Nothing is clamped before the resolve, like the megakernel.
+                        // Only one sample of a pixel is in flight, the one generated last
+                        bool even_sample =
+                            even_accumulation && (pixel_samples[ray_id] - 1) % 2 == 0;
+                        for (int c = 0; c < 3; ++c) {
+                            sycl::atomic_ref<
+                                float,
+                                sycl::memory_order_relaxed,
+                                sycl::memory_scope_device,
+                                sycl::access::address_space::global_space>
+                                accumulation_ref(accumulation[ray_id * 4 + c]);
+                            accumulation_ref += color[c];
+
+                            if (even_sample) {
+                                sycl::atomic_ref<
+                                    float,
+                                    sycl::memory_order_relaxed,
+                                    sycl::memory_scope_device,
+                                    sycl::access::address_space::global_space>
+                                    even_accumulation_ref(
+                                        even_accumulation[ray_id * 4 + c]
+                                    );
+                                even_accumulation_ref += color[c];
+                            }
+                        }
+                    }
+                    if (path_count > 0) {
                         // New ray was generated
                         uint32_t ray_index = local_ray_count_ref.fetch_add(1);
-                        local_ray_ids[ray_index] = ray_id;
-                        local_ray_origins[ray_index] =
-                            float3(ray.org_x, ray.org_y, ray.org_z);
-                        local_ray_directions[ray_index] =
-                            half3(ray.dir_x, ray.dir_y, ray.dir_z);
-                        local_ray_attenuations[ray_index] =
-                            ray_attenuation.convert<half>();
-                        local_ray_radiances[ray_index] = ray_radiance.convert<half>();
+                        write_local_ray(ray_index, ray_id, path);
                     }
                 }
 
@@ -298,120 +866,415 @@ void WavefrontRenderer::shoot_rays(
                     local_first_ray_index_accessor[0] =
                         global_ray_count_ref.fetch_add(local_ray_count_ref);
                 }
+                for (uint32_t d = local_id; d < settings.max_depth;
+                     d += id.get_local_range(0)) {
+                    if (local_roulette_count_accessor[d] == 0) continue;
+                    sycl::atomic_ref<
+                        uint64_t,
+                        sycl::memory_order_relaxed,
+                        sycl::memory_scope_device,
+                        sycl::access::address_space::global_space>
+                        global_roulette_count_ref(roulette_counts[d]);
+                    global_roulette_count_ref += local_roulette_count_accessor[d];
+                }
 
                 id.barrier(sycl::access::fence_space::local_space);
 
-                if (local_id < local_ray_count_ref) {
-                    const uint64_t i = local_first_ray_index_accessor[0] + local_id;
-                    new_ray_ids[i] = local_ray_ids[local_id];
-                    new_ray_origins[i] = local_ray_origins[local_id];
-                    new_ray_directions[i] = local_ray_directions[local_id];
-                    new_ray_attenuations[i] = local_ray_attenuations[local_id];
-                    new_ray_radiances[i] = local_ray_radiances[local_id];
+                for (uint32_t r = local_id; r < local_ray_count_ref;
+                     r += id.get_local_range(0)) {
+                    const uint64_t i = local_first_ray_index_accessor[0] + r;
+                    new_ray_ids[i] = local_ray_ids[r];
+                    new_ray_origins[i] = local_ray_origins[r];
+                    new_ray_directions[i] = local_ray_directions[r];
+                    new_ray_attenuations[i] = local_ray_attenuations[r];
+                    new_ray_radiances[i] = local_ray_radiances[r];
+                    new_ray_depths[i] = local_ray_depths[r];
+                    new_ray_rng_keys[i] = local_ray_rng_keys[r];
+                    new_ray_bsdf_pdfs[i] = local_ray_bsdf_pdfs[r];
+                    new_ray_cache_cells[i] = local_ray_cache_cells[r];
+                    new_ray_cache_throughputs[i] = local_ray_cache_throughputs[r];
+                    new_ray_guide_bins[i] = local_ray_guide_bins[r];
+                    new_ray_guide_throughputs[i] = local_ray_guide_throughputs[r];
                 }
-            });
-        })
-        .wait();
-
-    // print_elapsed(begin, "shoot end");
+            }
+        );
+    });
+    this->track_stage(WavefrontStage::eShade, event);
 }
 
-void WavefrontRenderer::merge_samples(uint32_t sample) {
-    app.queue
-        .submit([&](sycl::handler &cgh) {
-            // Group size / range
-            range<2> local_size{8, 8};
-            range<2> n_groups = {
-                ((img_size[0] + local_size[0] - 1) / local_size[0]),
-                ((img_size[1] + local_size[1] - 1) / local_size[1]),
-            };
-
-            // Accessors
-            auto image_reader =
-                this->image.get_access<float4, sycl::access::mode::read>(cgh);
-            auto combined_image_reader =
-                this->combined_image.get_access<float4, sycl::access::mode::read>(cgh);
-            auto combined_image_writer =
-                this->combined_image.get_access<float4, sycl::access::mode::write>(cgh);
-
-            // Params
-            const auto img_size = this->img_size;
+// Stage 4: traces the shadow rays of the light samples taken while shading and adds
+// the contribution of the visible ones to the accumulation buffer.
+void WavefrontRenderer::trace_shadow_rays(const Scene &scene) {
+    sycl::event event = this->queue.submit([&](sycl::handler &cgh) {
+        // Group size / range
+        range<1> local_size = 16;
+        range<1> n_groups = ((pool_size + local_size - 1) / local_size);
+        sycl::nd_range<1> for_range(n_groups * local_size, local_size);
+
+        this->specialization->apply(cgh);
+
+        // Params
+        RTCScene rtc_scene = scene.scene;
+        const ShadowRecord *shadow_records = this->shadow_records;
+        const uint64_t *ray_buffer_length = this->prev_buffer().ray_buffer_length;
+        uint64_t *traced_ray_count = this->traced_ray_count;
+        float *accumulation = this->accumulation;
+        float *even_accumulation =
+            settings.regenerate ? nullptr : this->sampler.even_accumulation;
+        const uint32_t *pixel_samples = this->sampler.pixel_samples;
+        const RadianceCache radiance_cache = this->radiance_cache;
+        const GuidingField guiding = this->guiding;
+
+        cgh.parallel_for<WavefrontTraceShadowRays>(
+            for_range,
+            [=](sycl::nd_item<1> id, sycl::kernel_handler h) {
+                auto global_id = id.get_global_id(0);
+                // Uniform across the group, like the ray count of the buffer
+                if (id.get_group(0) * id.get_local_range(0) >= *ray_buffer_length) {
+                    return;
+                }
 
-            cgh.parallel_for(
-                sycl::nd_range<2>(n_groups * local_size, local_size),
-                [=](sycl::nd_item<2> id) {
-                    auto global_id = id.get_global_id();
-                    if (global_id[0] >= img_size[0] || global_id[1] >= img_size[1]) {
-                        return;
+                bool traced = false;
+                if (global_id < *ray_buffer_length) {
+                    const ShadowRecord shadow = shadow_records[global_id];
+                    if (max_component(shadow.contribution) > 0.0f) {
+                        traced = true;
+
+                        RTCRay ray =
+                            make_ray(shadow.origin, shadow.direction, shadow.ray_id);
+                        ray.tfar = shadow.tfar;
+
+                        RTCOccludedArguments args;
+                        rtcInitOccludedArguments(&args);
+                        args.flags = RTC_RAY_QUERY_FLAG_INCOHERENT;
+                        args.feature_mask =
+                            h.get_specialization_constant<rtc::feature_mask>();
+                        rtcOccluded1(rtc_scene, &ray, &args);
+
+                        // Embree sets tfar to -inf when the ray is blocked
+                        if (ray.tfar >= 0.0f) {
+                            if (shadow.cache_cell != RADIANCE_CACHE_NO_CELL) {
+                                add_radiance_cache_sample(
+                                    radiance_cache,
+                                    shadow.cache_cell,
+                                    shadow.cache_radiance,
+                                    0
+                                );
+                            }
+                            if (shadow.guide_bin != GUIDING_NO_BIN) {
+                                add_guiding_sample(
+                                    guiding, shadow.guide_bin, shadow.guide_radiance
+                                );
+                            }
+
+                            const uint32_t ray_id = shadow.ray_id;
+                            const float3 color = shadow.contribution;
+                            bool even_sample = even_accumulation &&
+                                               (pixel_samples[ray_id] - 1) % 2 == 0;
+                            for (int c = 0; c < 3; ++c) {
+                                sycl::atomic_ref<
+                                    float,
+                                    sycl::memory_order_relaxed,
+                                    sycl::memory_scope_device,
+                                    sycl::access::address_space::global_space>
+                                    accumulation_ref(accumulation[ray_id * 4 + c]);
+                                accumulation_ref += color[c];
+
+                                if (even_sample) {
+                                    sycl::atomic_ref<
+                                        float,
+                                        sycl::memory_order_relaxed,
+                                        sycl::memory_scope_device,
+                                        sycl::access::address_space::global_space>
+                                        even_accumulation_ref(
+                                            even_accumulation[ray_id * 4 + c]
+                                        );
+                                    even_accumulation_ref += color[c];
+                                }
+                            }
+                        }
                     }
+                }
 
-                    int2 pixel_coords = {global_id[0], global_id[1]};
+                uint32_t group_traced = sycl::reduce_over_group(
+                    id.get_group(), traced ? 1u : 0u, sycl::plus<uint32_t>()
+                );
+                if (id.get_local_id(0) == 0 && group_traced > 0) {
+                    sycl::atomic_ref<
+                        uint64_t,
+                        sycl::memory_order_relaxed,
+                        sycl::memory_scope_device,
+                        sycl::access::address_space::global_space>
+                        traced_ray_count_ref(*traced_ray_count);
+                    traced_ray_count_ref += group_traced;
+                }
+            }
+        );
+    });
+    this->track_stage(WavefrontStage::eShadow, event);
+}
 
-                    float4 img_val = image_reader.read(pixel_coords);
-                    float4 combined_val = combined_image_reader.read(pixel_coords);
+void WavefrontRenderer::shoot_rays(const Camera &camera, const Scene &scene) {
+    // Ray counts only live on the device, so the rays are not read back here. When
+    // the previous buffer is empty, every kernel below exits right away.
+    this->queue.memset(this->current_buffer().ray_buffer_length, 0, sizeof(uint64_t));
+    this->queue.memset(this->split_count, 0, sizeof(uint64_t));
+
+    this->intersect_rays(scene);
+    this->sort_hits(scene);
+
+    const SceneFeatures &features = this->specialization->features;
+    this->shade_rays<DynamicDispatch>(camera, scene, ShadeBin::eMiss, ShadeBin::eNone);
+    if (features.has(MaterialType::eDiffuse)) {
+        this->shade_rays<StaticDispatch<MaterialType::eDiffuse>>(
+            camera, scene, ShadeBin::eDiffuseColor, ShadeBin::eDiffuseImage
+        );
+    }
+    if (features.has(MaterialType::eMetallic)) {
+        this->shade_rays<StaticDispatch<MaterialType::eMetallic>>(
+            camera, scene, ShadeBin::eMetallicColor, ShadeBin::eMetallicImage
+        );
+    }
+    if (features.has(MaterialType::eDielectric)) {
+        this->shade_rays<StaticDispatch<MaterialType::eDielectric>>(
+            camera, scene, ShadeBin::eDielectric, ShadeBin::eDielectric
+        );
+    }
 
-                    combined_image_writer.write(pixel_coords, combined_val + img_val);
-                }
-            );
-        })
-        .wait();
+    if (uses_light_sampling(scene, settings)) {
+        this->trace_shadow_rays(scene);
+    }
+}
+
+template <MaterialType Type> static sycl::kernel_id shade_kernel_id() {
+    return sycl::get_kernel_id<WavefrontShadeRays<StaticDispatch<Type>>>();
+}
+
+// Builds the intersection and shadow ray kernels and the shading kernels of the
+// material types used by `scene`, unless they were already built for the same
+// features.
+void WavefrontRenderer::specialize(const Scene &scene) {
+    SceneFeatures features = kernel_features(scene, settings);
+    if (this->specialization &&
+        this->specialization->matches(features, settings.max_depth)) {
+        return;
+    }
+
+    std::vector<sycl::kernel_id> kernels = {
+        sycl::get_kernel_id<WavefrontIntersectRays>(),
+        sycl::get_kernel_id<WavefrontTraceShadowRays>(),
+        sycl::get_kernel_id<WavefrontShadeRays<DynamicDispatch>>(),
+    };
+    if (features.has(MaterialType::eDiffuse)) {
+        kernels.push_back(shade_kernel_id<MaterialType::eDiffuse>());
+    }
+    if (features.has(MaterialType::eMetallic)) {
+        kernels.push_back(shade_kernel_id<MaterialType::eMetallic>());
+    }
+    if (features.has(MaterialType::eDielectric)) {
+        kernels.push_back(shade_kernel_id<MaterialType::eDielectric>());
+    }
+
+    this->specialization =
+        specialize_kernels(this->queue, kernels, features, settings.max_depth);
 }
 
+// The only full-frame pass: resolves the accumulated samples into the output image.
 void WavefrontRenderer::convert_image_to_srgb() {
-    app.queue
+    this->queue
         .submit([&](sycl::handler &cgh) {
-            auto combined_image_reader =
-                this->combined_image.get_access<float4, sycl::access::mode::read>(cgh);
             auto output_image_writer =
-                this->output_image.get_access<float4, sycl::access::mode::write>(cgh);
-
-            range<2> local_size{8, 8};
-            range<2> n_groups = {
-                ((img_size[0] + local_size[0] - 1) / local_size[0]),
-                ((img_size[1] + local_size[1] - 1) / local_size[1]),
-            };
+                output_image.get_access<float4, sycl::access::mode::write>(cgh);
 
             const auto img_size = this->img_size;
-            const uint32_t sample_count = this->sample_count;
-
-            cgh.parallel_for(
-                sycl::nd_range<2>(n_groups * local_size, local_size),
-                [=](sycl::nd_item<2> id) {
-                    auto global_id = id.get_global_id();
-                    if (global_id[0] >= img_size[0] || global_id[1] >= img_size[1]) {
-                        return;
-                    }
-
-                    int2 pixel_coords = {global_id[0], global_id[1]};
+            const uint32_t *pixel_samples = this->sampler.pixel_samples;
+            const float *accumulation = this->accumulation;
 
-                    float4 img_val =
-                        combined_image_reader.read(pixel_coords) / (float)sample_count;
-                    output_image_writer.write(pixel_coords, linear_to_gamma(img_val));
-                }
-            );
+            cgh.parallel_for(sycl::range<2>(img_size), [=](sycl::item<2> item) {
+                int2 pixel_coords = {item[0], item[1]};
+                size_t i = pixel_coords[0] + pixel_coords[1] * img_size[0];
+
+                float3 sum = float3(
+                    accumulation[i * 4 + 0],
+                    accumulation[i * 4 + 1],
+                    accumulation[i * 4 + 2]
+                );
+                float samples = (float)sycl::max(pixel_samples[i], 1u);
+                float4 img_val = float4(sum / samples, 1.0f);
+                output_image_writer.write(pixel_coords, linear_to_gamma(img_val));
+            });
         })
         .wait();
 }
 
-void WavefrontRenderer::render_frame(const Camera &camera, const Scene &scene) {
-    auto begin = std::chrono::high_resolution_clock::now();
+void WavefrontRenderer::track_stage(WavefrontStage stage, sycl::event event) {
+    if (this->profiling) {
+        this->stage_events.emplace_back(stage, event);
+    }
+}
+
+// Prints the device time spent in each stage of shoot_rays. Has to be called after
+// every tracked kernel completed.
+void WavefrontRenderer::print_stage_times() {
+    if (!this->profiling) {
+        fmt::println("\tStage times are only measured with --no-graph");
+        return;
+    }
+
+    std::array<double, (size_t)WavefrontStage::eCount> stage_seconds = {};
+    for (const auto &[stage, event] : this->stage_events) {
+        using profiling_info = sycl::info::event_profiling;
+        uint64_t start = event.get_profiling_info<profiling_info::command_start>();
+        uint64_t end = event.get_profiling_info<profiling_info::command_end>();
+        stage_seconds[(size_t)stage] += (end - start) * 1e-9;
+    }
+    this->stage_events.clear();
+
+    static const char *stage_names[] = {"intersect", "sort", "shade", "shadow"};
+    for (size_t stage = 0; stage < stage_seconds.size(); ++stage) {
+        fmt::println(
+            "\tStage {}: {:.6f}ms", stage_names[stage], stage_seconds[stage] * 1e3
+        );
+    }
+}
+
+// Submits every kernel of one sample. Nothing is read back on the host, so the same
+// submissions can be recorded into a command graph and replayed for each sample.
+void WavefrontRenderer::record_sample(const Camera &camera, const Scene &scene) {
+    // Each sample starts from the same buffer, so every replay matches the recording
+    // regardless of the parity of max_depth
+    this->buffer_index = 0;
+
+    this->generate_camera_rays(camera);
+
+    for (uint32_t depth = 0; depth < settings.max_depth; depth++) {
+        buffer_index++;
+
+        this->shoot_rays(camera, scene);
+    }
+}
+
+// Renders the frame in the passes decided by the adaptive sampler, shortened to
+// guiding_pass_samples with path guiding. Within a pass no sample waits on the host.
+void WavefrontRenderer::render_samples(const Camera &camera, const Scene &scene) {
+    this->queue.memset(this->accumulation, 0, sizeof(sycl::float4) * img_size.size());
+    this->sampler.reset(this->queue);
+
+    std::function<void()> submit_sample = [&]() { this->record_sample(camera, scene); };
+
+#ifdef SYCL_EXT_ONEAPI_GRAPH
+    namespace sycl_exp = sycl::ext::oneapi::experimental;
+
+    std::optional<sycl_exp::command_graph<sycl_exp::graph_state::executable>>
+        sample_graph;
+    if (this->use_graph) {
+        sycl_exp::command_graph graph(
+            this->queue.get_context(), this->queue.get_device()
+        );
+        // Recording has to be ended before the queue is used directly, but only if
+        // it began, ending it otherwise throws again
+        bool recording = false;
+        try {
+            graph.begin_recording(this->queue);
+            recording = true;
+            this->record_sample(camera, scene);
+            graph.end_recording(this->queue);
+            recording = false;
+            sample_graph = graph.finalize();
+            submit_sample = [&]() { this->queue.ext_oneapi_graph(*sample_graph); };
+        } catch (sycl::exception const &e) {
+            if (recording) {
+                graph.end_recording(this->queue);
+            }
+            fmt::println("Command graph unavailable, submitting directly: {}", e.what());
+            this->use_graph = false;
+        }
+    }
+#endif
 
-    uint64_t total_ray_count = 0;
+    uint32_t sample = 0;
+    uint32_t pass = 0;
+    while (uint32_t pass_samples = this->sampler.next_pass_samples()) {
+        pass_samples =
+            std::min(pass_samples, guiding_pass_samples(this->guiding, pass++));
+        for (uint32_t i = 0; i < pass_samples; i++) {
+            fmt::println("Sample {}", sample++);
+            submit_sample();
+        }
+        this->queue.wait();
 
-    for (uint32_t sample = 0; sample < this->sample_count; sample++) {
-        fmt::println("Sample {}", sample);
+        this->sampler.finish_pass(this->queue, pass_samples, this->accumulation);
+        update_guiding_field(this->queue, this->guiding);
+    }
+}
 
-        this->generate_camera_rays(camera, sample);
+// Keeps the ray pool full: after every bounce, the slots freed by terminated paths
+// are refilled with camera rays of the next samples until the sample budget is spent.
+// The host needs the number of free slots, so this waits for every bounce. Samples do
+// not come in passes here, so the guiding distributions are rebuilt whenever the new
+// rays reach a sample twice as far as the last rebuild. Paths in flight switch to the
+// new distributions at their next hit.
+void WavefrontRenderer::render_regenerating(const Camera &camera, const Scene &scene) {
+    this->queue.memset(this->accumulation, 0, sizeof(sycl::float4) * img_size.size())
+        .wait();
 
-        for (uint32_t depth = 0; depth < this->max_depth; depth++) {
-            total_ray_count += *this->current_buffer().ray_buffer_length;
+    const uint64_t job_count = img_size.size() * settings.sample_count;
+    uint64_t next_job = 0;
+    uint32_t last_sample = UINT32_MAX;
+    uint32_t next_guiding_update = 1;
+
+    *this->current_buffer().ray_buffer_length = 0;
+
+    while (true) {
+        uint64_t queued = *this->current_buffer().ray_buffer_length;
+        uint64_t count = std::min(this->pool_size - queued, job_count - next_job);
+        if (count > 0) {
+            uint32_t sample = (next_job + count - 1) / img_size.size();
+            if (sample != last_sample) {
+                fmt::println("Sample {}", sample);
+                last_sample = sample;
+            }
+            if (sample >= next_guiding_update) {
+                update_guiding_field(this->queue, this->guiding);
+                next_guiding_update = sample * 2;
+            }
 
-            buffer_index++;
+            this->regenerate_rays(camera, queued, next_job, count);
+            next_job += count;
+            *this->current_buffer().ray_buffer_length = queued + count;
+        }
 
-            this->shoot_rays(camera, scene, depth);
+        if (*this->current_buffer().ray_buffer_length == 0) {
+            break;
         }
 
-        this->merge_samples(sample);
+        buffer_index++;
+
+        this->shoot_rays(camera, scene);
+        this->queue.wait();
+    }
+
+    this->queue.fill(this->sampler.pixel_samples, settings.sample_count, img_size.size())
+        .wait();
+}
+
+void WavefrontRenderer::render_frame(const Camera &camera, const Scene &scene) {
+    this->specialize(scene);
+
+    auto begin = std::chrono::high_resolution_clock::now();
+
+    this->img_size = frame_size(camera, this->buffer_size);
+    this->sampler.resize(this->img_size);
+
+    std::fill(this->roulette_counts, this->roulette_counts + settings.max_depth, 0);
+    *this->traced_ray_count = 0;
+    reset_radiance_cache(this->queue, this->radiance_cache, scene, settings);
+    reset_guiding_field(this->queue, this->guiding, scene, settings);
+
+    if (settings.regenerate) {
+        this->render_regenerating(camera, scene);
+    } else {
+        this->render_samples(camera, scene);
     }
 
     this->convert_image_to_srgb();
@@ -419,6 +1282,7 @@ void WavefrontRenderer::render_frame(const Camera &camera, const Scene &scene) {
     auto end = std::chrono::high_resolution_clock::now();
     auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin);
 
+    uint64_t total_ray_count = *this->traced_ray_count;
     double secs = elapsed.count() * 1e-9;
     double rays_per_sec = (double)total_ray_count / secs;
 
@@ -426,6 +1290,10 @@ void WavefrontRenderer::render_frame(const Camera &camera, const Scene &scene) {
     fmt::println("Total rays: {}", total_ray_count);
     fmt::println("Rays/sec: {:.2f}M", rays_per_sec / 1000000.0);
 
-    fmt::println("Writing image to disk");
-    write_image(app.queue, output_image, img_size[0], img_size[1]);
+    this->print_stage_times();
+
+    print_roulette_stats(settings, this->roulette_counts);
+    this->sampler.print_histogram(this->queue);
+    print_radiance_cache_stats(this->queue, this->radiance_cache);
+    print_guiding_stats(this->queue, this->guiding);
 }
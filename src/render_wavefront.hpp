@@ -2,62 +2,201 @@
 
 #include "render.hpp"
 #include "camera.hpp"
+#include "adaptive_sampling.hpp"
+#include "guiding.hpp"
+#include "radiance_cache.hpp"
+#include "specialization.hpp"
 
 namespace raytracer {
 
 static uint32_t ZERO = 0;
 
+// Result of the intersection stage for one ray. `geom_id` is RTC_INVALID_GEOMETRY_ID
+// if the ray missed.
+struct HitRecord {
+    uint32_t inst_id;
+    uint32_t geom_id;
+    uint32_t prim_id;
+    float u;
+    float v;
+    float t;
+    // Unnormalized object space normal of the triangle, see SurfaceHit::geometric_normal
+    float ng_x;
+    float ng_y;
+    float ng_z;
+};
+
+// Light sample of the hit of one ray, traced after shading. `contribution` is 0 when
+// the hit sampled no light. See ShadowRay.
+struct ShadowRecord {
+    sycl::float3 origin;
+    sycl::float3 direction;
+    sycl::float3 contribution;
+    float tfar;
+    uint32_t ray_id;
+    // See ShadowRay::cache_cell
+    uint32_t cache_cell;
+    sycl::float3 cache_radiance;
+    // See ShadowRay::guide_bin
+    uint32_t guide_bin;
+    sycl::float3 guide_radiance;
+};
+
+// Hits are grouped into these bins before shading, so each shading kernel only sees
+// a single material type and texture type.
+enum class ShadeBin : uint8_t {
+    eMiss,
+    eNone,
+    eDiffuseColor,
+    eDiffuseImage,
+    eMetallicColor,
+    eMetallicImage,
+    eDielectric,
+    eCount,
+};
+
+constexpr uint32_t SHADE_BIN_COUNT = (uint32_t)ShadeBin::eCount;
+
+enum class WavefrontStage : uint32_t {
+    eIntersect,
+    eSort,
+    eShade,
+    eShadow,
+    eCount,
+};
+
 struct Buffers {
     uint64_t *ray_buffer_length;
     uint32_t *ray_ids;
     sycl::float3 *ray_origins;
     sycl::half3 *ray_directions;
     sycl::half3 *ray_attenuations;
-    sycl::half3 *ray_radiances;
+    // Radiance and the throughputs below are kept in float, emitters and environment
+    // maps brighter than the half range would turn them into infinities
+    sycl::float3 *ray_radiances;
+    uint16_t *ray_depths;
+    // Key of the path of each ray, see Rng. Random numbers are derived from it, so
+    // no generator state is loaded and stored between bounces.
+    uint32_t *ray_rng_keys;
+    // See PathState::bsdf_pdf
+    float *ray_bsdf_pdfs;
+    // See PathState::cache_cell and PathState::cache_throughput
+    uint32_t *ray_cache_cells;
+    sycl::float3 *ray_cache_throughputs;
+    // See PathState::guide_bin and PathState::guide_throughput
+    uint32_t *ray_guide_bins;
+    sycl::float3 *ray_guide_throughputs;
 
-    Buffers(App &app, sycl::range<2> img_size) {
+    Buffers(App &app, size_t capacity) {
         this->ray_buffer_length = (uint64_t *)sycl::aligned_alloc_shared(
             alignof(uint64_t), sizeof(uint64_t), app.queue
         );
         this->ray_ids = (uint32_t *)sycl::aligned_alloc_device(
-            alignof(uint32_t), sizeof(uint32_t) * img_size.size(), app.queue
+            alignof(uint32_t), sizeof(uint32_t) * capacity, app.queue
         );
         this->ray_origins = (sycl::float3 *)sycl::aligned_alloc_device(
-            alignof(sycl::float3), sizeof(sycl::float3) * img_size.size(), app.queue
+            alignof(sycl::float3), sizeof(sycl::float3) * capacity, app.queue
         );
         this->ray_directions = (sycl::half3 *)sycl::aligned_alloc_device(
-            alignof(sycl::half3), sizeof(sycl::half3) * img_size.size(), app.queue
+            alignof(sycl::half3), sizeof(sycl::half3) * capacity, app.queue
         );
         this->ray_attenuations = (sycl::half3 *)sycl::aligned_alloc_device(
-            alignof(sycl::half3), sizeof(sycl::half3) * img_size.size(), app.queue
+            alignof(sycl::half3), sizeof(sycl::half3) * capacity, app.queue
+        );
+        this->ray_radiances = (sycl::float3 *)sycl::aligned_alloc_device(
+            alignof(sycl::float3), sizeof(sycl::float3) * capacity, app.queue
+        );
+        this->ray_depths = (uint16_t *)sycl::aligned_alloc_device(
+            alignof(uint16_t), sizeof(uint16_t) * capacity, app.queue
+        );
+        this->ray_rng_keys = (uint32_t *)sycl::aligned_alloc_device(
+            alignof(uint32_t), sizeof(uint32_t) * capacity, app.queue
+        );
+        this->ray_bsdf_pdfs = (float *)sycl::aligned_alloc_device(
+            alignof(float), sizeof(float) * capacity, app.queue
+        );
+        this->ray_cache_cells = (uint32_t *)sycl::aligned_alloc_device(
+            alignof(uint32_t), sizeof(uint32_t) * capacity, app.queue
+        );
+        this->ray_cache_throughputs = (sycl::float3 *)sycl::aligned_alloc_device(
+            alignof(sycl::float3), sizeof(sycl::float3) * capacity, app.queue
         );
-        this->ray_radiances = (sycl::half3 *)sycl::aligned_alloc_device(
-            alignof(sycl::half3), sizeof(sycl::half3) * img_size.size(), app.queue
+        this->ray_guide_bins = (uint32_t *)sycl::aligned_alloc_device(
+            alignof(uint32_t), sizeof(uint32_t) * capacity, app.queue
+        );
+        this->ray_guide_throughputs = (sycl::float3 *)sycl::aligned_alloc_device(
+            alignof(sycl::float3), sizeof(sycl::float3) * capacity, app.queue
         );
     }
 };
 
 struct WavefrontRenderer : public IRenderer {
     App &app;
+    // Whether each sample is recorded once into a command graph and replayed
+    bool use_graph;
+    // Whether `queue` records profiling info for the stage timings
+    bool profiling;
+    // In-order queue every wavefront kernel is submitted to, so consecutive kernels
+    // depend on each other without waiting on the host.
+    sycl::queue queue;
+
+    // Pixels the buffers were allocated for, and the size of the current frame
+    sycl::range<2> buffer_size;
     sycl::range<2> img_size;
-    sycl::image<2> image;
-    sycl::image<2> combined_image;
     sycl::image<2> &output_image;
 
+    // Number of rays each of the ray buffers can hold
+    size_t pool_size;
+
     uint32_t buffer_index = 0;
     std::array<Buffers, 2> buffers;
 
-    XorShift32State *rng_buffer;
+    // Decides which pixels take samples and counts the samples of each pixel. Lives on
+    // the device so a recorded sample can be replayed unchanged.
+    AdaptiveSampler sampler;
+
+    // Per pixel RGBA sums of all samples. Paths add their contribution as they end.
+    float *accumulation;
+
+    // Rays traced during the frame, counted on the device
+    uint64_t *traced_ray_count;
+    // Split paths added to the current buffer during the bounce
+    uint64_t *split_count;
+
+    // Shading stage inputs, indexed like the rays of the buffer being shot
+    HitRecord *hits;
+    uint8_t *ray_bins;
+    // Ray indices sorted by bin
+    uint32_t *sorted_ray_indices;
+    uint32_t *bin_counts;
+    uint32_t *bin_offsets;
+    uint32_t *bin_cursors;
+    // Light samples of the shaded rays, indexed like their rays
+    ShadowRecord *shadow_records;
+
+    // Filled by the paths of the frame, see radiance_cache.hpp
+    RadianceCache radiance_cache;
+    // Trained by the passes of the frame, see guiding.hpp
+    GuidingField guiding;
+
+    // Kernels of each stage of shoot_rays submitted during the frame. Only tracked
+    // when profiling.
+    std::vector<std::pair<WavefrontStage, sycl::event>> stage_events;
 
-    const uint32_t max_depth;
-    const uint32_t sample_count;
+    // Paths terminated by russian roulette, indexed by depth
+    uint64_t *roulette_counts;
+
+    const RenderSettings settings;
+
+    // Shading kernels built for the features of the last rendered scene. Shading
+    // kernels of material types the scene does not use are never launched.
+    std::optional<KernelSpecialization> specialization;
 
     WavefrontRenderer(
         App &app,
         sycl::range<2> img_size,
         sycl::image<2> &output_image,
-        uint32_t max_depth,
-        uint32_t sample_count
+        const RenderSettings &settings
     );
 
     virtual void render_frame(const Camera &camera, const Scene &scene) override;
@@ -70,9 +209,27 @@ struct WavefrontRenderer : public IRenderer {
     }
 
   private:
-    void generate_camera_rays(const Camera &camera, uint32_t sample);
-    void shoot_rays(const Camera &camera, const Scene &scene, uint32_t depth);
-    void merge_samples(uint32_t sample);
+    void generate_camera_rays(const Camera &camera);
+    void regenerate_rays(
+        const Camera &camera, uint64_t first_slot, uint64_t first_job, uint64_t count
+    );
+    void shoot_rays(const Camera &camera, const Scene &scene);
+    void intersect_rays(const Scene &scene);
+    void sort_hits(const Scene &scene);
+    template <typename Dispatch>
+    void shade_rays(
+        const Camera &camera, const Scene &scene, ShadeBin first_bin, ShadeBin last_bin
+    );
+    void trace_shadow_rays(const Scene &scene);
+    void specialize(const Scene &scene);
     void convert_image_to_srgb();
+
+    void track_stage(WavefrontStage stage, sycl::event event);
+    void print_stage_times();
+
+    void record_sample(const Camera &camera, const Scene &scene);
+
+    void render_samples(const Camera &camera, const Scene &scene);
+    void render_regenerating(const Camera &camera, const Scene &scene);
 };
 } // namespace raytracer
@@ -0,0 +1,171 @@
+#pragma once
+
+#include <sycl/sycl.hpp>
+#include "util.hpp"
+
+namespace raytracer {
+
+// Integer hash with good avalanche behaviour ("lowbias32" by Chris Wellons).
+inline uint32_t hash_u32(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+inline uint32_t reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+// Owen scrambling of the binary digits of `x`, most significant digit first (Burley,
+// "Practical Hash-based Owen Scrambling").
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits(x);
+}
+
+// Second dimension of the Sobol sequence. The first one is reverse_bits(index).
+inline uint32_t sobol_dim1(uint32_t index) {
+    uint32_t result = 0;
+    for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1) {
+        if (index & 1u) result ^= v;
+    }
+    return result;
+}
+
+// Sequences the random numbers of a path are drawn from.
+enum class SampleSequence : uint8_t {
+    // Independent hashed numbers for every pixel, sample, bounce and dimension.
+    eRandom,
+    // 2D Owen-scrambled Sobol points indexed by the sample. Every pixel uses the same
+    // points, toroidally shifted by a dither mask, so the error of neighbouring pixels
+    // is decorrelated like blue noise.
+    eSobol,
+};
+
+// Bits of a path key holding the sample index. The rest tag paths split off from the
+// path of the sample, and are 0 for the path of the camera ray.
+constexpr uint32_t PATH_KEY_SAMPLE_BITS = 24;
+constexpr uint32_t PATH_KEY_SAMPLE_MASK = (1u << PATH_KEY_SAMPLE_BITS) - 1;
+
+// Counter-based random numbers. Each number is a function of the pixel, the key of the
+// path, the bounce it is drawn for and its dimension, the index of the number within
+// the bounce. A path only has to carry its key between kernels, and every renderer
+// draws the same numbers for the same sample of a pixel.
+struct Rng {
+    SampleSequence sequence;
+    sycl::uint2 pixel;
+    uint32_t key;
+    uint32_t bounce;
+    uint32_t dimension = 0;
+
+    // Key of the path traced for `sample` of a pixel.
+    static inline uint32_t path_key(uint32_t sample) {
+        return sample & PATH_KEY_SAMPLE_MASK;
+    }
+
+    // Key of a path split off at `bounce` from the path with `key`, so the two paths
+    // do not draw the same numbers.
+    static inline uint32_t split_key(uint32_t key, uint32_t bounce) {
+        uint32_t tag = hash_u32(hash_u32(bounce + 0x632be5abu) ^ key);
+        tag = sycl::max(tag >> PATH_KEY_SAMPLE_BITS, 1u);
+        return (key & PATH_KEY_SAMPLE_MASK) | (tag << PATH_KEY_SAMPLE_BITS);
+    }
+
+    // Numbers of the path with `key` at `bounce`. The camera ray is sampled at bounce
+    // 0, the hit of a ray at depth d at bounce d + 1.
+    static inline Rng
+    at(SampleSequence sequence, sycl::int2 pixel, uint32_t key, uint32_t bounce) {
+        return Rng{
+            .sequence = sequence,
+            .pixel = pixel.convert<uint32_t>(),
+            .key = key,
+            .bounce = bounce,
+        };
+    }
+
+    // Next dimension as 32 bit fixed point numbers in [0, 1).
+    inline sycl::uint2 next_bits_2d() {
+        uint32_t seed = hash_u32(this->dimension++ + 0x85ebca6bu);
+        seed = hash_u32(seed ^ this->bounce);
+        seed = hash_u32(seed ^ (this->key >> PATH_KEY_SAMPLE_BITS));
+
+        if (this->sequence == SampleSequence::eRandom) {
+            uint32_t x = hash_u32(seed ^ this->key);
+            x = hash_u32(x ^ this->pixel.x());
+            x = hash_u32(x ^ this->pixel.y());
+            return sycl::uint2(x, hash_u32(x + 0x9e3779b9u));
+        }
+
+        // Same scramble for every pixel, shifted by the R2 dither mask of the pixel
+        // (Roberts, "The Unreasonable Effectiveness of Quasirandom Sequences"). Adding
+        // fixed point numbers wraps around, which makes the shift toroidal.
+        uint32_t index =
+            nested_uniform_scramble(this->key & PATH_KEY_SAMPLE_MASK, seed);
+        sycl::uint2 dither = sycl::uint2(
+            this->pixel.x() * 0xc13fa9a9u + this->pixel.y() * 0x91e10da5u,
+            this->pixel.x() * 0x91e10da5u + this->pixel.y() * 0xc13fa9a9u
+        );
+        return sycl::uint2(
+            nested_uniform_scramble(reverse_bits(index), hash_u32(seed ^ 1u)),
+            nested_uniform_scramble(sobol_dim1(index), hash_u32(seed ^ 2u))
+        ) + dither;
+    }
+
+    inline sycl::float2 next_2d() {
+        // 24 bits, so the result is never rounded up to 1
+        constexpr float scale = 1.f / (1u << 24);
+        sycl::uint2 bits = this->next_bits_2d();
+        return sycl::float2((bits.x() >> 8) * scale, (bits.y() >> 8) * scale);
+    }
+
+    // A single number takes a whole dimension, so pairs that are sampled together,
+    // such as the two coordinates of a direction, should use next_2d().
+    inline float operator()() {
+        return this->next_2d().x();
+    }
+
+    inline float operator()(float min, float max) {
+        return min + (max - min) * this->operator()();
+    }
+
+    // Uniformly distributed direction.
+    inline sycl::float3 random_unit_vector() {
+        sycl::float2 u = this->next_2d();
+        float z = 1.0f - 2.0f * u.x();
+        float r = sycl::sqrt(sycl::fmax(0.0f, 1.0f - z * z));
+        float phi = 2.0f * PI * u.y();
+        return sycl::float3(r * sycl::cos(phi), r * sycl::sin(phi), z);
+    }
+
+    // Cosine distributed direction around +z, with density z / PI.
+    inline sycl::float3 random_cosine_direction() {
+        sycl::float2 u = this->next_2d();
+        float r = sycl::sqrt(u.x());
+        float phi = 2.0f * PI * u.y();
+        return sycl::float3(
+            r * sycl::cos(phi), r * sycl::sin(phi), sycl::sqrt(1.0f - u.x())
+        );
+    }
+
+    inline sycl::float3 random_on_hemisphere(const sycl::float3 &normal) {
+        sycl::float3 on_unit_sphere = this->random_unit_vector();
+        if (dot(on_unit_sphere, normal) > 0.0) // In the same hemisphere as the normal
+            return on_unit_sphere;
+        else
+            return -on_unit_sphere;
+    }
+};
+
+} // namespace raytracer
@@ -1,6 +1,14 @@
 #include "scene.hpp"
 
 #include <embree4/rtcore_geometry.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <limits>
+#include <memory>
 #include <stdexcept>
 #include <string>
 #include <sycl/sycl.hpp>
@@ -10,6 +18,8 @@
 
 #include "formatters.hpp"
 #include "util.hpp"
+#include "thread_pool.hpp"
+#include "stb_image.h"
 
 static_assert(sizeof(glm::vec3) == 3 * sizeof(float));
 static_assert(alignof(glm::vec3) == alignof(float));
@@ -51,14 +61,313 @@ Node::~Node() {
 //     return *this;
 // }
 
-Scene::Scene(App &app, const std::string &filepath, glm::vec3 global_scale)
-    : global_scale(global_scale) {
+Scene::Scene(
+    App &app,
+    const std::string &filepath,
+    const SceneSettings &settings,
+    glm::vec3 global_scale
+)
+    : settings(settings), global_scale(global_scale) {
+    auto begin = std::chrono::high_resolution_clock::now();
+
+    ThreadPool pool;
+
+    const std::string cache_path = filepath + ".cache";
+    uint64_t content_hash = 0;
+    bool cached = false;
+    if (settings.use_cache) {
+        content_hash = hash_file_contents(filepath);
+        cached = this->load_cache(app, cache_path, content_hash);
+    }
+
+    if (!cached) {
+        this->load_gltf(app, filepath, pool);
+        if (settings.use_cache) {
+            if (this->write_cache(cache_path, content_hash)) {
+                fmt::println("Wrote scene cache: {}", cache_path);
+            } else {
+                fmt::println("Failed to write scene cache: {}", cache_path);
+            }
+        }
+    }
+
+    this->image_array = this->image_baker.bake_image(app.queue);
+    this->update_world_matrices();
+
+    this->compact_shading_attributes(app, pool);
+    this->create_shading_tables(app);
+    this->build_acceleration_structures(app, pool);
+    this->create_light_table(app);
+
+    // The scene's environment map is relative to the scene file
+    std::string environment_path = settings.environment_map;
+    if (environment_path.empty() && !this->environment_map.empty()) {
+        environment_path =
+            (std::filesystem::path(filepath).parent_path() / this->environment_map)
+                .string();
+    }
+    this->create_environment_map(app, environment_path);
+
+    if (this->camera_node_index) {
+        Node &camera_node = this->nodes[this->camera_node_index];
+        glm::mat4 camera_transform = this->node_global_matrix(camera_node);
+
+        this->camera_position = glm::vec3(camera_transform[3]);
+
+        glm::quat camera_rotation = glm::quat_cast(camera_transform);
+
+        glm::vec3 forward_vector = glm::vec3(0.0f, 0.0f, -1.0f);
+        this->camera_direction = glm::normalize(camera_rotation * forward_vector);
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin);
+    fmt::println(
+        "Scene loaded in {:.3f}s ({})",
+        elapsed.count() * 1e-9,
+        cached ? "from cache" : "from glTF"
+    );
+}
+
+// Embree memory monitor, keeps a running total of the bytes Embree allocated
+static bool track_embree_memory(void *user_ptr, ssize_t bytes, bool post) {
+    auto *total = (std::atomic<int64_t> *)user_ptr;
+    *total += bytes;
+    return true;
+}
+
+static const char *build_quality_name(RTCBuildQuality quality) {
+    switch (quality) {
+    case RTC_BUILD_QUALITY_LOW: return "low";
+    case RTC_BUILD_QUALITY_MEDIUM: return "medium";
+    case RTC_BUILD_QUALITY_HIGH: return "high";
+    case RTC_BUILD_QUALITY_REFIT: return "refit";
+    }
+    return "unknown";
+}
+
+void Scene::build_acceleration_structures(App &app, ThreadPool &pool) {
+    std::atomic<int64_t> bvh_bytes = 0;
+    rtcSetDeviceMemoryMonitorFunction(app.embree_device, track_embree_memory, &bvh_bytes);
+
+    auto begin = std::chrono::high_resolution_clock::now();
+
+    // With a flat BVH, meshes used by a single node are baked into the top-level
+    // scene and only shared meshes stay instanced
+    std::vector<uint32_t> mesh_users(this->meshes.size(), 0);
+    for (auto &node : this->nodes) {
+        if (node.mesh > -1) {
+            mesh_users[node.mesh]++;
+        }
+    }
+    auto is_flattened = [&](int32_t mesh) {
+        return this->settings.flat_bvh && mesh_users[mesh] == 1;
+    };
+
+    // Every instanced mesh has its own BVH, so they are all built concurrently
+    std::vector<Mesh *> instanced_meshes;
+    uint32_t flattened_meshes = 0;
+    for (size_t i = 0; i < this->meshes.size(); ++i) {
+        if (is_flattened(i)) {
+            flattened_meshes++;
+        } else {
+            instanced_meshes.push_back(&this->meshes[i]);
+        }
+    }
+    pool.parallel_for(instanced_meshes.size(), [&](size_t i) {
+        this->create_mesh_scene(app, *instanced_meshes[i]);
+    });
+
+    for (auto &node : this->nodes) {
+        if (node.mesh > -1) {
+            this->create_node_geometries(app, node, is_flattened(node.mesh));
+        }
+    }
+
+    // Top-level geometry ids index the instance table. A node has a single instance
+    // geometry, or one geometry per primitive when flattened, so geometry `i` of a
+    // node always shades as primitive `i` of its mesh.
+    this->scene = rtcNewScene(app.embree_device);
+    rtcSetSceneBuildQuality(this->scene, this->settings.build_quality);
+    rtcSetSceneFlags(this->scene, this->settings.scene_flags);
+    std::vector<InstanceData> instances;
+    for (auto &node : this->nodes) {
+        if (node.mesh < 0) continue;
+
+        const Mesh &mesh = this->meshes[node.mesh];
+        glm::mat3 obj_to_world =
+            glm::transpose(glm::inverse(glm::mat3(this->node_global_matrix(node))));
+        for (uint32_t i = 0; i < node.geometries.size(); ++i) {
+            rtcAttachGeometryByID(this->scene, node.geometries[i], instances.size());
+            instances.push_back(InstanceData{
+                .obj_to_world = obj_to_world,
+                .first_primitive = mesh.first_primitive + i,
+            });
+        }
+    }
+    rtcCommitScene(this->scene);
+
+    InstanceData *instance_table =
+        alignedSYCLMallocDeviceReadOnly<InstanceData>(app.queue, instances.size(), 16);
+    std::copy(instances.begin(), instances.end(), instance_table);
+    this->tables.instances = instance_table;
+
+    auto end = std::chrono::high_resolution_clock::now();
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin);
+
+    rtcSetDeviceMemoryMonitorFunction(app.embree_device, nullptr, nullptr);
+
+    fmt::println(
+        "BVH build ({} quality{}{}{}): {} BLAS, {} flattened meshes, {} instances on {} "
+        "threads in {:.3f}s, {:.2f} MiB",
+        build_quality_name(this->settings.build_quality),
+        (this->settings.scene_flags & RTC_SCENE_FLAG_COMPACT) ? ", compact" : "",
+        (this->settings.scene_flags & RTC_SCENE_FLAG_ROBUST) ? ", robust" : "",
+        this->settings.flat_bvh ? ", flat" : "",
+        instanced_meshes.size(),
+        flattened_meshes,
+        instances.size(),
+        pool.thread_count(),
+        elapsed.count() * 1e-9,
+        (double)bvh_bytes.load() / (1024.0 * 1024.0)
+    );
+}
+
+void Scene::create_light_table(App &app) {
+    std::vector<EmissiveTriangle> triangles;
+    std::vector<float> powers;
+    for (const auto &node : this->nodes) {
+        if (node.mesh < 0) continue;
+
+        glm::mat4 global_transform = this->node_global_matrix(node);
+        for (const auto &prim : this->meshes[node.mesh].primitives) {
+            sycl::float3 emission = this->materials[prim.material_index].emitted();
+            if (max_component(emission) <= 0.0f) continue;
+
+            for (uint32_t i = 0; i + 2 < prim.index_count; i += 3) {
+                sycl::float3 p[3];
+                for (int v = 0; v < 3; ++v) {
+                    glm::vec3 local = prim.positions[prim.indices[i + v]];
+                    glm::vec3 world =
+                        glm::vec3(global_transform * glm::vec4(local, 1.0f));
+                    p[v] = sycl::float3(world.x, world.y, world.z);
+                }
+
+                EmissiveTriangle tri = {
+                    .p0 = p[0],
+                    .e1 = p[1] - p[0],
+                    .e2 = p[2] - p[0],
+                    .emission = emission,
+                };
+                float area = 0.5f * sycl::length(sycl::cross(tri.e1, tri.e2));
+                triangles.push_back(tri);
+                powers.push_back(light_power(emission, area));
+            }
+        }
+    }
+
+    float total_power = 0.0f;
+    for (float power : powers) total_power += power;
+    if (triangles.empty() || total_power <= 0.0f) {
+        fmt::println("Light table: no emissive triangles");
+        return;
+    }
+
+    std::vector<LightAliasEntry> alias = build_alias_table(powers);
+
+    EmissiveTriangle *triangle_table = alignedSYCLMallocDeviceReadOnly<EmissiveTriangle>(
+        app.queue, triangles.size(), 16
+    );
+    std::copy(triangles.begin(), triangles.end(), triangle_table);
+    LightAliasEntry *alias_table =
+        alignedSYCLMallocDeviceReadOnly<LightAliasEntry>(app.queue, alias.size(), 16);
+    std::copy(alias.begin(), alias.end(), alias_table);
+
+    this->lights = LightTable{
+        .triangles = triangle_table,
+        .alias = alias_table,
+        .count = (uint32_t)triangles.size(),
+        .total_power = total_power,
+    };
+
+    size_t bytes =
+        triangles.size() * (sizeof(EmissiveTriangle) + sizeof(LightAliasEntry));
+    fmt::println(
+        "Light table: {} emissive triangles, {:.2f} KiB",
+        triangles.size(),
+        (double)bytes / 1024.0
+    );
+}
+
+void Scene::create_environment_map(App &app, const std::string &path) {
+    this->environment = EnvironmentMap{.color = this->sky_color};
+    if (path.empty()) return;
+
+    int width, height, channels;
+    // LDR images are converted to linear
+    float *pixels = stbi_loadf(path.c_str(), &width, &height, &channels, STBI_rgb_alpha);
+    if (!pixels) {
+        throw std::runtime_error(fmt::format(
+            "Failed to load environment map {}: {}", path, stbi_failure_reason()
+        ));
+    }
+
+    const uint32_t texel_count = (uint32_t)width * (uint32_t)height;
+    sycl::float4 *texels =
+        alignedSYCLMallocDeviceReadOnly<sycl::float4>(app.queue, texel_count, 16);
+    std::vector<float> weights(texel_count);
+    double total_weight = 0.0;
+    for (uint32_t i = 0; i < texel_count; ++i) {
+        const float *pixel = &pixels[i * 4];
+        texels[i] = sycl::float4(
+            pixel[0] * this->sky_strength,
+            pixel[1] * this->sky_strength,
+            pixel[2] * this->sky_strength,
+            1.0f
+        );
+        weights[i] = environment_texel_weight(texels[i], i / (uint32_t)width, height);
+        total_weight += weights[i];
+    }
+    stbi_image_free(pixels);
+
+    if (total_weight <= 0.0) {
+        fmt::println("Environment map: {} is black, using the sky color", path);
+        alignedSYCLFree(app.queue, texels);
+        return;
+    }
+
+    std::vector<LightAliasEntry> alias = build_alias_table(weights);
+    LightAliasEntry *alias_table =
+        alignedSYCLMallocDeviceReadOnly<LightAliasEntry>(app.queue, alias.size(), 16);
+    std::copy(alias.begin(), alias.end(), alias_table);
+
+    this->environment = EnvironmentMap{
+        .texels = texels,
+        .alias = alias_table,
+        .width = (uint32_t)width,
+        .height = (uint32_t)height,
+        .total_weight = (float)total_weight,
+        .color = this->sky_color,
+    };
+
+    size_t bytes = texel_count * (sizeof(sycl::float4) + sizeof(LightAliasEntry));
+    fmt::println(
+        "Environment map: {}x{} from {}, {:.2f} MiB",
+        width,
+        height,
+        path,
+        (double)bytes / (1024.0 * 1024.0)
+    );
+}
+
+void Scene::load_gltf(App &app, const std::string &filepath, ThreadPool &pool) {
     tinygltf::Model gltf_model;
     tinygltf::TinyGLTF loader;
     std::string err;
     std::string warn;
 
     loader.SetStoreOriginalJSONForExtrasAndExtensions(true);
+    loader.SetImageLoader(defer_image_decode, nullptr);
     bool ret = loader.LoadBinaryFromFile(&gltf_model, &err, &warn, filepath.c_str());
 
     if (!warn.empty()) {
@@ -69,10 +378,47 @@ Scene::Scene(App &app, const std::string &filepath, glm::vec3 global_scale)
         throw std::runtime_error("Failed to load .glTF : " + err);
     }
 
-    load_images(app, gltf_model);
-    this->image_array = this->image_baker.bake_image(app.queue);
-
-    load_primitives(app, gltf_model);
+    // Image decoding and resizing, and attribute conversion run on every core.
+    // Images go first since they are the largest jobs.
+    auto begin = std::chrono::high_resolution_clock::now();
+
+    std::vector<std::function<void()>> jobs;
+    load_images(app, gltf_model, jobs);
+    load_materials(gltf_model);
+    load_primitives(app, gltf_model, jobs);
+
+    pool.parallel_for(jobs.size(), [&](size_t i) { jobs[i](); });
+
+    auto end = std::chrono::high_resolution_clock::now();
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin);
+    fmt::println(
+        "Converted {} images and attributes on {} threads in {:.3f}s",
+        jobs.size(),
+        pool.thread_count(),
+        elapsed.count() * 1e-9
+    );
+
+    if (this->settings.reorder_primitives) {
+        begin = std::chrono::high_resolution_clock::now();
+
+        std::vector<Primitive *> primitives;
+        for (auto &mesh : this->meshes) {
+            for (auto &primitive : mesh.primitives) {
+                primitives.push_back(&primitive);
+            }
+        }
+        pool.parallel_for(primitives.size(), [&](size_t i) {
+            reorder_primitive(*primitives[i]);
+        });
+
+        end = std::chrono::high_resolution_clock::now();
+        elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin);
+        fmt::println(
+            "Reordered {} primitives in {:.3f}s",
+            primitives.size(),
+            elapsed.count() * 1e-9
+        );
+    }
 
     const tinygltf::Scene &scene =
         gltf_model.scenes[gltf_model.defaultScene > -1 ? gltf_model.defaultScene : 0];
@@ -90,168 +436,641 @@ Scene::Scene(App &app, const std::string &filepath, glm::vec3 global_scale)
     if (auto sky_strength = scene.extras.Get("sky_strength"); sky_strength.IsNumber()) {
         float sky_strength_float = (float)sky_strength.GetNumberAsDouble();
         this->sky_color *= sky_strength_float;
+        this->sky_strength = sky_strength_float;
         fmt::println("Sky strength: {}", sky_strength_float);
     }
 
+    if (auto environment_map = scene.extras.Get("environment_map");
+        environment_map.IsString()) {
+        this->environment_map = environment_map.Get<std::string>();
+        fmt::println("Environment map: {}", this->environment_map);
+    }
+
     this->nodes.resize(gltf_model.nodes.size());
     for (uint32_t node_index : scene.nodes) {
         this->load_node(app, gltf_model, node_index, {});
     }
 
-    this->scene = rtcNewScene(app.embree_device);
-    for (auto &node : this->nodes) {
-        for (auto &geom : node.geometries) {
-            rtcAttachGeometry(this->scene, geom);
+    if (this->camera_node_index > -1) {
+        auto &gltf_camera_node = gltf_model.nodes[this->camera_node_index];
+        float yfov = gltf_model.cameras[gltf_camera_node.camera].perspective.yfov;
+        this->camera_focal_length = 1.0f / glm::tan(yfov / 2.0f);
+    }
+}
+
+Scene::~Scene() {
+    if (this->scene) {
+        rtcReleaseScene(this->scene);
+    }
+}
+
+SceneFeatures Scene::features() const {
+    SceneFeatures features = {
+        .material_types = 0,
+        .texture_types = 0,
+        .traversal = RTC_FEATURE_FLAG_TRIANGLE,
+    };
+    auto add_texture = [&](const Texture &texture) {
+        features.texture_types |= 1u << (uint32_t)texture.type;
+    };
+    for (const Material &material : this->materials) {
+        features.material_types |= 1u << (uint32_t)material.type;
+        switch (material.type) {
+        case MaterialType::eDiffuse: add_texture(material.diffuse.albedo); break;
+        case MaterialType::eMetallic: add_texture(material.metallic.albedo); break;
+        case MaterialType::eDielectric:
+        case MaterialType::eNone: break;
         }
     }
-    rtcCommitScene(this->scene);
+    // Nodes of flattened meshes hold triangles, the others a single level instance
+    for (const Node &node : this->nodes) {
+        if (node.mesh > -1 && this->meshes[node.mesh].scene) {
+            features.traversal =
+                (RTCFeatureFlags)(features.traversal | RTC_FEATURE_FLAG_INSTANCE);
+            break;
+        }
+    }
+    return features;
+}
 
-    if (this->camera_node_index) {
-        auto &gltf_camera_node = gltf_model.nodes[this->camera_node_index];
-        Node &camera_node = this->nodes[this->camera_node_index];
-        glm::mat4 camera_transform = this->node_global_matrix(camera_node);
+glm::mat4 Scene::node_global_matrix(const Node &node) const {
+    return node.world_matrix * glm::scale(glm::mat4(1.0f), this->global_scale);
+}
 
-        this->camera_position = glm::vec3(camera_transform[3]);
+void Scene::update_world_matrices() {
+    std::vector<std::vector<uint32_t>> children(this->nodes.size());
+    std::vector<uint32_t> order;
+    order.reserve(this->nodes.size());
+    for (uint32_t i = 0; i < this->nodes.size(); ++i) {
+        if (this->nodes[i].parent) {
+            children[this->nodes[i].parent.value()].push_back(i);
+        } else {
+            order.push_back(i);
+        }
+    }
 
-        glm::quat camera_rotation = glm::quat_cast(camera_transform);
+    // Breadth first from the roots, so parents are always done before their children
+    for (size_t i = 0; i < order.size(); ++i) {
+        Node &node = this->nodes[order[i]];
+        node.world_matrix = node.local_matrix();
+        if (node.parent) {
+            node.world_matrix =
+                this->nodes[node.parent.value()].world_matrix * node.world_matrix;
+        }
+        for (uint32_t child : children[order[i]]) {
+            order.push_back(child);
+        }
+    }
+}
 
-        glm::vec3 euler = glm::degrees(glm::eulerAngles(camera_rotation));
+// Spreads the lower 10 bits of `v` out to every third bit.
+static uint32_t expand_bits(uint32_t v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
 
-        glm::vec3 forward_vector = glm::vec3(0.0f, 0.0f, -1.0f);
-        this->camera_direction = glm::normalize(camera_rotation * forward_vector);
+// 30 bit Morton code of a point in the unit cube.
+static uint32_t morton_code(glm::vec3 p) {
+    p = glm::clamp(p * 1024.0f, glm::vec3(0.0f), glm::vec3(1023.0f));
+    return (expand_bits((uint32_t)p.x) << 2) | (expand_bits((uint32_t)p.y) << 1) |
+           expand_bits((uint32_t)p.z);
+}
 
-        float yfov = gltf_model.cameras[gltf_camera_node.camera].perspective.yfov;
-        float aspect_ratio =
-            gltf_model.cameras[gltf_camera_node.camera].perspective.aspectRatio;
+// Sorts the triangles of `primitive` along a Morton curve through their centroids,
+// then renumbers the vertices in order of first use. Triangles that end up in the
+// same BVH leaf then also share cache lines of the index and vertex arrays.
+static void reorder_primitive(Primitive &primitive) {
+    const uint32_t triangle_count = primitive.index_count / 3;
+    if (triangle_count < 2) return;
+
+    std::vector<glm::vec3> centroids(triangle_count);
+    glm::vec3 min = glm::vec3(std::numeric_limits<float>::max());
+    glm::vec3 max = glm::vec3(std::numeric_limits<float>::lowest());
+    for (uint32_t t = 0; t < triangle_count; ++t) {
+        const uint32_t *tri = &primitive.indices[t * 3];
+        centroids[t] = (primitive.positions[tri[0]] + primitive.positions[tri[1]] +
+                        primitive.positions[tri[2]]) /
+                       3.0f;
+        min = glm::min(min, centroids[t]);
+        max = glm::max(max, centroids[t]);
+    }
 
-        this->camera_focal_length = 1.0f / glm::tan(yfov / 2.0f);
+    glm::vec3 extent = glm::max(max - min, glm::vec3(1e-20f));
+    std::vector<std::pair<uint32_t, uint32_t>> keys(triangle_count);
+    for (uint32_t t = 0; t < triangle_count; ++t) {
+        keys[t] = {morton_code((centroids[t] - min) / extent), t};
     }
+    std::sort(keys.begin(), keys.end());
+
+    // New index buffer in Morton order, with vertices numbered by first use
+    const uint32_t unused = std::numeric_limits<uint32_t>::max();
+    std::vector<uint32_t> vertex_remap(primitive.vertex_count, unused);
+    std::vector<uint32_t> indices(primitive.index_count);
+    uint32_t next_vertex = 0;
+    for (uint32_t t = 0; t < triangle_count; ++t) {
+        const uint32_t *tri = &primitive.indices[keys[t].second * 3];
+        for (uint32_t k = 0; k < 3; ++k) {
+            if (vertex_remap[tri[k]] == unused) {
+                vertex_remap[tri[k]] = next_vertex++;
+            }
+            indices[t * 3 + k] = vertex_remap[tri[k]];
+        }
+    }
+    // Unreferenced vertices go last
+    for (uint32_t &index : vertex_remap) {
+        if (index == unused) {
+            index = next_vertex++;
+        }
+    }
+
+    std::vector<glm::vec3> positions(primitive.vertex_count);
+    std::vector<glm::vec3> normals(primitive.vertex_count);
+    std::vector<sycl::float2> uvs(primitive.vertex_count);
+    for (size_t v = 0; v < primitive.vertex_count; ++v) {
+        positions[vertex_remap[v]] = primitive.positions[v];
+        normals[vertex_remap[v]] = primitive.normals[v];
+        uvs[vertex_remap[v]] = primitive.uvs[v];
+    }
+
+    std::copy(positions.begin(), positions.end(), primitive.positions);
+    std::copy(normals.begin(), normals.end(), primitive.normals);
+    std::copy(uvs.begin(), uvs.end(), primitive.uvs);
+    std::copy(indices.begin(), indices.end(), primitive.indices);
 }
 
-Scene::~Scene() {
-    if (this->scene) {
-        rtcReleaseScene(this->scene);
+// tinygltf image loader that keeps the encoded bytes, so images can be decoded in
+// parallel once the file is parsed. See Scene::load_images.
+static bool defer_image_decode(
+    tinygltf::Image *image,
+    const int image_index,
+    std::string *err,
+    std::string *warn,
+    int req_width,
+    int req_height,
+    const unsigned char *bytes,
+    int size,
+    void *user_data
+) {
+    image->image.assign(bytes, bytes + size);
+    image->as_is = true;
+    return true;
+}
+
+static SceneCacheMaterial to_cache_material(const Material &material) {
+    SceneCacheMaterial cached = {};
+    cached.type = (uint8_t)material.type;
+
+    auto set_albedo = [&](const Texture &texture) {
+        if (texture.type == TextureType::eImage) {
+            cached.albedo_is_image = 1;
+            cached.albedo_image = texture.image_ref.index;
+        } else {
+            cached.albedo_color[0] = texture.color.x();
+            cached.albedo_color[1] = texture.color.y();
+            cached.albedo_color[2] = texture.color.z();
+        }
+    };
+    auto set_emissive = [&](sycl::float3 emissive) {
+        cached.emissive[0] = emissive.x();
+        cached.emissive[1] = emissive.y();
+        cached.emissive[2] = emissive.z();
+    };
+
+    switch (material.type) {
+    case MaterialType::eDiffuse:
+        set_albedo(material.diffuse.albedo);
+        set_emissive(material.diffuse.emissive);
+        break;
+    case MaterialType::eMetallic:
+        set_albedo(material.metallic.albedo);
+        set_emissive(material.metallic.emissive);
+        cached.roughness = material.metallic.roughness;
+        break;
+    case MaterialType::eDielectric: cached.ior = material.dielectric.ior; break;
+    case MaterialType::eNone: break;
     }
+
+    return cached;
 }
 
-glm::mat4 Scene::node_global_matrix(const Node &node) const {
-    glm::mat4 m = node.local_matrix() * glm::scale(glm::mat4(1.0f), this->global_scale);
-    std::optional<uint32_t> p = node.parent;
-    while (p) {
-        const Node &parent = nodes[p.value()];
-        m = parent.local_matrix() * m;
-        p = parent.parent;
-    }
-    return m;
+static Material from_cache_material(const SceneCacheMaterial &cached) {
+    Texture albedo = Texture(sycl::float3(
+        cached.albedo_color[0], cached.albedo_color[1], cached.albedo_color[2]
+    ));
+    if (cached.albedo_is_image) {
+        albedo = Texture(ImageRef{cached.albedo_image});
+    }
+    sycl::float3 emissive =
+        sycl::float3(cached.emissive[0], cached.emissive[1], cached.emissive[2]);
+
+    switch ((MaterialType)cached.type) {
+    case MaterialType::eDiffuse:
+        return MaterialDiffuse{
+            .albedo = albedo,
+            .emissive = emissive,
+        };
+    case MaterialType::eMetallic:
+        return MaterialMetallic{
+            .albedo = albedo,
+            .roughness = cached.roughness,
+            .emissive = emissive,
+        };
+    case MaterialType::eDielectric:
+        return MaterialDielectric{
+            .ior = cached.ior,
+        };
+    case MaterialType::eNone: break;
+    }
+    return Material();
+}
+
+// Copies `count` elements of a cached array into memory the renderers can use. Host
+// Embree devices read straight from the mapping, GPU devices need USM.
+template <typename T>
+static T *
+load_cache_array(App &app, const MappedFile &file, uint64_t offset, size_t count) {
+    const T *cached = file.at<T>(offset, count);
+    if (app.use_cpu || count == 0) {
+        return const_cast<T *>(cached);
+    }
+
+    T *array = alignedSYCLMallocDeviceReadOnly<T>(app.queue, count, 16);
+    std::memcpy(array, cached, sizeof(T) * count);
+    return array;
 }
 
-void Scene::load_images(App &app, const tinygltf::Model &gltf_model) {
+bool Scene::load_cache(App &app, const std::string &cache_path, uint64_t content_hash) {
+    auto file = std::make_unique<MappedFile>(cache_path);
+    if (!file->valid()) {
+        return false;
+    }
+
+    const SceneCacheHeader *header = file->at<SceneCacheHeader>(0);
+    if (!header || header->magic != SCENE_CACHE_MAGIC ||
+        header->version != SCENE_CACHE_VERSION ||
+        header->content_hash != content_hash ||
+        header->image_width != (uint32_t)IMAGE_SIZE.x() ||
+        header->image_height != (uint32_t)IMAGE_SIZE.y() ||
+        header->flags != this->cache_flags()) {
+        fmt::println("Scene cache is stale: {}", cache_path);
+        return false;
+    }
+
+    const size_t image_texels = IMAGE_SIZE.x() * IMAGE_SIZE.y() * IMAGE_CHANNELS;
+    const uint8_t *texels = file->at<uint8_t>(
+        header->images_offset, (uint64_t)header->image_count * image_texels
+    );
+    const SceneCacheMaterial *cached_materials = file->at<SceneCacheMaterial>(
+        header->materials_offset, header->material_count
+    );
+    const SceneCacheMesh *cached_meshes =
+        file->at<SceneCacheMesh>(header->meshes_offset, header->mesh_count);
+    const SceneCachePrimitive *cached_primitives = file->at<SceneCachePrimitive>(
+        header->primitives_offset, header->primitive_count
+    );
+    const SceneCacheNode *cached_nodes =
+        file->at<SceneCacheNode>(header->nodes_offset, header->node_count);
+    const char *environment_map =
+        file->at<char>(header->environment_map_offset, header->environment_map_length);
+
+    // Validate every section before touching the scene
+    bool valid = texels && cached_materials && cached_meshes && cached_primitives &&
+                 cached_nodes && environment_map && header->image_count <= MAX_IMAGES;
+    for (uint32_t i = 0; valid && i < header->material_count; ++i) {
+        const SceneCacheMaterial &material = cached_materials[i];
+        valid = !material.albedo_is_image || material.albedo_image < header->image_count;
+    }
+    for (uint32_t i = 0; valid && i < header->mesh_count; ++i) {
+        const SceneCacheMesh &mesh = cached_meshes[i];
+        valid = mesh.first_primitive <= header->primitive_count &&
+                mesh.primitive_count <= header->primitive_count - mesh.first_primitive;
+    }
+    for (uint32_t i = 0; valid && i < header->primitive_count; ++i) {
+        const SceneCachePrimitive &prim = cached_primitives[i];
+        valid = file->at<glm::vec3>(prim.positions_offset, prim.vertex_count) &&
+                file->at<glm::vec3>(prim.normals_offset, prim.vertex_count) &&
+                file->at<sycl::float2>(prim.uvs_offset, prim.vertex_count) &&
+                file->at<uint32_t>(prim.indices_offset, prim.index_count) &&
+                prim.index_count % 3 == 0 && prim.material_index < header->material_count;
+    }
+    for (uint32_t i = 0; valid && i < header->node_count; ++i) {
+        const SceneCacheNode &node = cached_nodes[i];
+        valid = node.parent < (int32_t)header->node_count &&
+                node.mesh < (int32_t)header->mesh_count;
+    }
+    valid = valid && header->camera_node_index < (int32_t)header->node_count;
+    if (!valid) {
+        fmt::println("Scene cache is corrupt: {}", cache_path);
+        return false;
+    }
+
+    this->images.resize(header->image_count);
+    for (uint32_t i = 0; i < header->image_count; ++i) {
+        this->images[i] = this->image_baker.add_image(texels + i * image_texels);
+    }
+
+    this->materials.resize(header->material_count);
+    for (uint32_t i = 0; i < header->material_count; ++i) {
+        this->materials[i] = from_cache_material(cached_materials[i]);
+    }
+
+    this->meshes.resize(header->mesh_count);
+    for (uint32_t i = 0; i < header->mesh_count; ++i) {
+        const SceneCacheMesh &cached_mesh = cached_meshes[i];
+        Mesh &mesh = this->meshes[i];
+
+        mesh.primitives.resize(cached_mesh.primitive_count);
+        for (uint32_t j = 0; j < cached_mesh.primitive_count; ++j) {
+            const SceneCachePrimitive &cached =
+                cached_primitives[cached_mesh.first_primitive + j];
+            Primitive &primitive = mesh.primitives[j];
+
+            primitive.vertex_count = cached.vertex_count;
+            primitive.index_count = cached.index_count;
+            primitive.positions = load_cache_array<glm::vec3>(
+                app, *file, cached.positions_offset, cached.vertex_count
+            );
+            primitive.normals = load_cache_array<glm::vec3>(
+                app, *file, cached.normals_offset, cached.vertex_count
+            );
+            primitive.uvs = load_cache_array<sycl::float2>(
+                app, *file, cached.uvs_offset, cached.vertex_count
+            );
+            primitive.indices = load_cache_array<uint32_t>(
+                app, *file, cached.indices_offset, cached.index_count
+            );
+            primitive.material_index = cached.material_index;
+        }
+    }
+
+    this->nodes.resize(header->node_count);
+    for (uint32_t i = 0; i < header->node_count; ++i) {
+        const SceneCacheNode &cached = cached_nodes[i];
+        Node &node = this->nodes[i];
+
+        if (cached.parent > -1) {
+            node.parent = (uint32_t)cached.parent;
+        }
+        node.mesh = cached.mesh;
+        node.translation = glm::make_vec3(cached.translation);
+        node.scale = glm::make_vec3(cached.scale);
+        node.rotation = glm::make_quat(cached.rotation);
+        node.matrix = glm::make_mat4x4(cached.matrix);
+    }
+
+    this->camera_node_index = header->camera_node_index;
+    this->camera_focal_length = header->camera_focal_length;
+    this->sky_color =
+        sycl::float3(header->sky_color[0], header->sky_color[1], header->sky_color[2]);
+    this->sky_strength = header->sky_strength;
+    this->environment_map =
+        std::string(environment_map, header->environment_map_length);
+
+    // Host devices keep pointing into the mapping, so it lives as long as the scene
+    this->cache_file = std::move(file);
+    return true;
+}
+
+bool Scene::write_cache(const std::string &cache_path, uint64_t content_hash) const {
+    SceneCacheWriter writer;
+
+    SceneCacheHeader header = {};
+    header.magic = SCENE_CACHE_MAGIC;
+    header.version = SCENE_CACHE_VERSION;
+    header.content_hash = content_hash;
+    header.flags = this->cache_flags();
+    header.image_count = this->image_baker.images.size();
+    header.image_width = IMAGE_SIZE.x();
+    header.image_height = IMAGE_SIZE.y();
+    header.material_count = this->materials.size();
+    header.mesh_count = this->meshes.size();
+    header.node_count = this->nodes.size();
+    header.camera_node_index = this->camera_node_index;
+    header.camera_focal_length = this->camera_focal_length;
+    header.sky_color[0] = this->sky_color.x();
+    header.sky_color[1] = this->sky_color.y();
+    header.sky_color[2] = this->sky_color.z();
+    header.sky_strength = this->sky_strength;
+    header.environment_map_length = this->environment_map.size();
+    header.environment_map_offset = writer.append_array(
+        this->environment_map.data(), this->environment_map.size()
+    );
+
+    const size_t image_texels = IMAGE_SIZE.x() * IMAGE_SIZE.y() * IMAGE_CHANNELS;
+    std::vector<uint8_t> texels(this->image_baker.images.size() * image_texels);
+    for (size_t i = 0; i < this->image_baker.images.size(); ++i) {
+        std::memcpy(
+            texels.data() + i * image_texels,
+            this->image_baker.images[i].data.data(),
+            image_texels
+        );
+    }
+    header.images_offset = writer.append_array(texels.data(), texels.size());
+
+    std::vector<SceneCacheMaterial> cached_materials;
+    for (const Material &material : this->materials) {
+        cached_materials.push_back(to_cache_material(material));
+    }
+    header.materials_offset =
+        writer.append_array(cached_materials.data(), cached_materials.size());
+
+    std::vector<SceneCacheMesh> cached_meshes;
+    std::vector<SceneCachePrimitive> cached_primitives;
+    for (const Mesh &mesh : this->meshes) {
+        cached_meshes.push_back(SceneCacheMesh{
+            .first_primitive = (uint32_t)cached_primitives.size(),
+            .primitive_count = (uint32_t)mesh.primitives.size(),
+        });
+
+        for (const Primitive &primitive : mesh.primitives) {
+            SceneCachePrimitive cached = {};
+            cached.material_index = primitive.material_index;
+            cached.vertex_count = primitive.vertex_count;
+            cached.index_count = primitive.index_count;
+            cached.positions_offset =
+                writer.append_array(primitive.positions, primitive.vertex_count);
+            cached.normals_offset =
+                writer.append_array(primitive.normals, primitive.vertex_count);
+            cached.uvs_offset =
+                writer.append_array(primitive.uvs, primitive.vertex_count);
+            cached.indices_offset =
+                writer.append_array(primitive.indices, primitive.index_count);
+            cached_primitives.push_back(cached);
+        }
+    }
+    header.primitive_count = cached_primitives.size();
+    header.meshes_offset =
+        writer.append_array(cached_meshes.data(), cached_meshes.size());
+    header.primitives_offset =
+        writer.append_array(cached_primitives.data(), cached_primitives.size());
+
+    std::vector<SceneCacheNode> cached_nodes;
+    for (const Node &node : this->nodes) {
+        SceneCacheNode cached = {};
+        cached.parent = node.parent ? (int32_t)node.parent.value() : -1;
+        cached.mesh = node.mesh;
+        std::memcpy(cached.translation, &node.translation[0], sizeof(cached.translation));
+        std::memcpy(cached.scale, &node.scale[0], sizeof(cached.scale));
+        std::memcpy(cached.rotation, &node.rotation[0], sizeof(cached.rotation));
+        std::memcpy(cached.matrix, &node.matrix[0][0], sizeof(cached.matrix));
+        cached_nodes.push_back(cached);
+    }
+    header.nodes_offset = writer.append_array(cached_nodes.data(), cached_nodes.size());
+
+    return writer.write(cache_path, header);
+}
+
+void Scene::load_images(
+    App &app, const tinygltf::Model &gltf_model, std::vector<std::function<void()>> &jobs
+) {
     this->images.resize(gltf_model.images.size());
 
     fmt::println("Loading {} images", gltf_model.images.size());
 
     for (size_t i = 0; i < gltf_model.images.size(); i++) {
         const tinygltf::Image &gltf_image = gltf_model.images[i];
+        ImageRef image_ref = this->image_baker.allocate_image();
+        this->images[i] = image_ref;
+
+        if (!gltf_image.as_is) {
+            jobs.push_back([this, &gltf_image, image_ref] {
+                this->image_baker.resize_image(
+                    image_ref,
+                    gltf_image.width,
+                    gltf_image.height,
+                    gltf_image.image.data()
+                );
+            });
+            continue;
+        }
 
-        assert(!gltf_image.as_is);
+        // Still encoded, see defer_image_decode
+        jobs.push_back([this, &gltf_image, image_ref] {
+            int width, height, channels;
+            stbi_uc *pixels = stbi_load_from_memory(
+                gltf_image.image.data(),
+                (int)gltf_image.image.size(),
+                &width,
+                &height,
+                &channels,
+                STBI_rgb_alpha
+            );
+            if (!pixels) {
+                throw std::runtime_error(fmt::format(
+                    "Failed to decode image {}: {}",
+                    image_ref.index,
+                    stbi_failure_reason()
+                ));
+            }
 
-        this->images[i] = this->image_baker.upload_image(
-            gltf_image.width, gltf_image.height, gltf_image.image.data()
-        );
+            this->image_baker.resize_image(image_ref, width, height, pixels);
+            stbi_image_free(pixels);
+        });
     }
 }
 
-void Scene::load_primitives(App &app, const tinygltf::Model &gltf_model) {
-    this->meshes.resize(gltf_model.meshes.size());
+void Scene::load_materials(const tinygltf::Model &gltf_model) {
+    this->materials.resize(gltf_model.materials.size());
 
-    for (size_t i = 0; i < gltf_model.meshes.size(); i++) {
-        const tinygltf::Mesh &gltf_mesh = gltf_model.meshes[i];
-        Mesh &mesh = this->meshes[i];
+    for (size_t i = 0; i < gltf_model.materials.size(); i++) {
+        const tinygltf::Material &gltf_material = gltf_model.materials[i];
+        Material &material = this->materials[i];
 
-        mesh.primitives.resize(gltf_mesh.primitives.size());
-        for (size_t j = 0; j < gltf_mesh.primitives.size(); j++) {
-            const tinygltf::Primitive &gltf_primitive = gltf_mesh.primitives[j];
-            Primitive &primitive = mesh.primitives[j];
+#if 1
+        fmt::println("Material[{}]: {}", i, gltf_material.name);
+        for (auto &ext : gltf_material.extensions) {
+            fmt::println("Extension: {}", ext.first);
+        }
+#endif
 
-            assert(gltf_primitive.material > -1);
+        const auto &pbr = gltf_material.pbrMetallicRoughness;
+        const auto &base_color_vec = pbr.baseColorFactor;
+        sycl::float3 base_color =
+            sycl::float3(base_color_vec[0], base_color_vec[1], base_color_vec[2]);
+
+        const auto &emissive_vec = gltf_material.emissiveFactor;
+        sycl::float3 emissive =
+            sycl::float3(emissive_vec[0], emissive_vec[1], emissive_vec[2]);
+
+        float emissive_strength = 0.0f;
+        if (auto emissive_strength_ext =
+                gltf_material.extensions.find("KHR_materials_emissive_strength");
+            emissive_strength_ext != gltf_material.extensions.end()) {
+            emissive_strength =
+                (float)emissive_strength_ext->second.Get("emissiveStrength")
+                    .GetNumberAsDouble();
+        }
+        emissive = emissive * emissive_strength;
 
-            const tinygltf::Material &gltf_material =
-                gltf_model.materials[gltf_primitive.material];
+        auto ior_ext = gltf_material.extensions.find("KHR_materials_ior");
+        auto transmission_ext =
+            gltf_material.extensions.find("KHR_materials_transmission");
 
-#if 1
-            fmt::println("Material[{}]: {}", gltf_primitive.material, gltf_material.name);
-            for (auto &ext : gltf_material.extensions) {
-                fmt::println("Extension: {}", ext.first);
+        if (ior_ext != gltf_material.extensions.end() &&
+            transmission_ext != gltf_material.extensions.end()) {
+            float ior = (float)ior_ext->second.Get("ior").GetNumberAsDouble();
+            material = MaterialDielectric{
+                .ior = ior,
+            };
+            fmt::println("Dielectric: ior={}", ior);
+        } else if (pbr.metallicFactor > 0.01f) {
+            Texture texture = Texture(base_color);
+            if (gltf_material.pbrMetallicRoughness.baseColorTexture.index > -1) {
+                uint32_t texture_index =
+                    gltf_material.pbrMetallicRoughness.baseColorTexture.index;
+                uint32_t image_index = gltf_model.textures[texture_index].source;
+
+                texture = Texture(this->images[image_index]);
             }
-#endif
 
-            const auto &pbr = gltf_material.pbrMetallicRoughness;
-            const auto &base_color_vec = pbr.baseColorFactor;
-            sycl::float3 base_color =
-                sycl::float3(base_color_vec[0], base_color_vec[1], base_color_vec[2]);
-
-            const auto &emissive_vec =
-                gltf_model.materials[gltf_primitive.material].emissiveFactor;
-            sycl::float3 emissive =
-                sycl::float3(emissive_vec[0], emissive_vec[1], emissive_vec[2]);
-
-            float emissive_strength = 0.0f;
-            if (auto emissive_strength_ext =
-                    gltf_material.extensions.find("KHR_materials_emissive_strength");
-                emissive_strength_ext != gltf_material.extensions.end()) {
-                emissive_strength =
-                    (float)emissive_strength_ext->second.Get("emissiveStrength")
-                        .GetNumberAsDouble();
+            material = MaterialMetallic{
+                .albedo = texture,
+                .roughness = (float)pbr.roughnessFactor,
+                .emissive = emissive,
+            };
+            fmt::println(
+                "Metallic: roughness={}, emissive={}",
+                (float)pbr.roughnessFactor,
+                emissive
+            );
+        } else {
+            Texture texture = Texture(base_color);
+            if (gltf_material.pbrMetallicRoughness.baseColorTexture.index > -1) {
+                uint32_t texture_index =
+                    gltf_material.pbrMetallicRoughness.baseColorTexture.index;
+                uint32_t image_index = gltf_model.textures[texture_index].source;
+
+                texture = Texture(this->images[image_index]);
             }
-            emissive = emissive * emissive_strength;
 
-            auto ior_ext = gltf_material.extensions.find("KHR_materials_ior");
-            auto transmission_ext =
-                gltf_material.extensions.find("KHR_materials_transmission");
+            material = MaterialDiffuse{
+                .albedo = texture,
+                .emissive = emissive,
+            };
+            fmt::println("Diffuse: albedo={}, emissive={}", base_color, emissive);
+        }
+    }
+}
 
-            if (ior_ext != gltf_material.extensions.end() &&
-                transmission_ext != gltf_material.extensions.end()) {
-                float ior = (float)ior_ext->second.Get("ior").GetNumberAsDouble();
-                primitive.material = MaterialDielectric{
-                    .ior = ior,
-                };
-                fmt::println("Dielectric: ior={}", ior);
-            } else if (pbr.metallicFactor > 0.01f) {
-                Texture texture = Texture(base_color);
-                if (gltf_material.pbrMetallicRoughness.baseColorTexture.index > -1) {
-                    uint32_t texture_index =
-                        gltf_material.pbrMetallicRoughness.baseColorTexture.index;
-                    uint32_t image_index = gltf_model.textures[texture_index].source;
-
-                    texture = Texture(this->images[image_index]);
-                }
+void Scene::load_primitives(
+    App &app, const tinygltf::Model &gltf_model, std::vector<std::function<void()>> &jobs
+) {
+    this->meshes.resize(gltf_model.meshes.size());
 
-                primitive.material = MaterialMetallic{
-                    .albedo = texture,
-                    .roughness = (float)pbr.roughnessFactor,
-                    .emissive = emissive,
-                };
-                fmt::println(
-                    "Metallic: roughness={}, emissive={}",
-                    (float)pbr.roughnessFactor,
-                    emissive
-                );
-            } else {
-                Texture texture = Texture(base_color);
-                if (gltf_material.pbrMetallicRoughness.baseColorTexture.index > -1) {
-                    uint32_t texture_index =
-                        gltf_material.pbrMetallicRoughness.baseColorTexture.index;
-                    uint32_t image_index = gltf_model.textures[texture_index].source;
+    for (size_t i = 0; i < gltf_model.meshes.size(); i++) {
+        const tinygltf::Mesh &gltf_mesh = gltf_model.meshes[i];
+        Mesh &mesh = this->meshes[i];
 
-                    texture = Texture(this->images[image_index]);
-                }
+        mesh.primitives.resize(gltf_mesh.primitives.size());
+        for (size_t j = 0; j < gltf_mesh.primitives.size(); j++) {
+            const tinygltf::Primitive &gltf_primitive = gltf_mesh.primitives[j];
+            Primitive &primitive = mesh.primitives[j];
 
-                primitive.material = MaterialDiffuse{
-                    .albedo = texture,
-                    .emissive = emissive,
-                };
-                fmt::println("Diffuse: albedo={}, emissive={}", base_color, emissive);
-            }
+            assert(gltf_primitive.material > -1);
+            primitive.material_index = gltf_primitive.material;
 
             // We only work with indices
             bool has_indices = gltf_primitive.indices > -1;
@@ -298,10 +1117,6 @@ void Scene::load_primitives(App &app, const tinygltf::Model &gltf_model) {
                 app.queue, primitive.vertex_count, 16
             );
 
-            for (size_t v = 0; v < pos_accessor.count; v++) {
-                primitive.positions[v] = glm::make_vec3(&buffer_pos[v * pos_byte_stride]);
-            }
-
             // Normal buffer
 
             const tinygltf::Accessor &normal_accessor =
@@ -322,11 +1137,6 @@ void Scene::load_primitives(App &app, const tinygltf::Model &gltf_model) {
                 app.queue, primitive.vertex_count, 16
             );
 
-            for (size_t v = 0; v < primitive.vertex_count; v++) {
-                primitive.normals[v] =
-                    glm::make_vec3(&buffer_normal[v * normal_byte_stride]);
-            }
-
             // UV buffer
 
             const tinygltf::Accessor &uv_accessor =
@@ -348,10 +1158,6 @@ void Scene::load_primitives(App &app, const tinygltf::Model &gltf_model) {
                 app.queue, primitive.vertex_count, 16
             );
 
-            for (size_t v = 0; v < primitive.vertex_count; v++) {
-                primitive.uvs[v] = *((sycl::float2 *)&buffer_uv[v * uv_byte_stride]);
-            }
-
             // Index buffer
             const tinygltf::Accessor &indices_accessor =
                 gltf_model
@@ -371,74 +1177,202 @@ void Scene::load_primitives(App &app, const tinygltf::Model &gltf_model) {
                 app.queue, primitive.index_count, 16
             );
 
-            switch (indices_accessor.componentType) {
-            case TINYGLTF_PARAMETER_TYPE_UNSIGNED_INT: {
-                const uint32_t *buf = static_cast<const uint32_t *>(indices_data_ptr);
-                for (size_t index = 0; index < indices_accessor.count; index++) {
-                    primitive.indices[index] = buf[index];
-                }
-                break;
+            int index_type = indices_accessor.componentType;
+            if (index_type != TINYGLTF_PARAMETER_TYPE_UNSIGNED_INT &&
+                index_type != TINYGLTF_PARAMETER_TYPE_UNSIGNED_SHORT &&
+                index_type != TINYGLTF_PARAMETER_TYPE_UNSIGNED_BYTE) {
+                fmt::println("Index component type {} not supported!", index_type);
+                assert(0);
             }
-            case TINYGLTF_PARAMETER_TYPE_UNSIGNED_SHORT: {
-                const uint16_t *buf = static_cast<const uint16_t *>(indices_data_ptr);
-                for (size_t index = 0; index < indices_accessor.count; index++) {
-                    primitive.indices[index] = buf[index];
+
+            // Allocations happen above, the conversion loops only touch the arrays of
+            // this primitive and run on the thread pool
+            jobs.push_back([&primitive,
+                            buffer_pos,
+                            pos_byte_stride,
+                            buffer_normal,
+                            normal_byte_stride,
+                            buffer_uv,
+                            uv_byte_stride,
+                            indices_data_ptr,
+                            index_type] {
+                for (size_t v = 0; v < primitive.vertex_count; v++) {
+                    primitive.positions[v] =
+                        glm::make_vec3(&buffer_pos[v * pos_byte_stride]);
+                    primitive.normals[v] =
+                        glm::make_vec3(&buffer_normal[v * normal_byte_stride]);
+                    primitive.uvs[v] = *((sycl::float2 *)&buffer_uv[v * uv_byte_stride]);
                 }
-                break;
-            }
-            case TINYGLTF_PARAMETER_TYPE_UNSIGNED_BYTE: {
-                const uint8_t *buf = static_cast<const uint8_t *>(indices_data_ptr);
-                for (size_t index = 0; index < indices_accessor.count; index++) {
-                    primitive.indices[index] = buf[index];
+
+                switch (index_type) {
+                case TINYGLTF_PARAMETER_TYPE_UNSIGNED_INT: {
+                    const uint32_t *buf = static_cast<const uint32_t *>(indices_data_ptr);
+                    for (size_t index = 0; index < primitive.index_count; index++) {
+                        primitive.indices[index] = buf[index];
+                    }
+                    break;
                 }
-                break;
-            }
-            default:
-                fmt::println(
-                    "Index component type {} not supported!",
-                    indices_accessor.componentType
-                );
-                assert(0);
-            }
+                case TINYGLTF_PARAMETER_TYPE_UNSIGNED_SHORT: {
+                    const uint16_t *buf = static_cast<const uint16_t *>(indices_data_ptr);
+                    for (size_t index = 0; index < primitive.index_count; index++) {
+                        primitive.indices[index] = buf[index];
+                    }
+                    break;
+                }
+                case TINYGLTF_PARAMETER_TYPE_UNSIGNED_BYTE: {
+                    const uint8_t *buf = static_cast<const uint8_t *>(indices_data_ptr);
+                    for (size_t index = 0; index < primitive.index_count; index++) {
+                        primitive.indices[index] = buf[index];
+                    }
+                    break;
+                }
+                }
+            });
+        }
+    }
+}
 
-            // Create geometry and scene for instancing later
+void Scene::compact_shading_attributes(App &app, ThreadPool &pool) {
+    std::vector<Primitive *> primitives;
+    size_t vertex_count = 0;
+    for (auto &mesh : this->meshes) {
+        for (auto &primitive : mesh.primitives) {
+            primitives.push_back(&primitive);
+            vertex_count += primitive.vertex_count;
+        }
+    }
 
-            RTCGeometry geom =
-                rtcNewGeometry(app.embree_device, RTC_GEOMETRY_TYPE_TRIANGLE);
+    if (!this->settings.compact_attributes) {
+        size_t bytes = vertex_count * (sizeof(glm::vec3) + sizeof(sycl::float2));
+        fmt::println(
+            "Shading attributes: {:.2f} MiB (float)", (double)bytes / (1024.0 * 1024.0)
+        );
+        return;
+    }
 
-            rtcSetSharedGeometryBuffer(
-                geom,
-                RTC_BUFFER_TYPE_VERTEX,
-                0,
-                RTC_FORMAT_FLOAT3,
-                primitive.positions,
-                0,
-                sizeof(glm::vec3),
-                primitive.vertex_count
-            );
+    for (Primitive *primitive : primitives) {
+        primitive->compact_vertices = alignedSYCLMallocDeviceReadOnly<CompactVertex>(
+            app.queue, primitive->vertex_count, 16
+        );
+    }
 
-            assert(primitive.index_count % 3 == 0);
-            uint32_t triangle_count = primitive.index_count / 3;
-            rtcSetSharedGeometryBuffer(
-                geom,
-                RTC_BUFFER_TYPE_INDEX,
-                0,
-                RTC_FORMAT_UINT3,
-                primitive.indices,
-                0,
-                3 * sizeof(uint32_t),
-                triangle_count
-            );
+    pool.parallel_for(primitives.size(), [&](size_t i) {
+        Primitive &primitive = *primitives[i];
+        for (size_t v = 0; v < primitive.vertex_count; ++v) {
+            primitive.compact_vertices[v] = CompactVertex{
+                .normal = encode_octahedral(primitive.normals[v]),
+                .uv = {primitive.uvs[v].x(), primitive.uvs[v].y()},
+            };
+        }
+    });
+
+    // Arrays loaded from a mapped cache on host devices are not USM
+    sycl::context context = app.queue.get_context();
+    for (Primitive *primitive : primitives) {
+        for (void *ptr : {(void *)primitive->normals, (void *)primitive->uvs}) {
+            bool is_usm =
+                ptr && sycl::get_pointer_type(ptr, context) != sycl::usm::alloc::unknown;
+            if (is_usm) {
+                sycl::free(ptr, context);
+            }
+        }
+        primitive->normals = nullptr;
+        primitive->uvs = nullptr;
+    }
 
-            rtcCommitGeometry(geom);
+    size_t bytes = vertex_count * sizeof(CompactVertex);
+    fmt::println(
+        "Shading attributes: {:.2f} MiB (compact)", (double)bytes / (1024.0 * 1024.0)
+    );
+}
 
-            primitive.scene = rtcNewScene(app.embree_device);
-            rtcAttachGeometry(primitive.scene, geom);
-            rtcCommitScene(primitive.scene);
+void Scene::create_shading_tables(App &app) {
+    Material *material_table = alignedSYCLMallocDeviceReadOnly<Material>(
+        app.queue, this->materials.size(), 16
+    );
+    for (size_t i = 0; i < this->materials.size(); ++i) {
+        material_table[i] = this->materials[i];
+    }
 
-            rtcReleaseGeometry(geom);
+    std::vector<PrimitiveData> primitives;
+    for (auto &mesh : this->meshes) {
+        mesh.first_primitive = primitives.size();
+        for (const auto &prim : mesh.primitives) {
+            primitives.push_back(PrimitiveData{
+                .normal_buffer = prim.normals,
+                .uv_buffer = prim.uvs,
+                .compact_vertex_buffer = prim.compact_vertices,
+                .index_buffer = prim.indices,
+                .material_index = prim.material_index,
+            });
         }
     }
+    PrimitiveData *primitive_table =
+        alignedSYCLMallocDeviceReadOnly<PrimitiveData>(app.queue, primitives.size(), 16);
+    std::copy(primitives.begin(), primitives.end(), primitive_table);
+
+    this->tables.materials = material_table;
+    this->tables.primitives = primitive_table;
+
+    size_t bytes = this->materials.size() * sizeof(Material) +
+                   primitives.size() * sizeof(PrimitiveData);
+    fmt::println(
+        "Shading tables: {} materials, {} primitives, {:.2f} KiB",
+        this->materials.size(),
+        primitives.size(),
+        (double)bytes / 1024.0
+    );
+}
+
+// Shares the index buffer of `primitive` and `positions` with a triangle geometry.
+static void set_triangle_buffers(
+    RTCGeometry geom, const glm::vec3 *positions, const Primitive &primitive
+) {
+    rtcSetSharedGeometryBuffer(
+        geom,
+        RTC_BUFFER_TYPE_VERTEX,
+        0,
+        RTC_FORMAT_FLOAT3,
+        positions,
+        0,
+        sizeof(glm::vec3),
+        primitive.vertex_count
+    );
+
+    assert(primitive.index_count % 3 == 0);
+    uint32_t triangle_count = primitive.index_count / 3;
+    rtcSetSharedGeometryBuffer(
+        geom,
+        RTC_BUFFER_TYPE_INDEX,
+        0,
+        RTC_FORMAT_UINT3,
+        primitive.indices,
+        0,
+        3 * sizeof(uint32_t),
+        triangle_count
+    );
+}
+
+void Scene::create_mesh_scene(App &app, Mesh &mesh) {
+    // One geometry per primitive, so the geometry id of a hit inside an instance is
+    // the index of the primitive
+    mesh.scene = rtcNewScene(app.embree_device);
+    rtcSetSceneBuildQuality(mesh.scene, this->settings.build_quality);
+    rtcSetSceneFlags(mesh.scene, this->settings.scene_flags);
+
+    for (uint32_t i = 0; i < mesh.primitives.size(); ++i) {
+        Primitive &primitive = mesh.primitives[i];
+
+        RTCGeometry geom = rtcNewGeometry(app.embree_device, RTC_GEOMETRY_TYPE_TRIANGLE);
+        rtcSetGeometryBuildQuality(geom, this->settings.build_quality);
+        set_triangle_buffers(geom, primitive.positions, primitive);
+        rtcCommitGeometry(geom);
+
+        rtcAttachGeometryByID(mesh.scene, geom, i);
+        rtcReleaseGeometry(geom);
+    }
+
+    rtcCommitScene(mesh.scene);
 }
 
 void Scene::load_node(
@@ -476,36 +1410,44 @@ void Scene::load_node(
     }
 
     // Node contains mesh data
-    if (gltf_node.mesh != -1) {
-        const tinygltf::Mesh gltf_mesh = gltf_model.meshes[gltf_node.mesh];
-        Mesh &mesh = this->meshes[gltf_node.mesh];
-
-        node.geometries.resize(mesh.primitives.size());
-        for (size_t i = 0; i < mesh.primitives.size(); ++i) {
-            Primitive &prim = mesh.primitives[i];
-            RTCGeometry *geom = &node.geometries[i];
-            *geom = rtcNewGeometry(app.embree_device, RTC_GEOMETRY_TYPE_INSTANCE);
-            rtcSetGeometryTimeStepCount(*geom, 1);
-            rtcSetGeometryInstancedScene(*geom, prim.scene);
-            glm::mat4 global_transform = this->node_global_matrix(node);
-            rtcSetGeometryTransform(
-                *geom, 0, RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR, &global_transform[0][0]
-            );
+    node.mesh = gltf_node.mesh;
+}
 
-            GeometryData *user_data =
-                alignedSYCLMallocDeviceReadOnly<GeometryData>(app.queue, 1, 16);
-            *user_data = GeometryData{
-                .vertex_buffer = prim.positions,
-                .normal_buffer = prim.normals,
-                .uv_buffer = prim.uvs,
-                .index_buffer = prim.indices,
-                .obj_to_world = glm::transpose(glm::inverse(glm::mat3(global_transform))),
-                .material = prim.material,
-            };
-            rtcSetGeometryUserData(*geom, user_data);
+void Scene::create_node_geometries(App &app, Node &node, bool flatten) {
+    Mesh &mesh = this->meshes[node.mesh];
+    glm::mat4 global_transform = this->node_global_matrix(node);
+
+    // Shading data comes from the tables, see build_acceleration_structures
+    if (!flatten) {
+        RTCGeometry geom = rtcNewGeometry(app.embree_device, RTC_GEOMETRY_TYPE_INSTANCE);
+        rtcSetGeometryTimeStepCount(geom, 1);
+        rtcSetGeometryInstancedScene(geom, mesh.scene);
+        rtcSetGeometryTransform(
+            geom, 0, RTC_FORMAT_FLOAT4X4_COLUMN_MAJOR, &global_transform[0][0]
+        );
+        rtcCommitGeometry(geom);
+
+        node.geometries.push_back(geom);
+        return;
+    }
 
-            rtcCommitGeometry(*geom);
+    node.geometries.resize(mesh.primitives.size());
+    for (size_t i = 0; i < mesh.primitives.size(); ++i) {
+        Primitive &prim = mesh.primitives[i];
+        RTCGeometry *geom = &node.geometries[i];
+
+        // World space copy of the positions, the other attributes are shared
+        glm::vec3 *vertex_buffer =
+            alignedSYCLMallocDeviceReadOnly<glm::vec3>(app.queue, prim.vertex_count, 16);
+        for (size_t v = 0; v < prim.vertex_count; ++v) {
+            vertex_buffer[v] =
+                glm::vec3(global_transform * glm::vec4(prim.positions[v], 1.0f));
         }
+
+        *geom = rtcNewGeometry(app.embree_device, RTC_GEOMETRY_TYPE_TRIANGLE);
+        rtcSetGeometryBuildQuality(*geom, this->settings.build_quality);
+        set_triangle_buffers(*geom, vertex_buffer, prim);
+        rtcCommitGeometry(*geom);
     }
 }
 
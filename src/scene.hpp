@@ -1,5 +1,7 @@
 #pragma once
 
+#include <functional>
+#include <memory>
 #include <string>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -8,45 +10,142 @@
 #include "tiny_gltf.h"
 
 #include "app.hpp"
-#include "xorshift.hpp"
+#include "rng.hpp"
 #include "util.hpp"
 #include "material.hpp"
+#include "lights.hpp"
+#include "scene_cache.hpp"
+#include "thread_pool.hpp"
 
 namespace raytracer {
 
-struct GeometryData {
-    glm::vec3 *vertex_buffer;
+struct SceneSettings {
+    // Load the scene from its preprocessed cache when it is up to date, and write
+    // the cache otherwise.
+    bool use_cache = true;
+
+    // Quality of the primitive and top-level BVHs. Low builds fastest, for previews.
+    // High uses spatial splits, building slower but tracing faster, for final frames.
+    RTCBuildQuality build_quality = RTC_BUILD_QUALITY_MEDIUM;
+
+    // Any of RTC_SCENE_FLAG_COMPACT and RTC_SCENE_FLAG_ROBUST, applied to every
+    // Embree scene.
+    RTCSceneFlags scene_flags = RTC_SCENE_FLAG_NONE;
+
+    // Sort the triangles of every primitive along a Morton curve and renumber the
+    // vertices by first use, for locality of BVH leaves and attribute fetches.
+    bool reorder_primitives = true;
+
+    // Store vertex normals and uvs as one compact record per vertex (CompactVertex)
+    // instead of separate float arrays.
+    bool compact_attributes = false;
+
+    // Bake meshes that are used by a single node into world space triangles of the
+    // top-level scene, so their rays skip instance traversal. Meshes used by several
+    // nodes stay instanced.
+    bool flat_bvh = false;
+
+    // Equirectangular HDR image that lights the scene instead of the sky color.
+    // Overrides the `environment_map` property of the scene when set.
+    std::string environment_map = {};
+};
+
+// Shading attributes of a vertex in the compact layout: an octahedral encoded normal
+// as two snorm16 values, and the uv as two halfs.
+struct CompactVertex {
+    uint32_t normal;
+    sycl::half uv[2];
+};
+static_assert(sizeof(CompactVertex) == 8);
+
+// Maps a unit vector to the octahedron and stores it as two snorm16 values.
+inline uint32_t encode_octahedral(glm::vec3 n) {
+    float sum = glm::abs(n.x) + glm::abs(n.y) + glm::abs(n.z);
+    if (sum == 0.0f) {
+        n = glm::vec3(0.0f, 0.0f, 1.0f);
+        sum = 1.0f;
+    }
+    n /= sum;
+
+    glm::vec2 p = glm::vec2(n.x, n.y);
+    if (n.z < 0.0f) {
+        // Fold the lower hemisphere over the diagonals
+        p = (1.0f - glm::abs(glm::vec2(n.y, n.x))) *
+            glm::vec2(n.x >= 0.0f ? 1.0f : -1.0f, n.y >= 0.0f ? 1.0f : -1.0f);
+    }
+
+    int16_t x = (int16_t)glm::round(glm::clamp(p.x, -1.0f, 1.0f) * 32767.0f);
+    int16_t y = (int16_t)glm::round(glm::clamp(p.y, -1.0f, 1.0f) * 32767.0f);
+    return (uint32_t)(uint16_t)x | ((uint32_t)(uint16_t)y << 16);
+}
+
+// Inverse of encode_octahedral, returns a unit vector.
+inline glm::vec3 decode_octahedral(uint32_t encoded) {
+    float x = (float)(int16_t)(encoded & 0xffff) / 32767.0f;
+    float y = (float)(int16_t)(encoded >> 16) / 32767.0f;
+
+    glm::vec3 n = glm::vec3(x, y, 1.0f - glm::abs(x) - glm::abs(y));
+    float t = glm::max(-n.z, 0.0f);
+    n.x += n.x >= 0.0f ? -t : t;
+    n.y += n.y >= 0.0f ? -t : t;
+    return glm::normalize(n);
+}
+
+// Shading data of a top-level geometry, indexed by its geometry id. See
+// hit_shading_data.
+struct InstanceData {
+    glm::mat3 obj_to_world;
+    // Index into ShadingTables::primitives of the first primitive of the mesh, or of
+    // the primitive itself for flattened triangles
+    uint32_t first_primitive;
+};
+
+// Shading data of a primitive, shared by every node that uses its mesh
+struct PrimitiveData {
+    // Either the normal and uv buffers, or the compact vertex buffer is set
     glm::vec3 *normal_buffer;
     sycl::float2 *uv_buffer;
+    CompactVertex *compact_vertex_buffer;
     uint32_t *index_buffer;
-    glm::mat3 obj_to_world;
-    Material material;
+    // Index into ShadingTables::materials
+    uint32_t material_index;
 };
 
 struct Primitive {
     glm::vec3 *positions;
     glm::vec3 *normals;
     sycl::float2 *uvs;
+    // Replaces `normals` and `uvs` with SceneSettings::compact_attributes
+    CompactVertex *compact_vertices = nullptr;
     size_t vertex_count;
     uint32_t *indices;
     uint32_t index_count;
 
-    RTCScene scene;
-
-    Material material;
+    // Index into Scene::materials
+    uint32_t material_index;
 };
 
 struct Mesh {
     std::vector<Primitive> primitives;
+    // Index of `primitives[0]` in ShadingTables::primitives
+    uint32_t first_primitive = 0;
+
+    // One triangle geometry per primitive, with the primitive index as geometry id.
+    // Instanced by nodes, null when the mesh is flattened into the top-level scene.
+    RTCScene scene = nullptr;
 };
 
 struct Node {
     std::optional<uint32_t> parent = {};
+    // Index into Scene::meshes, -1 when the node has no mesh
+    int32_t mesh = -1;
     std::vector<RTCGeometry> geometries = {};
     glm::vec3 translation{};
     glm::vec3 scale{1.0f};
     glm::quat rotation{};
     glm::mat4 matrix{1.0f};
+    // Parent chain times local_matrix(), see Scene::update_world_matrices
+    glm::mat4 world_matrix{1.0f};
 
     Node() = default;
 
@@ -62,11 +161,17 @@ struct Node {
 };
 
 struct Scene {
+    const SceneSettings settings;
+
     std::vector<Node> nodes;
     std::vector<ImageRef> images;
     std::vector<Mesh> meshes;
+    // One per glTF material, indexed by Primitive::material_index
+    std::vector<Material> materials;
     glm::vec3 global_scale;
     RTCScene scene;
+    ShadingTables tables = {};
+    LightTable lights = {};
     int camera_node_index = -1;
 
     glm::vec3 camera_position;
@@ -74,26 +179,75 @@ struct Scene {
     float camera_focal_length;
 
     sycl::float3 sky_color = {0.5f, 0.7f, 1.0f};
+    // Scales the environment map, `sky_color` is already scaled
+    float sky_strength = 1.0f;
+    // Path of the environment map relative to the scene file, from the
+    // `environment_map` property of the scene
+    std::string environment_map = {};
+    EnvironmentMap environment = {};
 
     mutable ImageManager image_baker = {};
     mutable std::optional<sycl::image<3>> image_array;
 
+    // Mapping of the scene cache the scene was loaded from, if any
+    std::unique_ptr<MappedFile> cache_file;
+
     Scene(const Scene &) = delete;
     Scene &operator=(const Scene &) = delete;
 
     Scene(Scene &&other) = delete;
     Scene &operator=(Scene &&other) = delete;
 
+    // Loads `filepath` from its scene cache when `settings.use_cache` is set and the
+    // cache is up to date, otherwise from the glTF file, writing a new cache.
     Scene(
-        App &app, const std::string &filepath, glm::vec3 global_scale = {1.0f, 1.0f, 1.0f}
+        App &app,
+        const std::string &filepath,
+        const SceneSettings &settings = {},
+        glm::vec3 global_scale = {1.0f, 1.0f, 1.0f}
     );
 
     ~Scene();
 
+    // Material and texture types used by `materials` and the geometry types of the
+    // top-level scene, which the render kernels are specialized on. Only valid once
+    // the acceleration structures are built.
+    SceneFeatures features() const;
+
     glm::mat4 node_global_matrix(const Node &node) const;
+    // Computes the world matrix of every node in one pass over the hierarchy.
+    void update_world_matrices();
+
+    // SceneCacheHeader::flags matching the settings
+    inline uint32_t cache_flags() const {
+        return this->settings.reorder_primitives ? SCENE_CACHE_FLAG_REORDERED : 0;
+    }
+
+    bool load_cache(App &app, const std::string &cache_path, uint64_t content_hash);
+    bool write_cache(const std::string &cache_path, uint64_t content_hash) const;
 
-    void load_images(App &app, const tinygltf::Model &gltf_model);
-    void load_primitives(App &app, const tinygltf::Model &gltf_model);
+    void load_gltf(App &app, const std::string &filepath, ThreadPool &pool);
+    // Both fill in the scene serially and append the expensive conversion work to
+    // `jobs`, which may run in parallel.
+    void load_images(
+        App &app,
+        const tinygltf::Model &gltf_model,
+        std::vector<std::function<void()>> &jobs
+    );
+    void load_primitives(
+        App &app,
+        const tinygltf::Model &gltf_model,
+        std::vector<std::function<void()>> &jobs
+    );
+    void load_materials(const tinygltf::Model &gltf_model);
+
+    // Converts the normals and uvs of every primitive to CompactVertex when
+    // compact attributes are enabled, and reports the memory of the attributes.
+    void compact_shading_attributes(App &app, ThreadPool &pool);
+
+    // Uploads the material and primitive tables and assigns Mesh::first_primitive.
+    // The instance table is filled by build_acceleration_structures.
+    void create_shading_tables(App &app);
 
     void load_node(
         App &app,
@@ -101,6 +255,20 @@ struct Scene {
         uint32_t node_index,
         std::optional<uint32_t> parent_index
     );
+
+    // Builds the BVH of every mesh in parallel, then the instances and the top-level
+    // scene with its instance table, and reports the build time and memory.
+    void build_acceleration_structures(App &app, ThreadPool &pool);
+    // Collects the world space triangles of every emissive primitive of every node
+    // into the light table, and reports their count and memory.
+    void create_light_table(App &app);
+    // Loads the environment map at `path` scaled by `sky_strength`, and uploads it
+    // with an alias table over its texels. Escaped rays see `sky_color` without one.
+    void create_environment_map(App &app, const std::string &path);
+    void create_mesh_scene(App &app, Mesh &mesh);
+    // Creates the top-level geometries of a node: an instance of the mesh scene, or
+    // world space triangles of every primitive when `flatten` is set.
+    void create_node_geometries(App &app, Node &node, bool flatten);
 };
 
 } // namespace raytracer
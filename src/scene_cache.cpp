@@ -0,0 +1,117 @@
+#include "scene_cache.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace raytracer;
+
+uint64_t raytracer::hash_file_contents(const std::string &path) {
+    MappedFile file(path);
+    if (!file.valid()) {
+        throw std::runtime_error("Failed to read " + path);
+    }
+
+    // Four independent lanes consume 8 bytes each per step, so the multiplies of
+    // neighbouring words overlap instead of waiting on each other
+    constexpr uint64_t K1 = 0x9e3779b97f4a7c15ull;
+    constexpr uint64_t K2 = 0xc2b2ae3d27d4eb4full;
+    auto mix = [&](uint64_t hash, uint64_t word) {
+        hash ^= word * K1;
+        hash = (hash << 31) | (hash >> 33);
+        return hash * K2;
+    };
+
+    uint64_t lanes[4] = {K1, K2, ~K1, ~K2};
+    size_t i = 0;
+    for (; i + 32 <= file.size; i += 32) {
+        uint64_t words[4];
+        memcpy(words, file.data + i, sizeof(words));
+        for (int l = 0; l < 4; ++l) {
+            lanes[l] = mix(lanes[l], words[l]);
+        }
+    }
+
+    uint64_t hash = file.size;
+    for (int l = 0; l < 4; ++l) {
+        hash = mix(hash, lanes[l]);
+    }
+    for (; i + 8 <= file.size; i += 8) {
+        uint64_t word;
+        memcpy(&word, file.data + i, sizeof(word));
+        hash = mix(hash, word);
+    }
+    if (i < file.size) {
+        uint64_t word = 0;
+        memcpy(&word, file.data + i, file.size - i);
+        hash = mix(hash, word);
+    }
+
+    // Final avalanche, every input bit affects every output bit
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+MappedFile::MappedFile(const std::string &path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *ptr = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr != MAP_FAILED) {
+            this->data = (const uint8_t *)ptr;
+            this->size = (size_t)st.st_size;
+        }
+    }
+
+    // The mapping stays valid after closing the descriptor
+    close(fd);
+}
+
+MappedFile::~MappedFile() {
+    if (this->data) {
+        munmap((void *)this->data, this->size);
+    }
+}
+
+SceneCacheWriter::SceneCacheWriter() {
+    this->bytes.resize(sizeof(SceneCacheHeader), 0);
+}
+
+uint64_t SceneCacheWriter::append(const void *data, size_t size) {
+    // Leave room for Embree's 16 byte over-read past the previous section
+    size_t offset = this->bytes.size() + 16;
+    offset = (offset + SCENE_CACHE_ALIGNMENT - 1) & ~(SCENE_CACHE_ALIGNMENT - 1);
+
+    this->bytes.resize(offset + size, 0);
+    if (size > 0) {
+        std::memcpy(this->bytes.data() + offset, data, size);
+    }
+    return offset;
+}
+
+bool SceneCacheWriter::write(const std::string &path, const SceneCacheHeader &header) {
+    std::memcpy(this->bytes.data(), &header, sizeof(header));
+    // Trailing padding of the last section
+    this->bytes.resize(this->bytes.size() + 16, 0);
+
+    std::string tmp_path = path + ".tmp";
+    FILE *file = fopen(tmp_path.c_str(), "wb");
+    if (!file) return false;
+
+    bool ok = fwrite(this->bytes.data(), 1, this->bytes.size(), file) ==
+              this->bytes.size();
+    ok = (fclose(file) == 0) && ok;
+    if (!ok || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,149 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace raytracer {
+
+// Preprocessed scenes are stored next to the asset as `<asset>.cache`. The file holds
+// the converted vertex, index and uv arrays, materials, nodes and the resized texture
+// texels, so loading it skips glTF parsing and image resizing altogether.
+//
+// Layout: a SceneCacheHeader followed by sections addressed by byte offsets from the
+// start of the file. Every section starts at a SCENE_CACHE_ALIGNMENT boundary and is
+// followed by at least 16 bytes of padding, which is what Embree asks of shared
+// vertex buffers, so a mapped file can be handed to rtcSetSharedGeometryBuffer as is.
+//
+// Bump SCENE_CACHE_VERSION whenever the layout or the conversion of any field
+// changes. Caches with another version, or made from different asset contents, are
+// ignored and rewritten.
+constexpr uint32_t SCENE_CACHE_MAGIC = 0x43535452; // "RTSC"
+constexpr uint32_t SCENE_CACHE_VERSION = 4;
+constexpr size_t SCENE_CACHE_ALIGNMENT = 64;
+
+// SceneCacheHeader::flags, the cache is stale when they differ from the settings
+constexpr uint32_t SCENE_CACHE_FLAG_REORDERED = 1u << 0;
+
+struct SceneCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t content_hash;
+    uint32_t flags;
+
+    uint32_t image_count;
+    uint32_t image_width;
+    uint32_t image_height;
+    uint32_t material_count;
+    uint32_t mesh_count;
+    uint32_t primitive_count;
+    uint32_t node_count;
+
+    int32_t camera_node_index;
+    float camera_focal_length;
+    float sky_color[3];
+    float sky_strength;
+    // Characters of Scene::environment_map, without a terminator
+    uint32_t environment_map_length;
+
+    uint64_t images_offset;
+    uint64_t materials_offset;
+    uint64_t meshes_offset;
+    uint64_t primitives_offset;
+    uint64_t nodes_offset;
+    uint64_t environment_map_offset;
+};
+
+// Flattened Material. Texture colors and image indices share `albedo_color` /
+// `albedo_image` depending on `albedo_is_image`.
+struct SceneCacheMaterial {
+    uint8_t type;
+    uint8_t albedo_is_image;
+    uint32_t albedo_image;
+    float albedo_color[3];
+    float emissive[3];
+    float roughness;
+    float ior;
+};
+
+struct SceneCacheMesh {
+    uint32_t first_primitive;
+    uint32_t primitive_count;
+};
+
+struct SceneCachePrimitive {
+    // Index into the materials section
+    uint32_t material_index;
+    uint64_t vertex_count;
+    uint64_t index_count;
+    uint64_t positions_offset;
+    uint64_t normals_offset;
+    uint64_t uvs_offset;
+    uint64_t indices_offset;
+};
+
+struct SceneCacheNode {
+    int32_t parent;
+    int32_t mesh;
+    float translation[3];
+    float scale[3];
+    float rotation[4];
+    float matrix[16];
+};
+
+// 64-bit hash of the contents of the file at `path`, 8 bytes at a time. Throws if
+// the file cannot be read.
+uint64_t hash_file_contents(const std::string &path);
+
+// Read-only memory mapping of a whole file.
+struct MappedFile {
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+
+    // Leaves the mapping empty when the file does not exist or cannot be mapped.
+    MappedFile(const std::string &path);
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    MappedFile(MappedFile &&) = delete;
+    MappedFile &operator=(MappedFile &&) = delete;
+
+    ~MappedFile();
+
+    inline bool valid() const {
+        return this->data != nullptr;
+    }
+
+    // Returns the `count` elements at `offset`, or nullptr when they do not fit in
+    // the file.
+    template <typename T> const T *at(uint64_t offset, uint64_t count = 1) const {
+        if (offset > this->size || count > (this->size - offset) / sizeof(T)) {
+            return nullptr;
+        }
+        return reinterpret_cast<const T *>(this->data + offset);
+    }
+};
+
+// Builds a cache file in memory. Sections are appended in any order and the header
+// is patched in before writing.
+struct SceneCacheWriter {
+    std::vector<uint8_t> bytes;
+
+    SceneCacheWriter();
+
+    // Appends `size` bytes as a new aligned section and returns its offset.
+    uint64_t append(const void *data, size_t size);
+
+    template <typename T> uint64_t append_array(const T *data, size_t count) {
+        return this->append(data, sizeof(T) * count);
+    }
+
+    // Writes the header and the sections to `path`. The file is written under a
+    // temporary name first so that readers never see a partial cache. Returns false
+    // on failure.
+    bool write(const std::string &path, const SceneCacheHeader &header);
+};
+
+} // namespace raytracer
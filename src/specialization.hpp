@@ -0,0 +1,144 @@
+#pragma once
+
+#include <chrono>
+#include <optional>
+#include <string>
+#include <vector>
+#include <sycl/sycl.hpp>
+#include <fmt/core.h>
+
+#include "render.hpp"
+
+namespace raytracer {
+
+// Specialization constants of the render kernels, read with specialize_kernel. When
+// the kernels are JIT compiled, branches that depend on them are folded away. Embree
+// specializes its traversal on its own constant, rtc::feature_mask, which is always
+// set to SceneFeatures::traversal.
+inline constexpr sycl::specialization_id<SceneFeatures> SCENE_FEATURES;
+inline constexpr sycl::specialization_id<uint32_t> MAX_DEPTH(10u);
+
+// Lists the names of the material and texture types of `features`.
+inline std::string describe_features(const SceneFeatures &features) {
+    std::string result = "materials:";
+    const std::pair<MaterialType, const char *> materials[] = {
+        {MaterialType::eDiffuse, "diffuse"},
+        {MaterialType::eMetallic, "metallic"},
+        {MaterialType::eDielectric, "dielectric"},
+    };
+    for (auto [type, name] : materials) {
+        if (features.has(type)) result += fmt::format(" {}", name);
+    }
+
+    result += ", textures:";
+    const std::pair<TextureType, const char *> textures[] = {
+        {TextureType::eColor, "color"},
+        {TextureType::eImage, "image"},
+    };
+    for (auto [type, name] : textures) {
+        if (features.has(type)) result += fmt::format(" {}", name);
+    }
+
+    result += ", traversal:";
+    if (features.traversal == RTC_FEATURE_FLAG_ALL) {
+        result += " all";
+    } else {
+        const std::pair<RTCFeatureFlags, const char *> traversal[] = {
+            {RTC_FEATURE_FLAG_TRIANGLE, "triangle"},
+            {RTC_FEATURE_FLAG_INSTANCE, "instance"},
+        };
+        for (auto [flag, name] : traversal) {
+            if (features.traversal & flag) result += fmt::format(" {}", name);
+        }
+    }
+    return result;
+}
+
+// Features the kernels of a renderer are specialized on for `scene`.
+inline SceneFeatures kernel_features(const Scene &scene, const RenderSettings &settings) {
+    SceneFeatures features = scene.features();
+    if (!settings.traversal_feature_mask) {
+        features.traversal = RTC_FEATURE_FLAG_ALL;
+    }
+    return features;
+}
+
+// Values the kernels of a renderer are specialized on, and the executable bundle
+// built for them. Without a bundle, the kernels were compiled ahead of time and get
+// the values through their handler instead.
+struct KernelSpecialization {
+    SceneFeatures features;
+    uint32_t max_depth;
+    std::optional<sycl::kernel_bundle<sycl::bundle_state::executable>> bundle;
+
+    inline bool matches(const SceneFeatures &features, uint32_t max_depth) const {
+        return this->features.material_types == features.material_types &&
+               this->features.texture_types == features.texture_types &&
+               this->features.traversal == features.traversal &&
+               this->max_depth == max_depth;
+    }
+
+    // Must be called by every command group that launches one of the kernels.
+    inline void apply(sycl::handler &cgh) const {
+        if (this->bundle) {
+            cgh.use_kernel_bundle(*this->bundle);
+        } else {
+            cgh.set_specialization_constant<SCENE_FEATURES>(this->features);
+            cgh.set_specialization_constant<rtc::feature_mask>(this->features.traversal);
+            cgh.set_specialization_constant<MAX_DEPTH>(this->max_depth);
+        }
+    }
+};
+
+// Builds `kernels` specialized for `features` and `max_depth` before they are first
+// submitted, and reports the variant and the time spent in the JIT.
+inline KernelSpecialization specialize_kernels(
+    const sycl::queue &queue,
+    const std::vector<sycl::kernel_id> &kernels,
+    const SceneFeatures &features,
+    uint32_t max_depth
+) {
+    KernelSpecialization specialization = {
+        .features = features,
+        .max_depth = max_depth,
+    };
+
+    auto begin = std::chrono::high_resolution_clock::now();
+
+    sycl::context context = queue.get_context();
+    std::vector<sycl::device> devices = {queue.get_device()};
+    if (sycl::has_kernel_bundle<sycl::bundle_state::input>(context, devices, kernels)) {
+        auto input =
+            sycl::get_kernel_bundle<sycl::bundle_state::input>(context, devices, kernels);
+        input.set_specialization_constant<SCENE_FEATURES>(features);
+        input.set_specialization_constant<rtc::feature_mask>(features.traversal);
+        input.set_specialization_constant<MAX_DEPTH>(max_depth);
+        specialization.bundle = sycl::build(input);
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin);
+
+    fmt::println(
+        "Kernel variant: {}, max depth {}", describe_features(features), max_depth
+    );
+    if (specialization.bundle) {
+        fmt::println(
+            "JIT compiled {} kernels in {:.3f}s", kernels.size(), elapsed.count() * 1e-9
+        );
+    } else {
+        fmt::println("Kernels compiled ahead of time, constants are set at launch");
+    }
+
+    return specialization;
+}
+
+// Copies the specialization constants into the kernel's own context and settings.
+template <typename Context>
+inline void
+specialize_kernel(sycl::kernel_handler &h, Context &ctx, RenderSettings &settings) {
+    ctx.features = h.get_specialization_constant<SCENE_FEATURES>();
+    settings.max_depth = h.get_specialization_constant<MAX_DEPTH>();
+}
+
+} // namespace raytracer
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace raytracer {
+
+// Fixed set of host threads for scene loading work. Work is handed out as index
+// ranges through `parallel_for`, which the calling thread also helps with.
+struct ThreadPool {
+    std::vector<std::thread> threads;
+
+    std::mutex mutex;
+    std::condition_variable work_ready;
+    std::condition_variable work_done;
+    bool stopping = false;
+
+    // Current job, guarded by `mutex` except for the atomics
+    const std::function<void(size_t)> *job = nullptr;
+    size_t job_size = 0;
+    uint64_t job_generation = 0;
+    std::atomic<size_t> next_index = 0;
+    uint32_t busy_threads = 0;
+    std::exception_ptr job_error;
+
+    ThreadPool(uint32_t thread_count = std::thread::hardware_concurrency()) {
+        // The calling thread takes part in every job
+        thread_count = std::max(thread_count, 1u) - 1;
+        for (uint32_t i = 0; i < thread_count; ++i) {
+            this->threads.emplace_back([this] { this->worker(); });
+        }
+    }
+
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    ThreadPool(ThreadPool &&) = delete;
+    ThreadPool &operator=(ThreadPool &&) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->stopping = true;
+        }
+        this->work_ready.notify_all();
+        for (auto &thread : this->threads) {
+            thread.join();
+        }
+    }
+
+    inline uint32_t thread_count() const {
+        return this->threads.size() + 1;
+    }
+
+    // Calls `fn(i)` for every i in [0, count) and returns once all calls finished.
+    // Calls run in no particular order. The first exception thrown by `fn` is
+    // rethrown here after the remaining calls are done.
+    void parallel_for(size_t count, const std::function<void(size_t)> &fn) {
+        if (count == 0) return;
+
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->job = &fn;
+            this->job_size = count;
+            this->job_generation++;
+            this->next_index = 0;
+            this->busy_threads = this->threads.size();
+            this->job_error = nullptr;
+        }
+        this->work_ready.notify_all();
+
+        this->run_job(fn, count);
+
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->work_done.wait(lock, [this] { return this->busy_threads == 0; });
+        this->job = nullptr;
+
+        if (this->job_error) {
+            std::rethrow_exception(this->job_error);
+        }
+    }
+
+  private:
+    void run_job(const std::function<void(size_t)> &fn, size_t count) {
+        for (size_t i = this->next_index++; i < count; i = this->next_index++) {
+            try {
+                fn(i);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                if (!this->job_error) {
+                    this->job_error = std::current_exception();
+                }
+            }
+        }
+    }
+
+    void worker() {
+        uint64_t seen_generation = 0;
+        while (true) {
+            const std::function<void(size_t)> *fn;
+            size_t count;
+            {
+                std::unique_lock<std::mutex> lock(this->mutex);
+                this->work_ready.wait(lock, [&] {
+                    return this->stopping || this->job_generation != seen_generation;
+                });
+                if (this->stopping) return;
+
+                seen_generation = this->job_generation;
+                fn = this->job;
+                count = this->job_size;
+            }
+
+            this->run_job(*fn, count);
+
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                this->busy_threads--;
+            }
+            this->work_done.notify_one();
+        }
+    }
+};
+
+} // namespace raytracer
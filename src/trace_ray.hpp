@@ -1,52 +1,210 @@
 #pragma once
 
+#include <limits>
 #include <sycl/sycl.hpp>
 #include <embree4/rtcore.h>
 
 #include "render.hpp"
-#include "xorshift.hpp"
+#include "lights.hpp"
+#include "guiding.hpp"
+#include "radiance_cache.hpp"
+#include "rng.hpp"
 
 namespace raytracer {
 
-static inline std::optional<sycl::float3> trace_ray(
-    const RenderContext &ctx,
-    XorShift32State &rng,
-    RTCRay &ray,
-    sycl::float3 &attenuation,
-    sycl::float3 &radiance
-) {
+// Maximum number of pending paths a single camera ray can be split into.
+constexpr uint32_t MAX_SPLIT_PATHS = 4;
+
+// Russian roulette never keeps a path with a probability higher than this, so even
+// bright paths eventually terminate.
+constexpr float ROULETTE_MAX_SURVIVAL = 0.95f;
+
+struct SurfaceHit {
+    sycl::float3 position;
+    sycl::float3 normal;
+    // Normal of the triangle itself, unlike `normal` not interpolated from the vertices
+    sycl::float3 geometric_normal;
+    sycl::float3 dir;
+    sycl::float2 uv;
+    const Material *material;
+};
+
+// Material dispatch policies. DynamicDispatch switches on the material type of each
+// hit, StaticDispatch<Type> is used when every hit is known to have material `Type`.
+struct DynamicDispatch {
+    template <typename Context>
+    static inline bool scatter(
+        const Material &material,
+        const Context &ctx,
+        Rng &rng,
+        const SurfaceHit &surface,
+        ScatterResult &result
+    ) {
+        return material.scatter(
+            ctx, rng, surface.dir, surface.normal, surface.uv, result
+        );
+    }
+
+    template <typename Context>
+    static inline BsdfEval eval(
+        const Material &material,
+        const Context &ctx,
+        const SurfaceHit &surface,
+        const sycl::float3 &wi
+    ) {
+        return material.eval(ctx, surface.dir, surface.normal, surface.uv, wi);
+    }
+
+    static inline bool samples_lights(const Material &material) {
+        return material.samples_lights();
+    }
+
+    static inline sycl::float3 emitted(const Material &material) {
+        return material.emitted();
+    }
+};
+
+template <MaterialType Type> struct StaticDispatch {
+    template <typename Context>
+    static inline bool scatter(
+        const Material &material,
+        const Context &ctx,
+        Rng &rng,
+        const SurfaceHit &surface,
+        ScatterResult &result
+    ) {
+        return material.scatter_as<Type>(
+            ctx, rng, surface.dir, surface.normal, surface.uv, result
+        );
+    }
+
+    template <typename Context>
+    static inline BsdfEval eval(
+        const Material &material,
+        const Context &ctx,
+        const SurfaceHit &surface,
+        const sycl::float3 &wi
+    ) {
+        return material.eval_as<Type>(
+            ctx, surface.dir, surface.normal, surface.uv, wi
+        );
+    }
+
+    static inline bool samples_lights(const Material &material) {
+        return material.samples_lights_as<Type>();
+    }
+
+    static inline sycl::float3 emitted(const Material &material) {
+        return material.emitted_as<Type>();
+    }
+};
+
+struct PathState {
+    RTCRay ray;
+    sycl::float3 attenuation;
+    sycl::float3 radiance;
+    uint32_t depth;
+    // Key of the random numbers of the path, see Rng
+    uint32_t rng_key;
+    // Density the BSDF picked the direction of `ray` with, 0 for camera rays and
+    // BSDFs without a density. Weighs the emission the ray hits against light sampling.
+    float bsdf_pdf;
+    // Radiance cache cell the path records into and its throughput when it reached
+    // the cell. While recording, `radiance` only holds what was gathered since.
+    uint32_t cache_cell = RADIANCE_CACHE_NO_CELL;
+    sycl::float3 cache_throughput = sycl::float3(0.0f);
+    // Guiding bin the path records into (see add_guiding_sample), and its throughput
+    // times the density of its direction when it left the hit of the bin's cell
+    uint32_t guide_bin = GUIDING_NO_BIN;
+    sycl::float3 guide_throughput = sycl::float3(0.0f);
+};
+
+// Occlusion ray towards a point sampled on a light. `contribution` is added to the
+// color of the sample when nothing blocks `ray`, and is 0 when there is no ray.
+struct ShadowRay {
+    RTCRay ray;
+    sycl::float3 contribution;
+    // Radiance cache cell of the path and `contribution` relative to it, added to the
+    // cell when the light is visible
+    uint32_t cache_cell = RADIANCE_CACHE_NO_CELL;
+    sycl::float3 cache_radiance = sycl::float3(0.0f);
+    // Same for the guiding bin of the path
+    uint32_t guide_bin = GUIDING_NO_BIN;
+    sycl::float3 guide_radiance = sycl::float3(0.0f);
+};
+
+// Query flags of a ray at `depth`: camera rays are coherent, bounce rays are not.
+static inline RTCRayQueryFlags ray_query_flags(uint32_t depth) {
+    return depth == 0 ? RTC_RAY_QUERY_FLAG_COHERENT : RTC_RAY_QUERY_FLAG_INCOHERENT;
+}
+
+// Traverses only the geometry features of the scene, see SceneFeatures::traversal.
+template <typename Context>
+static inline RTCRayHit
+intersect_ray(const Context &ctx, const RTCRay &ray, RTCRayQueryFlags flags) {
+    RTCIntersectArguments args;
+    rtcInitIntersectArguments(&args);
+    args.flags = flags;
+    args.feature_mask = ctx.features.traversal;
+
     RTCRayHit rayhit;
     rayhit.ray = ray;
     rayhit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
     rayhit.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
-    rtcIntersect1(ctx.scene, &rayhit);
+    rtcIntersect1(ctx.scene, &rayhit, &args);
+    return rayhit;
+}
 
-    // If not hit, return sky color
-    if (rayhit.hit.geomID == RTC_INVALID_GEOMETRY_ID) {
-        return attenuation * (ctx.sky_color + radiance);
-    }
+struct HitShadingData {
+    const InstanceData *instance;
+    const PrimitiveData *primitive;
+};
 
-    GeometryData *user_data =
-        (GeometryData *)rtcGetGeometryUserDataFromScene(ctx.scene, rayhit.hit.instID[0]);
+// Shading data of a hit. The top-level geometry (the instance, or the triangles
+// themselves when flattened into the top-level scene) selects the InstanceData. Inside
+// an instance the geometry id is the index of the primitive in its mesh.
+static inline HitShadingData
+hit_shading_data(const ShadingTables &tables, uint32_t inst_id, uint32_t geom_id) {
+    bool instanced = inst_id != RTC_INVALID_GEOMETRY_ID;
+    const InstanceData *instance = &tables.instances[instanced ? inst_id : geom_id];
+    return HitShadingData{
+        .instance = instance,
+        .primitive =
+            &tables.primitives[instance->first_primitive + (instanced ? geom_id : 0)],
+    };
+}
+
+// Fetches the interpolated shading attributes of a hit. `rayhit` must have hit
+// something.
+template <typename Context>
+static inline SurfaceHit get_surface_hit(const Context &ctx, const RTCRayHit &rayhit) {
+    HitShadingData data =
+        hit_shading_data(ctx.tables, rayhit.hit.instID[0], rayhit.hit.geomID);
+    const PrimitiveData *prim = data.primitive;
 
     glm::vec2 bary = {rayhit.hit.u, rayhit.hit.v};
 
-    const uint32_t *prim_indices = &user_data->index_buffer[rayhit.hit.primID * 3];
-    std::array<glm::vec3, 3> vertex_normals = {
-        user_data->normal_buffer[prim_indices[0]],
-        user_data->normal_buffer[prim_indices[1]],
-        user_data->normal_buffer[prim_indices[2]],
-    };
+    const uint32_t *prim_indices = &prim->index_buffer[rayhit.hit.primID * 3];
+    std::array<glm::vec3, 3> vertex_normals;
+    std::array<sycl::float2, 3> vertex_uvs;
+    if (prim->compact_vertex_buffer) {
+        for (int i = 0; i < 3; ++i) {
+            const CompactVertex vertex = prim->compact_vertex_buffer[prim_indices[i]];
+            vertex_normals[i] = decode_octahedral(vertex.normal);
+            vertex_uvs[i] = sycl::float2(vertex.uv[0], vertex.uv[1]);
+        }
+    } else {
+        for (int i = 0; i < 3; ++i) {
+            vertex_normals[i] = prim->normal_buffer[prim_indices[i]];
+            vertex_uvs[i] = prim->uv_buffer[prim_indices[i]];
+        }
+    }
 
-    std::array<sycl::float2, 3> vertex_uvs = {
-        user_data->uv_buffer[prim_indices[0]],
-        user_data->uv_buffer[prim_indices[1]],
-        user_data->uv_buffer[prim_indices[2]],
-    };
+    SurfaceHit surface;
 
     // Calculate UVs
-    sycl::float2 vertex_uv = (1 - bary.x - bary.y) * vertex_uvs[0] +
-                             bary.x * vertex_uvs[1] + bary.y * vertex_uvs[2];
+    surface.uv = (1 - bary.x - bary.y) * vertex_uvs[0] + bary.x * vertex_uvs[1] +
+                 bary.y * vertex_uvs[2];
 
     // Calculate normals
     glm::vec3 vertex_normal = glm::normalize(
@@ -54,31 +212,585 @@ static inline std::optional<sycl::float3> trace_ray(
         bary.y * vertex_normals[2]
     );
 
-    glm::vec3 g_normal = user_data->obj_to_world * vertex_normal;
-    const sycl::float3 normal =
-        normalize(sycl::float3(g_normal.x, g_normal.y, g_normal.z));
+    glm::vec3 g_normal = data.instance->obj_to_world * vertex_normal;
+    surface.normal = normalize(sycl::float3(g_normal.x, g_normal.y, g_normal.z));
 
-    const sycl::float3 dir =
+    // Embree reports Ng in the space of the hit geometry. Flattened triangles were
+    // baked into world space, only instanced ones need the transform.
+    glm::vec3 hit_normal = glm::vec3(rayhit.hit.Ng_x, rayhit.hit.Ng_y, rayhit.hit.Ng_z);
+    if (rayhit.hit.instID[0] != RTC_INVALID_GEOMETRY_ID) {
+        hit_normal = data.instance->obj_to_world * hit_normal;
+    }
+    surface.geometric_normal =
+        normalize(sycl::float3(hit_normal.x, hit_normal.y, hit_normal.z));
+
+    surface.dir =
         normalize(sycl::float3(rayhit.ray.dir_x, rayhit.ray.dir_y, rayhit.ray.dir_z));
 
-    radiance += user_data->material.emitted();
+    surface.position = sycl::float3(
+        rayhit.ray.org_x + rayhit.ray.dir_x * rayhit.ray.tfar,
+        rayhit.ray.org_y + rayhit.ray.dir_y * rayhit.ray.tfar,
+        rayhit.ray.org_z + rayhit.ray.dir_z * rayhit.ray.tfar
+    );
 
-    ScatterResult result;
-    if (user_data->material.scatter(ctx, rng, dir, normal, vertex_uv, result)) {
-        ray.org_x = rayhit.ray.org_x + rayhit.ray.dir_x * rayhit.ray.tfar;
-        ray.org_z = rayhit.ray.org_z + rayhit.ray.dir_z * rayhit.ray.tfar;
-        ray.org_y = rayhit.ray.org_y + rayhit.ray.dir_y * rayhit.ray.tfar;
+    surface.material = &ctx.tables.materials[prim->material_index];
+
+    return surface;
+}
+
+// Whether hits sample lights explicitly, see sample_direct_light.
+template <typename Context>
+static inline bool
+uses_light_sampling(const Context &ctx, const RenderSettings &settings) {
+    return settings.next_event_estimation &&
+           (ctx.lights.count > 0 || ctx.environment.texels != nullptr);
+}
 
-        ray.dir_x = result.dir.x();
-        ray.dir_y = result.dir.y();
-        ray.dir_z = result.dir.z();
+// Probability of sample_direct_light sampling the environment map instead of the
+// light table.
+template <typename Context>
+static inline float environment_sampling_probability(const Context &ctx) {
+    if (!ctx.environment.texels) return 0.0f;
+    return ctx.lights.count > 0 ? 0.5f : 1.0f;
+}
+
+// Samples a point on a light or a direction of the environment map and, if the BSDF
+// at `surface` scatters towards it, sets `shadow` to the occlusion ray and the
+// contribution of the light weighted by MIS against BSDF sampling, mixed with the
+// guiding distribution of `guide` if the hit is guided.
+template <typename Dispatch = DynamicDispatch, typename Context>
+static inline void sample_direct_light(
+    const Context &ctx,
+    Rng &rng,
+    const SurfaceHit &surface,
+    const GuidingLookup &guide,
+    const RTCRay &ray,
+    const sycl::float3 &throughput,
+    ShadowRay &shadow
+) {
+    float env_probability = environment_sampling_probability(ctx);
 
-        attenuation = attenuation * result.attenuation;
+    sycl::float3 wi;
+    sycl::float3 radiance;
+    float light_pdf;
+    float tfar;
+    if (env_probability > 0.0f && rng() < env_probability) {
+        EnvironmentSample env = sample_environment(ctx.environment, rng);
+        wi = env.direction;
+        radiance = env.radiance;
+        light_pdf = env_probability * env.pdf;
+        tfar = std::numeric_limits<float>::infinity();
     } else {
-        return attenuation * radiance;
+        LightSample light = sample_light(ctx.lights, rng);
+
+        sycl::float3 to_light = light.position - surface.position;
+        float distance = sycl::length(to_light);
+        if (distance <= 0.0f) return;
+        wi = to_light / distance;
+
+        // Emitters are two-sided, like the emission added when a ray hits them
+        float cos_light = sycl::fabs(dot(wi, light.normal));
+        radiance = light.emission;
+        light_pdf = (1.0f - env_probability) *
+                    area_to_solid_angle(light.pdf_area, distance, cos_light);
+        // Stop short of the light itself
+        tfar = distance * 0.999f;
+    }
+    if (light_pdf <= 0.0f) return;
+
+    BsdfEval bsdf = Dispatch::eval(*surface.material, ctx, surface, wi);
+    if (max_component(bsdf.value) <= 0.0f) return;
+    bsdf.pdf = guided_pdf(ctx.guiding, guide, bsdf.pdf, wi);
+
+    shadow.ray = ray;
+    shadow.ray.org_x = surface.position.x();
+    shadow.ray.org_y = surface.position.y();
+    shadow.ray.org_z = surface.position.z();
+    shadow.ray.dir_x = wi.x();
+    shadow.ray.dir_y = wi.y();
+    shadow.ray.dir_z = wi.z();
+    shadow.ray.tfar = tfar;
+    shadow.contribution = throughput * bsdf.value * radiance *
+                          (mis_weight(light_pdf, bsdf.pdf) / light_pdf);
+}
+
+// MIS weight of the emission `rayhit` found on `surface`, against the chance that
+// light sampling at the previous hit of `path` picked the same point.
+template <typename Context>
+static inline float emission_weight(
+    const Context &ctx,
+    const RenderSettings &settings,
+    const PathState &path,
+    const RTCRayHit &rayhit,
+    const SurfaceHit &surface,
+    const sycl::float3 &emission
+) {
+    if (path.bsdf_pdf <= 0.0f || !uses_light_sampling(ctx, settings)) {
+        return 1.0f;
+    }
+
+    sycl::float3 dir = sycl::float3(rayhit.ray.dir_x, rayhit.ray.dir_y, rayhit.ray.dir_z);
+    float distance = rayhit.ray.tfar * sycl::length(dir);
+    // sample_light uses the normal of the triangle, so the densities have to as well
+    float cos_light = sycl::fabs(dot(surface.dir, surface.geometric_normal));
+    float light_pdf = (1.0f - environment_sampling_probability(ctx)) *
+                      area_to_solid_angle(
+                          light_pdf_area(ctx.lights, emission), distance, cos_light
+                      );
+    return mis_weight(path.bsdf_pdf, light_pdf);
+}
+
+// MIS weight of the environment radiance seen by the ray of `path` escaping in
+// direction `dir`, against the chance that light sampling picked the same direction.
+template <typename Context>
+static inline float environment_weight(
+    const Context &ctx,
+    const RenderSettings &settings,
+    const PathState &path,
+    const sycl::float3 &dir
+) {
+    float env_probability = environment_sampling_probability(ctx);
+    if (path.bsdf_pdf <= 0.0f || env_probability <= 0.0f ||
+        !uses_light_sampling(ctx, settings)) {
+        return 1.0f;
+    }
+    float light_pdf = env_probability * environment_pdf(ctx.environment, dir);
+    return mis_weight(path.bsdf_pdf, light_pdf);
+}
+
+// Traces `shadow` and returns its contribution if the light is visible.
+template <typename Context>
+static inline sycl::float3
+trace_shadow_ray(const Context &ctx, const ShadowRay &shadow, uint32_t &ray_count) {
+    if (max_component(shadow.contribution) <= 0.0f) {
+        return sycl::float3(0.0f);
+    }
+    ray_count++;
+
+    RTCOccludedArguments args;
+    rtcInitOccludedArguments(&args);
+    args.flags = RTC_RAY_QUERY_FLAG_INCOHERENT;
+    args.feature_mask = ctx.features.traversal;
+
+    RTCRay ray = shadow.ray;
+    rtcOccluded1(ctx.scene, &ray, &args);
+    // Embree sets tfar to -inf when the ray is blocked
+    if (ray.tfar < 0.0f) {
+        return sycl::float3(0.0f);
+    }
+    if (shadow.cache_cell != RADIANCE_CACHE_NO_CELL) {
+        add_radiance_cache_sample(
+            ctx.radiance_cache, shadow.cache_cell, shadow.cache_radiance, 0
+        );
+    }
+    if (shadow.guide_bin != GUIDING_NO_BIN) {
+        add_guiding_sample(ctx.guiding, shadow.guide_bin, shadow.guide_radiance);
+    }
+    return shadow.contribution;
+}
+
+// Samples a bounce direction at `surface`. On success `ray` becomes the bounce ray,
+// `attenuation` is multiplied by the material's attenuation and `pdf` is the density
+// of the new direction. Guided hits pick the direction from the guiding distribution
+// of `guide` or from the BSDF, and weigh it by the density of the mixture of both.
+template <typename Dispatch = DynamicDispatch, typename Context>
+static inline bool scatter_surface(
+    const Context &ctx,
+    Rng &rng,
+    const SurfaceHit &surface,
+    const GuidingLookup &guide,
+    RTCRay &ray,
+    sycl::float3 &attenuation,
+    float &pdf
+) {
+    ScatterResult result;
+    if (guide.cdf && rng() < ctx.guiding.probability) {
+        GuidingSample sample = sample_guiding(guide.cdf, rng);
+        BsdfEval bsdf =
+            Dispatch::eval(*surface.material, ctx, surface, sample.direction);
+        if (max_component(bsdf.value) <= 0.0f) {
+            return false;
+        }
+        result.dir = sample.direction;
+        result.pdf = ctx.guiding.probability * sample.pdf +
+                     (1.0f - ctx.guiding.probability) * bsdf.pdf;
+        result.attenuation = bsdf.value / result.pdf;
+    } else {
+        if (!Dispatch::scatter(*surface.material, ctx, rng, surface, result)) {
+            return false;
+        }
+        if (guide.cdf) {
+            // The attenuation is the BSDF times the cosine over the BSDF's density
+            float mixture_pdf = guided_pdf(ctx.guiding, guide, result.pdf, result.dir);
+            result.attenuation *= result.pdf / mixture_pdf;
+            result.pdf = mixture_pdf;
+        }
+    }
+
+    ray.org_x = surface.position.x();
+    ray.org_y = surface.position.y();
+    ray.org_z = surface.position.z();
+
+    ray.dir_x = result.dir.x();
+    ray.dir_y = result.dir.y();
+    ray.dir_z = result.dir.z();
+
+    attenuation = attenuation * result.attenuation;
+    pdf = result.pdf;
+    return true;
+}
+
+// Guiding distribution of `surface`. Only diffuse hits are guided.
+template <typename Context>
+static inline GuidingLookup lookup_guiding(
+    const Context &ctx, const RenderSettings &settings, const SurfaceHit &surface
+) {
+    if (!uses_guiding(ctx, settings) ||
+        surface.material->type != MaterialType::eDiffuse) {
+        return GuidingLookup{};
+    }
+    return find_guiding_cell(
+        ctx.guiding, surface.position, face_forward(surface.normal, surface.dir)
+    );
+}
+
+// Shades the already intersected ray of `path`. Emission is weighted by the
+// throughput of the path at the hit, and lights are sampled into `shadow`. On scatter,
+// the ray of `path` is updated in place with the bounce ray and an empty optional is
+// returned. When the path ends, its final color is returned.
+template <typename Dispatch = DynamicDispatch, typename Context>
+static inline std::optional<sycl::float3> shade_hit(
+    const Context &ctx,
+    const RenderSettings &settings,
+    Rng &rng,
+    const RTCRayHit &rayhit,
+    PathState &path,
+    ShadowRay &shadow,
+    SurfaceHit *out_surface = nullptr,
+    GuidingLookup *out_guide = nullptr
+) {
+    // If not hit, return the environment radiance
+    if (rayhit.hit.geomID == RTC_INVALID_GEOMETRY_ID) {
+        sycl::float3 dir = normalize(
+            sycl::float3(rayhit.ray.dir_x, rayhit.ray.dir_y, rayhit.ray.dir_z)
+        );
+        return path.radiance + path.attenuation *
+                                   environment_radiance(ctx.environment, dir) *
+                                   environment_weight(ctx, settings, path, dir);
+    }
+
+    SurfaceHit surface = get_surface_hit(ctx, rayhit);
+    if (out_surface) {
+        *out_surface = surface;
+    }
+
+    sycl::float3 emission = Dispatch::emitted(*surface.material);
+    if (max_component(emission) > 0.0f) {
+        path.radiance += path.attenuation * emission *
+                         emission_weight(ctx, settings, path, rayhit, surface, emission);
+    }
+
+    GuidingLookup guide = lookup_guiding(ctx, settings, surface);
+    if (out_guide) {
+        *out_guide = guide;
+    }
+
+    // The last hit of a path traces no bounce ray, so its light sample would be
+    // weighted against BSDF samples that are never taken. Leaving it out ends paths at
+    // the same depth with and without light sampling.
+    if (Dispatch::samples_lights(*surface.material) &&
+        uses_light_sampling(ctx, settings) && path.depth + 1 < settings.max_depth) {
+        sample_direct_light<Dispatch>(
+            ctx, rng, surface, guide, path.ray, path.attenuation, shadow
+        );
+    }
+
+    if (!scatter_surface<Dispatch>(
+            ctx, rng, surface, guide, path.ray, path.attenuation, path.bsdf_pdf
+        )) {
+        return path.radiance;
     }
 
     return {};
 }
 
+// Returns the factor the throughput of a path has to be scaled by before tracing its
+// ray at `depth`, or 0 if the path was terminated by russian roulette.
+static inline float russian_roulette(
+    const RenderSettings &settings,
+    uint32_t depth,
+    Rng &rng,
+    const sycl::float3 &attenuation
+) {
+    if (settings.roulette_min_depth == 0 || depth < settings.roulette_min_depth) {
+        return 1.0f;
+    }
+
+    float survival = sycl::fmin(max_component(attenuation), ROULETTE_MAX_SURVIVAL);
+    if (rng() >= survival) {
+        return 0.0f;
+    }
+    return 1.0f / survival;
+}
+
+// Random numbers of the path with `key` that `ray` belongs to, at `bounce`.
+template <typename Context>
+static inline Rng path_rng(
+    const Context &ctx,
+    const RenderSettings &settings,
+    const RTCRay &ray,
+    uint32_t key,
+    uint32_t bounce
+) {
+    sycl::int2 pixel = ctx.camera.image_pixel(ctx.camera.ray_pixel(ray.id));
+    return Rng::at(settings.sample_sequence, pixel, key, bounce);
+}
+
+// Adds `radiance`, gathered by `path`, to `color` and to the radiance cache cell and
+// the guiding bin the path records into.
+template <typename Context>
+static inline void add_path_radiance(
+    const Context &ctx,
+    const PathState &path,
+    const sycl::float3 &radiance,
+    sycl::float3 &color
+) {
+    color += radiance;
+    if (path.cache_cell != RADIANCE_CACHE_NO_CELL) {
+        add_radiance_cache_sample(
+            ctx.radiance_cache,
+            path.cache_cell,
+            radiance_cache_sample(radiance, path.cache_throughput),
+            0
+        );
+    }
+    if (path.guide_bin != GUIDING_NO_BIN) {
+        add_guiding_sample(
+            ctx.guiding,
+            path.guide_bin,
+            radiance_cache_sample(radiance, path.guide_throughput)
+        );
+    }
+}
+
+// Makes `path`, which just scattered at a hit in guiding cell `cell`, record into the
+// bin of its new direction. What it gathered before moves to `color`.
+template <typename Context>
+static inline void start_guiding_record(
+    const Context &ctx, uint32_t cell, PathState &path, sycl::float3 &color
+) {
+    add_path_radiance(ctx, path, path.radiance, color);
+    path.radiance = sycl::float3(0.0f);
+
+    sycl::float3 dir = sycl::float3(path.ray.dir_x, path.ray.dir_y, path.ray.dir_z);
+    path.guide_bin = cell * GUIDING_BINS + guiding_bin(dir);
+    path.guide_throughput = path.attenuation * path.bsdf_pdf;
+    add_guiding_path(ctx.guiding, cell);
+}
+
+// Looks up the radiance cache cell of `surface`, a diffuse hit of `path`, which had
+// `throughput` before the hit was shaded. Returns true if the cell has enough samples,
+// in which case the path ends with the cached radiance, added to `color`. Otherwise
+// the path starts recording into the cell: what it gathered so far moves to `color`.
+template <typename Context>
+static inline bool enter_radiance_cache(
+    const Context &ctx,
+    const SurfaceHit &surface,
+    const sycl::float3 &throughput,
+    PathState &path,
+    ShadowRay &shadow,
+    sycl::float3 &color
+) {
+    const RadianceCache &cache = ctx.radiance_cache;
+    uint32_t cell = find_radiance_cache_cell(
+        cache, surface.position, face_forward(surface.normal, surface.dir)
+    );
+    if (cell == RADIANCE_CACHE_NO_CELL) {
+        return false;
+    }
+
+    sycl::float3 cached;
+    if (read_radiance_cache(cache, cell, cached)) {
+        // The light sample of the hit is part of the cached radiance
+        shadow.contribution = sycl::float3(0.0f);
+        add_path_radiance(ctx, path, path.radiance + throughput * cached, color);
+        return true;
+    }
+
+    add_path_radiance(ctx, path, path.radiance, color);
+    path.radiance = sycl::float3(0.0f);
+    path.cache_cell = cell;
+    path.cache_throughput = throughput;
+    add_radiance_cache_sample(cache, cell, sycl::float3(0.0f), 1);
+    return false;
+}
+
+// Split reservation of advance_path for callers that always have room for a split.
+struct AlwaysSplit {
+    bool operator()() const {
+        return true;
+    }
+};
+
+// Shades the hit of `path` and decides whether the path continues, applying the
+// radiance cache, russian roulette and splitting. Returns the number of paths that
+// continue: 0 when the path ended (its contribution is added to `color`), 1 when
+// `path` holds the next ray, and 2 when `path` was also split into `split`. Splitting
+// only happens if `split` is not null. Paths recording into the radiance cache or
+// the guiding field may also add to `color` before they end. Whatever the result,
+// `shadow` holds the light sample of the hit, whose contribution the caller adds if it
+// is visible.
+// `on_roulette(depth)` is called for every path terminated by roulette, and
+// `reserve_split()` before a path is split. The path is not split if it returns false.
+template <
+    typename Dispatch = DynamicDispatch,
+    typename Context,
+    typename OnRoulette,
+    typename ReserveSplit = AlwaysSplit>
+static inline uint32_t advance_path(
+    const Context &ctx,
+    const RenderSettings &settings,
+    const RTCRayHit &rayhit,
+    PathState &path,
+    PathState *split,
+    ShadowRay &shadow,
+    sycl::float3 &color,
+    OnRoulette on_roulette,
+    ReserveSplit reserve_split = {}
+) {
+    const sycl::float3 throughput = path.attenuation;
+    const uint32_t bounce = path.depth + 1;
+    Rng rng = path_rng(ctx, settings, path.ray, path.rng_key, bounce);
+    shadow = ShadowRay{.ray = path.ray, .contribution = sycl::float3(0.0f)};
+
+    SurfaceHit surface;
+    GuidingLookup guide;
+    auto res = shade_hit<Dispatch>(
+        ctx, settings, rng, rayhit, path, shadow, &surface, &guide
+    );
+    if (res) {
+        add_path_radiance(ctx, path, *res, color);
+        return 0;
+    }
+
+    if (uses_radiance_cache(ctx, settings) && bounce >= settings.radiance_cache_depth &&
+        path.cache_cell == RADIANCE_CACHE_NO_CELL &&
+        surface.material->type == MaterialType::eDiffuse &&
+        enter_radiance_cache(ctx, surface, throughput, path, shadow, color)) {
+        return 0;
+    }
+    if (path.cache_cell != RADIANCE_CACHE_NO_CELL) {
+        shadow.cache_cell = path.cache_cell;
+        shadow.cache_radiance =
+            radiance_cache_sample(shadow.contribution, path.cache_throughput);
+    }
+    // The light sample of the hit belongs to the bin the path recorded into until now
+    if (path.guide_bin != GUIDING_NO_BIN) {
+        shadow.guide_bin = path.guide_bin;
+        shadow.guide_radiance =
+            radiance_cache_sample(shadow.contribution, path.guide_throughput);
+    }
+
+    path.depth++;
+    if (path.depth >= settings.max_depth) {
+        add_path_radiance(ctx, path, path.radiance, color);
+        return 0;
+    }
+
+    if (guide.cell != RADIANCE_CACHE_NO_CELL) {
+        start_guiding_record(ctx, guide.cell, path, color);
+    }
+
+    float weight = russian_roulette(settings, path.depth, rng, path.attenuation);
+    if (weight == 0.0f) {
+        on_roulette(path.depth);
+        add_path_radiance(ctx, path, path.radiance, color);
+        return 0;
+    }
+    path.attenuation *= weight;
+
+    uint32_t path_count = 1;
+    if (split && settings.split_threshold > 0.0f &&
+        max_component(path.attenuation) > settings.split_threshold && reserve_split()) {
+        // Both halves carry half of the throughput. Radiance gathered so far stays
+        // with the original path so it is only counted once.
+        path.attenuation *= 0.5f;
+
+        *split = PathState{
+            .ray = path.ray,
+            .attenuation = throughput * weight * 0.5f,
+            .radiance = sycl::float3(0.0f),
+            .depth = path.depth,
+            .rng_key = Rng::split_key(path.rng_key, bounce),
+            .bsdf_pdf = 0.0f,
+            .cache_cell = path.cache_cell,
+            .cache_throughput = path.cache_throughput,
+            .guide_bin = path.guide_bin,
+            .guide_throughput = path.guide_throughput,
+        };
+        Rng split_rng = path_rng(ctx, settings, split->ray, split->rng_key, bounce);
+        if (scatter_surface<Dispatch>(
+                ctx,
+                split_rng,
+                surface,
+                guide,
+                split->ray,
+                split->attenuation,
+                split->bsdf_pdf
+            )) {
+            path_count = 2;
+            // The split left the hit in a direction of its own
+            if (guide.cell != RADIANCE_CACHE_NO_CELL) {
+                start_guiding_record(ctx, guide.cell, *split, color);
+            }
+        }
+    }
+
+    if (path.cache_cell != RADIANCE_CACHE_NO_CELL) {
+        add_radiance_cache_rays(ctx.radiance_cache, path.cache_cell, path_count);
+    }
+    return path_count;
+}
+
+// Traces `initial` and every path split from it until they all end and returns the
+// sum of their contributions, including the visible light samples.
+template <typename Context, typename OnRoulette>
+static inline sycl::float3 trace_path(
+    const Context &ctx,
+    const RenderSettings &settings,
+    const PathState &initial,
+    uint32_t &ray_count,
+    OnRoulette on_roulette
+) {
+    PathState stack[MAX_SPLIT_PATHS];
+    uint32_t stack_size = 0;
+    stack[stack_size++] = initial;
+
+    sycl::float3 color = sycl::float3(0.0f);
+    while (stack_size > 0) {
+        PathState path = stack[--stack_size];
+
+        uint32_t path_count = 1;
+        while (path_count > 0) {
+            ray_count++;
+
+            RTCRayHit rayhit =
+                intersect_ray(ctx, path.ray, ray_query_flags(path.depth));
+
+            PathState *split =
+                stack_size < MAX_SPLIT_PATHS ? &stack[stack_size] : nullptr;
+            ShadowRay shadow;
+            path_count = advance_path(
+                ctx, settings, rayhit, path, split, shadow, color, on_roulette
+            );
+            color += trace_shadow_ray(ctx, shadow, ray_count);
+            if (path_count == 2) {
+                stack_size++;
+            }
+        }
+    }
+
+    return color;
+}
+
 } // namespace raytracer
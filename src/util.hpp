@@ -1,12 +1,15 @@
 #pragma once
 
 #include <sycl/sycl.hpp>
+#include <cstdio>
+#include <vector>
 #include "stb_image_write.h"
 
 namespace raytracer {
 
-static void
-write_image(sycl::queue &q, sycl::image<2> &image, size_t width, size_t height) {
+// Reads the RGBA8 contents of `image` back to the host, row by row.
+static std::vector<uint8_t>
+read_image(sycl::queue &q, sycl::image<2> &image, size_t width, size_t height) {
     uint8_t *transfer_buf = sycl::malloc_shared<uint8_t>(width * height * 4, q);
     sycl::range<2> img_size = sycl::range<2>(width, height);
 
@@ -24,14 +27,80 @@ write_image(sycl::queue &q, sycl::image<2> &image, size_t width, size_t height)
     });
     q.wait_and_throw();
 
-    if (!stbi_write_png("out.png", width, height, 4, transfer_buf, width * 4)) {
+    std::vector<uint8_t> pixels(transfer_buf, transfer_buf + width * height * 4);
+    sycl::free(transfer_buf, q);
+    return pixels;
+}
+
+static void
+write_image(sycl::queue &q, sycl::image<2> &image, size_t width, size_t height) {
+    std::vector<uint8_t> pixels = read_image(q, image, width, height);
+
+    if (!stbi_write_png("out.png", width, height, 4, pixels.data(), width * 4)) {
         std::cout << "Failed to write image to disk." << std::endl;
         std::terminate();
     }
-
-    sycl::free(transfer_buf, q);
 }
 
+// Writes an image to a binary PPM file one tile at a time, so the whole image never
+// has to be in memory. The file is sized up front and every tile row is written at
+// its final offset.
+struct PpmTileWriter {
+    FILE *file = nullptr;
+    size_t width;
+    size_t height;
+    long header_size;
+
+    PpmTileWriter(const char *path, size_t width, size_t height)
+        : width(width), height(height) {
+        this->file = fopen(path, "wb");
+        if (!this->file) {
+            std::cout << "Failed to open " << path << " for writing." << std::endl;
+            std::terminate();
+        }
+
+        this->header_size = fprintf(this->file, "P6\n%zu %zu\n255\n", width, height);
+        if (width * height > 0) {
+            long file_size = this->header_size + (long)(width * height * 3);
+            fseek(this->file, file_size - 1, SEEK_SET);
+            fputc(0, this->file);
+        }
+    }
+
+    PpmTileWriter(const PpmTileWriter &) = delete;
+    PpmTileWriter &operator=(const PpmTileWriter &) = delete;
+
+    ~PpmTileWriter() {
+        if (this->file) fclose(this->file);
+    }
+
+    // Writes the `size` pixels at `origin` from RGBA8 `pixels`, whose rows are
+    // `stride` pixels apart. Alpha is dropped.
+    void write_tile(
+        sycl::range<2> origin,
+        sycl::range<2> size,
+        const uint8_t *pixels,
+        size_t stride
+    ) {
+        std::vector<uint8_t> row(size[0] * 3);
+        for (size_t y = 0; y < size[1]; ++y) {
+            const uint8_t *src = pixels + y * stride * 4;
+            for (size_t x = 0; x < size[0]; ++x) {
+                row[x * 3 + 0] = src[x * 4 + 0];
+                row[x * 3 + 1] = src[x * 4 + 1];
+                row[x * 3 + 2] = src[x * 4 + 2];
+            }
+
+            size_t offset = ((origin[1] + y) * this->width + origin[0]) * 3;
+            fseek(this->file, this->header_size + (long)offset, SEEK_SET);
+            if (fwrite(row.data(), 1, row.size(), this->file) != row.size()) {
+                std::cout << "Failed to write image to disk." << std::endl;
+                std::terminate();
+            }
+        }
+    }
+};
+
 /*
  * This function allocated USM memory that is writeable by the device.
  */
@@ -79,6 +148,8 @@ inline void alignedSYCLFree(const sycl::queue &queue, void *ptr) {
 
 // Vector utilities
 
+constexpr float PI = 3.14159265358979323846f;
+
 inline float linear_to_gamma(float linear_component) {
     return sycl::sqrt(linear_component);
 }
@@ -106,11 +177,53 @@ inline bool near_zero(sycl::float3 e) {
     return (sycl::fabs(e[0]) < s) && (sycl::fabs(e[1]) < s) && (sycl::fabs(e[2]) < s);
 }
 
+// Relative luminance of a linear Rec. 709 color.
+inline float luminance(const sycl::float3 &c) {
+    return 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2];
+}
+
+inline float max_component(const sycl::float3 &v) {
+    return sycl::fmax(v[0], sycl::fmax(v[1], v[2]));
+}
+
 inline float length_squared(const sycl::float3 &v) {
     float length = sycl::length(v);
     return length * length;
 }
 
+// Flips `normal` to the side of the surface that `dir` arrives from.
+inline sycl::float3 face_forward(const sycl::float3 &normal, const sycl::float3 &dir) {
+    return dot(dir, normal) < 0.0f ? normal : -normal;
+}
+
+// Orthonormal basis with `n` as the z axis.
+struct Frame {
+    sycl::float3 t;
+    sycl::float3 b;
+    sycl::float3 n;
+
+    // Branchless construction from Duff et al., "Building an Orthonormal Basis,
+    // Revisited". `n` must be normalized.
+    static inline Frame from_normal(const sycl::float3 &n) {
+        float sign = sycl::copysign(1.0f, n.z());
+        float a = -1.0f / (sign + n.z());
+        float b = n.x() * n.y() * a;
+        return Frame{
+            .t = sycl::float3(1.0f + sign * n.x() * n.x() * a, sign * b, -sign * n.x()),
+            .b = sycl::float3(b, sign + n.y() * n.y() * a, -n.y()),
+            .n = n,
+        };
+    }
+
+    inline sycl::float3 to_local(const sycl::float3 &v) const {
+        return sycl::float3(dot(v, this->t), dot(v, this->b), dot(v, this->n));
+    }
+
+    inline sycl::float3 to_world(const sycl::float3 &v) const {
+        return this->t * v.x() + this->b * v.y() + this->n * v.z();
+    }
+};
+
 inline sycl::float3 reflect(const sycl::float3 &v, const sycl::float3 &n) {
     return v - 2 * dot(v, n) * n;
 }